@@ -0,0 +1,77 @@
+﻿
+#include "Types/ECSFrameAllocator.h"
+
+#include <atomic>
+
+namespace
+{
+	std::atomic<uint32> FrameSerialCounter{ 1 };
+
+	struct FThreadFrameArena
+	{
+		struct FPage
+		{
+			uint8* Memory;
+			SIZE_T Size;
+		};
+
+		~FThreadFrameArena()
+		{
+			for (const FPage& Page : Pages)
+				FMemory::Free(Page.Memory);
+		}
+
+		TArray<FPage> Pages;
+		int32 PageIndex = 0;
+		SIZE_T Offset = 0;// Into Pages[PageIndex]
+		uint32 FrameSerial = 0;
+	};
+
+	thread_local FThreadFrameArena ThreadFrameArena;
+}
+
+void* FECSFrameArena::Allocate(const SIZE_T Size, const uint32 Alignment)
+{
+	checkf(Alignment <= PAGE_ALIGNMENT, TEXT("FECSFrameArena: Alignment %u exceeds the page alignment"), Alignment);
+
+	FThreadFrameArena& Arena = ThreadFrameArena;
+
+	// First allocation on this thread this frame. Everything allocated in previous frames is dead so rewind
+	const uint32 FrameSerial = GetFrameSerial();
+	if (Arena.FrameSerial != FrameSerial)
+	{
+		Arena.FrameSerial = FrameSerial;
+		Arena.PageIndex = 0;
+		Arena.Offset = 0;
+	}
+
+	while (Arena.PageIndex < Arena.Pages.Num())
+	{
+		const FThreadFrameArena::FPage& Page = Arena.Pages[Arena.PageIndex];
+		const SIZE_T Start = Align(Arena.Offset, Alignment);
+		if (Start + Size <= Page.Size)
+		{
+			Arena.Offset = Start + Size;
+			return Page.Memory + Start;
+		}
+
+		++Arena.PageIndex;
+		Arena.Offset = 0;
+	}
+
+	const SIZE_T PageSize = FMath::Max(PAGE_SIZE, Align(Size, PAGE_ALIGNMENT));
+	Arena.PageIndex = Arena.Pages.Add({ (uint8*)FMemory::Malloc(PageSize, PAGE_ALIGNMENT), PageSize });
+	Arena.Offset = Size;
+	return Arena.Pages[Arena.PageIndex].Memory;
+}
+
+void FECSFrameArena::AdvanceFrame()
+{
+	check(IsInGameThread());
+	FrameSerialCounter.fetch_add(1, std::memory_order_relaxed);
+}
+
+uint32 FECSFrameArena::GetFrameSerial()
+{
+	return FrameSerialCounter.load(std::memory_order_relaxed);
+}
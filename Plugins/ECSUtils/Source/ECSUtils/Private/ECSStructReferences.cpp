@@ -0,0 +1,103 @@
+﻿
+#include "Types/ECSStructReferences.h"
+
+namespace
+{
+	FRWLock StructReferencesLock;
+	TMap<const UScriptStruct*, TUniquePtr<FECSStructReferences>> StructReferences;// Boxed so references stay valid when the map grows
+}
+
+const FECSStructReferences& FECSStructReferences::Get(const UScriptStruct* Type)
+{
+	check(Type);
+
+	{
+		FReadScopeLock Lock(StructReferencesLock);
+		if (const TUniquePtr<FECSStructReferences>* Found = StructReferences.Find(Type))
+			return **Found;
+	}
+
+	FWriteScopeLock Lock(StructReferencesLock);
+	TUniquePtr<FECSStructReferences>& References = StructReferences.FindOrAdd(Type);
+	if (!References)
+	{
+		References.Reset(new FECSStructReferences(Type));
+	}
+
+	return *References;
+}
+
+void FECSStructReferences::Reset()
+{
+	check(IsInGameThread());
+
+	FWriteScopeLock Lock(StructReferencesLock);
+	StructReferences.Empty();
+}
+
+FECSStructReferences::FECSStructReferences(const UScriptStruct* Type)
+	: Type(Type), bNeedsPropertyWalk(false)
+{
+	const bool bHasNativeAdd = Type->StructFlags & STRUCT_AddStructReferencedObjects;
+	if (bHasNativeAdd)
+	{
+		NativeAdds.Add({ 0, Type->GetCppStructOps()->AddStructReferencedObjects() });
+	}
+
+	TArray<const FStructProperty*> EncounteredStructProps;
+	AddStructOffsets(Type, 0, EncounteredStructProps);
+
+	// The property walk reaches nested native structs itself
+	if (bNeedsPropertyWalk)
+	{
+		NativeAdds.SetNum(bHasNativeAdd ? 1 : 0);
+	}
+
+	bHasReferences = bNeedsPropertyWalk || !NativeAdds.IsEmpty() || !ObjectOffsets.IsEmpty();
+}
+
+void FECSStructReferences::AddReferencedObjectsByProperties(void* Item, FReferenceCollector& Collector) const
+{
+	for (TPropertyValueIterator<FProperty> It(Type, Item); It; ++It)
+	{
+		if (CastField<FObjectProperty>(It.Key()))
+		{
+			Collector.AddReferencedObject(*(UObject**)It.Value());
+		}
+		else if (const FStructProperty* StructProp = CastField<FStructProperty>(It.Key()))
+		{
+			if (StructProp->Struct->StructFlags & STRUCT_AddStructReferencedObjects)
+			{
+				StructProp->Struct->GetCppStructOps()->AddStructReferencedObjects()((void*)It.Value(), Collector);
+			}
+		}
+	}
+}
+
+void FECSStructReferences::AddStructOffsets(const UStruct* Struct, const int32 BaseOffset, TArray<const FStructProperty*>& EncounteredStructProps)
+{
+	for (TFieldIterator<FProperty> It(Struct); It; ++It)
+	{
+		for (int32 ArrayIndex = 0; ArrayIndex < It->ArrayDim; ++ArrayIndex)
+		{
+			const int32 Offset = BaseOffset + It->GetOffset_ForInternal() + ArrayIndex * It->ElementSize;
+			if (CastField<FObjectProperty>(*It))
+			{
+				ObjectOffsets.Add(Offset);
+			}
+			else if (const FStructProperty* StructProp = CastField<FStructProperty>(*It))
+			{
+				if (StructProp->Struct->StructFlags & STRUCT_AddStructReferencedObjects)
+				{
+					NativeAdds.Add({ Offset, StructProp->Struct->GetCppStructOps()->AddStructReferencedObjects() });
+				}
+
+				AddStructOffsets(StructProp->Struct, Offset, EncounteredStructProps);
+			}
+			else if (It->ContainsObjectReference(EncounteredStructProps))
+			{
+				bNeedsPropertyWalk = true;
+			}
+		}
+	}
+}
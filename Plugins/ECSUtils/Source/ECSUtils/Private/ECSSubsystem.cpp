@@ -2,17 +2,41 @@
 #include "ECSSubsystem.h"
 
 #include "Algo/Accumulate.h"
+#include "Engine/World.h"
+#include "Tasks/Task.h"
 #include "Types/AnyStructArray.h"
 #include "Types/Archetype.h"
 #include "Types/CompQuery.h"
+#include "Types/ECSCommandBuffer.h"
+#include "Types/ECSTypeRegistry.h"
 
 #define PRINT(Fmt, ...) GEngine->AddOnScreenDebugMessage(-1, 10.f, FColor::Purple, FString::Printf(TEXT(Fmt), ##__VA_ARGS__));
 
 UECSSubsystem::UECSSubsystem()
+	: CommandBuffersSerial(0)
 {
    
 }
 
+namespace
+{
+	// Last command buffer used by this thread. Avoids locking on every GetCommandBuffer call
+	struct FThreadCommandBuffer
+	{
+		uint32 Serial = 0;
+		FECSCommandBuffer* Buffer = nullptr;
+	};
+
+	thread_local FThreadCommandBuffer ThreadCommandBuffer;
+	FThreadSafeCounter CommandBuffersSerialCounter;
+
+	FThreadSafeCounter ArchetypeSlotCounter;
+}
+
+ECS_REGISTER_TYPE(FComp1)
+ECS_REGISTER_TYPE(FComp2)
+ECS_REGISTER_TYPE(FComp3)
+
 template<typename T>
 FString ToString(const FAnyStructArray& Arr)
 {
@@ -36,6 +60,11 @@ void UECSSubsystem::Initialize(FSubsystemCollectionBase& Collection)
 	
 	Super::Initialize(Collection);
 
+	CommandBuffersSerial = (uint32)CommandBuffersSerialCounter.Increment();
+
+	PreActorTickHandle = FWorldDelegates::OnWorldPreActorTick.AddUObject(this, &UECSSubsystem::OnWorldPreActorTick);
+	PostActorTickHandle = FWorldDelegates::OnWorldPostActorTick.AddUObject(this, &UECSSubsystem::OnWorldPostActorTick);
+
 	// Testing stuff
 	const FEntityID NewEntity = SpawnEntity<TCompTypes<FComp1, FComp2>>(FComp1(), FVector(999.f));
 	const FEntityID OtherNewEntity = SpawnEntity<TCompTypes<FComp2, FComp1>>(FVector(93802.f), FComp1());
@@ -52,34 +81,357 @@ void UECSSubsystem::Initialize(FSubsystemCollectionBase& Collection)
 
 void UECSSubsystem::Deinitialize()
 {
+	FWorldDelegates::OnWorldPreActorTick.Remove(PreActorTickHandle);
+	FWorldDelegates::OnWorldPostActorTick.Remove(PostActorTickHandle);
+
+	for (FECSSystemPhase& SystemPhase : SystemPhases)
+	{
+		SystemPhase.Systems.Empty();
+		SystemPhase.Prerequisites.Empty();
+	}
+
+	{
+		FScopeLock Lock(&CommandBuffersMutex);
+		for (const TPair<uint32, FECSCommandBuffer*>& Pair : CommandBuffers)
+			delete Pair.Value;
+
+		CommandBuffers.Empty();
+	}
+
+	ActiveSparseSets.Empty();
+	SparseSets.Empty();
+	
 	Super::Deinitialize();
 }
 
-void UECSSubsystem::RegisterComponentsAndTags()
+void UECSSubsystem::AddReferencedObjects(UObject* InThis, FReferenceCollector& Collector)
 {
-	for (TObjectIterator<UScriptStruct> It; It; ++It)
+	// Sparse sets aren't reflected so their values are reported manually
+	for (FECSSparseSet* SparseSet : CastChecked<UECSSubsystem>(InThis)->ActiveSparseSets)
+		SparseSet->AddReferencedObjects(Collector);
+
+	Super::AddReferencedObjects(InThis, Collector);
+}
+
+void UECSSubsystem::OnWorldPreActorTick(UWorld* World, ELevelTick TickType, float DeltaSeconds)
+{
+	if (World != GetWorld()) return;
+	RunSystems(EECSSystemPhase::PreActorTick, DeltaSeconds);
+}
+
+void UECSSubsystem::OnWorldPostActorTick(UWorld* World, ELevelTick TickType, float DeltaSeconds)
+{
+	if (World != GetWorld()) return;
+	RunSystems(EECSSystemPhase::PostActorTick, DeltaSeconds);
+}
+
+void UECSSubsystem::RunSystems(const EECSSystemPhase Phase, const float DeltaTime)
+{
+	check(IsInGameThread());
+	check(Phase < EECSSystemPhase::Num);
+
+	// Commands recorded outside of systems are flushed even if the phase has none
+	FECSSystemPhase& SystemPhase = SystemPhases[(int32)Phase];
+	if (!SystemPhase.Systems.IsEmpty())
 	{
-		if (*It == FECSCompBase::StaticStruct() || *It == FECSTagBase::StaticStruct()) continue;
-		if (It->IsChildOf(FECSCompBase::StaticStruct()))
+		if (SystemPhase.bGraphDirty)
 		{
-			RegisteredComponents.Emplace(*It);
+			SystemPhase.BuildGraph();
 		}
-		else if (It->IsChildOf(FECSTagBase::StaticStruct()))
+
+		// Launch every system with its conflicting predecessors as prerequisites
+		TArray<UE::Tasks::FTask> Tasks;
+		Tasks.Reserve(SystemPhase.Systems.Num());
+		for (int32 i = 0; i < SystemPhase.Systems.Num(); ++i)
+		{
+			TArray<UE::Tasks::FTask> Prerequisites;
+			Prerequisites.Reserve(SystemPhase.Prerequisites[i].Num());
+			for (const int32 PrerequisiteIndex : SystemPhase.Prerequisites[i])
+				Prerequisites.Add(Tasks[PrerequisiteIndex]);
+
+			FECSSystem* System = SystemPhase.Systems[i].Get();
+			Tasks.Add(UE::Tasks::Launch(TEXT("ECSSystem"), [System, DeltaTime]
+			{
+				System->Execute(DeltaTime);
+			}, Prerequisites));
+		}
+
+		UE::Tasks::Wait(Tasks);
+	}
+
+	FlushCommandBuffers();
+}
+
+FECSCommandBuffer& UECSSubsystem::GetCommandBuffer() const
+{
+	checkf(CommandBuffersSerial != 0, TEXT("Attempted to record commands before the subsystem was initialized"));
+
+	if (LIKELY(ThreadCommandBuffer.Serial == CommandBuffersSerial))
+		return *ThreadCommandBuffer.Buffer;
+
+	FECSCommandBuffer* Buffer;
+	{
+		FScopeLock Lock(&CommandBuffersMutex);
+		FECSCommandBuffer*& Existing = CommandBuffers.FindOrAdd(FPlatformTLS::GetCurrentThreadId(), nullptr);
+		if (!Existing)
 		{
-			RegisteredTags.Emplace(*It);
+			Existing = new FECSCommandBuffer(this, CommandBuffers.Num());
 		}
+
+		Buffer = Existing;
 	}
 
-	RegisteredComponents.Sort([](const FCompDescription& A, const FCompDescription& B)->bool
+	ThreadCommandBuffer.Serial = CommandBuffersSerial;
+	ThreadCommandBuffer.Buffer = Buffer;
+	return *Buffer;
+}
+
+void UECSSubsystem::FlushCommandBuffers()
+{
+	check(IsInGameThread());
+
+	using FCommand = FECSCommandBuffer::FCommand;
+	using ECommandType = FECSCommandBuffer::ECommandType;
+
+	struct FPendingSpawn
+	{
+		FArchetypeID ArchetypeID;
+		FCommand* Command;
+	};
+
+	TArray<FECSCommandBuffer*, TInlineAllocator<32>> Buffers;
+	{
+		FScopeLock Lock(&CommandBuffersMutex);
+		for (const TPair<uint32, FECSCommandBuffer*>& Pair : CommandBuffers)
+			if (!Pair.Value->IsEmpty())
+				Buffers.Add(Pair.Value);
+	}
+
+	if (Buffers.IsEmpty()) return;
+
+	const int32 NumCompsAndTags = RegisteredComponents.Num() + RegisteredTags.Num();
+	TBitArray<> Signature;
+	TArray<FPendingSpawn> PendingSpawns;
+
+	// Commands on entities spawned by the same buffer, paired with their spawn command. Applied once the spawns are inserted
+	struct FDeferredCommand
+	{
+		FCommand* Command;
+		FCommand* Spawn;
+	};
+
+	TArray<FDeferredCommand> DeferredCommands;
+	TArray<FCommand*> BufferSpawns;// Spawn commands of the buffer being played back. Index via placeholder spawn index
+
+	// Applies a change to an existing entity. Consumed payloads are relocated, skipped ones destroyed
+	const auto ApplyCommand = [&](FCommand& Command)
+	{
+		switch (Command.Type)
 		{
-			const int32 SizeA = A.Type->GetStructureSize(), SizeB = B.Type->GetStructureSize();
-			return SizeA != SizeB ? SizeA < SizeB : A.Type->GetUniqueID() < B.Type->GetUniqueID();
-		});
+		case ECommandType::Destroy:
+		{
+			if (IsValidEntity(Command.EntityID))
+			{
+				DestroyEntity(Command.EntityID);
+			}
+			break;
+		}
+		case ECommandType::AddComp:
+		{
+			const FCompTypeID CompID = Command.GetCompIDs()[0];
+			if (!IsValidEntity(Command.EntityID))
+			{
+				RegisteredComponents[CompID.ToInt()].Type->DestroyStruct(Command.GetCompData(0));
+				break;
+			}
+
+			if (Command.bSparse)
+			{
+				FECSSparseSet& SparseSet = FindOrAddSparseSet(CompID.ToInt());
+				uint8* Comp = SparseSet.Find(Command.EntityID.GetIndex());
+				if (Comp)
+				{
+					SparseSet.GetType()->DestroyStruct(Comp);
+				}
+				else
+				{
+					Comp = SparseSet.AddUninitialized(Command.EntityID);
+				}
 
-	RegisteredTags.Sort([](const FTagDescription& A, const FTagDescription& B)->bool
+				FMemory::Memcpy(Comp, Command.GetCompData(0), SparseSet.GetType()->GetStructureSize());
+				break;
+			}
+
+			const bool bReplace = EntityHasComp(Command.EntityID, CompID);
+			if (!bReplace)
+			{
+				MoveEntityToArchetype(Command.EntityID, FindTransitionArchetypeID(EntityRecords[Command.EntityID.GetIndex()].ArchetypeID, CompID.ToInt(), true));
+			}
+
+			const FArchetypeEntityRecord& Record = EntityRecords[Command.EntityID.GetIndex()];
+			FArchetype& Archetype = GetArchetype(Record.ArchetypeID);
+			FArchetype::FComponentsRow& Row = Archetype[Archetype.GetCompRow(CompID)];
+			if (bReplace)
+			{
+				Row.DestroyItems(Row[Record.ColumnIndex]);
+				Archetype.MarkRowChanged(Archetype.GetCompRow(CompID), Record.ColumnIndex / Archetype.GetChunkCapacity(), AdvanceChangeVersion());
+			}
+
+			FMemory::Memcpy(Row[Record.ColumnIndex], Command.GetCompData(0), Row.GetSize());
+			break;
+		}
+		case ECommandType::RemoveComp:
 		{
-			return A.Type->GetUniqueID() < B.Type->GetUniqueID();
+			if (IsValidEntity(Command.EntityID))
+			{
+				RemoveComp(Command.EntityID, Command.GetCompIDs()[0]);
+			}
+			break;
+		}
+		case ECommandType::AddTag:
+		{
+			if (IsValidEntity(Command.EntityID))
+			{
+				AddTag(Command.EntityID, Command.GetTagIDs()[0]);
+			}
+			break;
+		}
+		case ECommandType::RemoveTag:
+		{
+			if (IsValidEntity(Command.EntityID))
+			{
+				RemoveTag(Command.EntityID, Command.GetTagIDs()[0]);
+			}
+			break;
+		}
+		default: checkNoEntry();
+		}
+	};
+
+	// Apply changes to existing entities in recording order
+	for (FECSCommandBuffer* Buffer : Buffers)
+	{
+		BufferSpawns.Reset();
+		Buffer->ForEachCommand([&](FCommand& Command)
+		{
+			if (Command.Type == ECommandType::Spawn)
+			{
+				Signature.Init(false, NumCompsAndTags);
+				for (int32 i = 0; i < Command.NumComps; ++i)
+					Signature[Command.GetCompIDs()[i].ToInt()] = true;
+
+				for (int32 i = 0; i < Command.NumTags; ++i)
+					Signature[Command.GetTagIDs()[i].ToInt() + RegisteredComponents.Num()] = true;
+
+				PendingSpawns.Add({ FindOrCreateArchetypeID(Signature), &Command });
+				BufferSpawns.Add(&Command);
+				return;
+			}
+
+			if (FECSCommandBuffer::IsPlaceholder(Command.EntityID))
+			{
+				if (ensureMsgf(Buffer->OwnsPlaceholder(Command.EntityID), TEXT("Placeholder entity IDs are only valid within the command buffer that recorded the spawn")))
+				{
+					DeferredCommands.Add({ &Command, BufferSpawns[FECSCommandBuffer::GetPlaceholderSpawnIndex(Command.EntityID)] });
+					return;
+				}
+
+				// Skipped like any other invalid entity
+				Command.EntityID = FEntityID();
+			}
+
+			ApplyCommand(Command);
 		});
+	}
+
+	// Insert spawns one archetype at a time so each group fills contiguous columns
+	PendingSpawns.StableSort([](const FPendingSpawn& A, const FPendingSpawn& B) { return A.ArchetypeID < B.ArchetypeID; });
+
+	int32 LowestFreeIndex = 0;
+	for (int32 GroupStart = 0; GroupStart < PendingSpawns.Num();)
+	{
+		const FArchetypeID ArchetypeID = PendingSpawns[GroupStart].ArchetypeID;
+		int32 GroupEnd = GroupStart + 1;
+		while (GroupEnd < PendingSpawns.Num() && PendingSpawns[GroupEnd].ArchetypeID == ArchetypeID)
+			++GroupEnd;
+
+		FArchetype& Archetype = RegisteredArchetypes[ArchetypeID.ToInt()];
+
+		const uint32 SpawnVersion = AdvanceChangeVersion();
+
+		// Grow once for the whole group
+		const int32 NumFree = Archetype.GetNumColumns() - Archetype.GetNumInitializedColumns();
+		if (NumFree < GroupEnd - GroupStart)
+		{
+			Archetype.AddUninitialized(GroupEnd - GroupStart - NumFree);
+		}
+
+		int32 ColumnIndex = 0;
+		for (int32 i = GroupStart; i < GroupEnd; ++i)
+		{
+			ColumnIndex = Archetype.FindFirstUninitializedRow(ColumnIndex);
+			check(ColumnIndex != INDEX_NONE);
+
+			FCommand& Command = *PendingSpawns[i].Command;
+			for (int32 CompIndex = 0; CompIndex < Command.NumComps; ++CompIndex)
+			{
+				FArchetype::FComponentsRow& Row = Archetype[Archetype.GetCompRow(Command.GetCompIDs()[CompIndex])];
+				FMemory::Memcpy(Row[ColumnIndex], Command.GetCompData(CompIndex), Row.GetSize());
+			}
+
+			Archetype.SetColumnInitializedFlag(true, ColumnIndex);
+			Archetype.MarkColumnsChanged(ColumnIndex, 1, SpawnVersion);
+
+			// Resolves the buffer's placeholder for this spawn
+			Command.EntityID = AddEntityRecord(LowestFreeIndex, ArchetypeID, ColumnIndex);
+			Archetype.SetColumnEntity(ColumnIndex, Command.EntityID);
+		}
+
+		GroupStart = GroupEnd;
+	}
+
+	for (const FDeferredCommand& Deferred : DeferredCommands)
+	{
+		Deferred.Command->EntityID = Deferred.Spawn->EntityID;
+		ApplyCommand(*Deferred.Command);
+	}
+
+	for (FECSCommandBuffer* Buffer : Buffers)
+		Buffer->Reset(false);
+}
+
+void UECSSubsystem::RegisterComponentsAndTags()
+{
+	// Only resolves types from modules loaded since the last world initialized
+	FECSTypeRegistry& Registry = FECSTypeRegistry::Get();
+	Registry.ProcessPendingTypes();
+
+	RegisteredComponents.Reserve(Registry.GetCompTypes().Num());
+	for (int32 i = 0; i < Registry.GetCompTypes().Num(); ++i)
+		RegisteredComponents.Emplace(Registry.GetCompTypes()[i], Registry.GetCompStorages()[i]);
+
+	RegisteredTags.Reserve(Registry.GetTagTypes().Num());
+	for (int32 i = 0; i < Registry.GetTagTypes().Num(); ++i)
+		RegisteredTags.Emplace(Registry.GetTagTypes()[i], Registry.GetTagStorages()[i]);
+
+	SparseSets.SetNum(RegisteredComponents.Num() + RegisteredTags.Num());
+}
+
+FECSSparseSet& UECSSubsystem::FindOrAddSparseSet(const int32 SignatureIndex) const
+{
+	check(SparseSets.IsValidIndex(SignatureIndex));
+	checkf(IsSparseStorage(SignatureIndex), TEXT("Signature index %i isn't sparse set stored"), SignatureIndex);
+
+	TUniquePtr<FECSSparseSet>& SparseSet = SparseSets[SignatureIndex];
+	if (!SparseSet)
+	{
+		// Tags only track membership
+		const bool bIsComp = SignatureIndex < RegisteredComponents.Num();
+		SparseSet = MakeUnique<FECSSparseSet>(bIsComp ? RegisteredComponents[SignatureIndex].Type : nullptr);
+		ActiveSparseSets.Add(SparseSet.Get());
+	}
+
+	return *SparseSet;
 }
 
 UE_NODISCARD FCompTypeID UECSSubsystem::FindCompTypeID(const UScriptStruct* Type) const
@@ -87,11 +439,10 @@ UE_NODISCARD FCompTypeID UECSSubsystem::FindCompTypeID(const UScriptStruct* Type
 	checkf(!RegisteredComponents.IsEmpty(), TEXT("Attempted to retrieve a component type ID before any components have been registered!"));
 	check(Type);
 	check(Type->IsChildOf(FECSCompBase::StaticStruct()));
-	return FCompTypeID(Algo::BinarySearchBy(RegisteredComponents, Type, &FCompDescription::Type, [](const UScriptStruct* A, const UScriptStruct* B)->bool
-	{
-		const int32 SizeA = A->GetStructureSize(), SizeB = B->GetStructureSize();
-		return SizeA != SizeB ? SizeA < SizeB : A->GetUniqueID() < B->GetUniqueID();
-	}));
+
+	const int32 Index = FECSTypeRegistry::Get().FindTypeIndex(Type);
+	checkf(RegisteredComponents.IsValidIndex(Index), TEXT("Component %s isn't registered in this world. Missing ECS_REGISTER_TYPE(%s)?"), *Type->GetName(), *Type->GetStructCPPName());
+	return FCompTypeID(Index);
 }
 
 UE_NODISCARD FTagTypeID UECSSubsystem::FindTagTypeID(const UScriptStruct* Type) const
@@ -99,26 +450,437 @@ UE_NODISCARD FTagTypeID UECSSubsystem::FindTagTypeID(const UScriptStruct* Type)
 	checkf(!RegisteredTags.IsEmpty(), TEXT("Attempted to retrieve a tag type ID before any components have been registered!"));
 	check(Type);
 	check(Type->IsChildOf(FECSTagBase::StaticStruct()));
-	return FTagTypeID(Algo::BinarySearchBy(RegisteredTags, Type, &FTagDescription::Type, [](const UScriptStruct* A, const UScriptStruct* B)->bool
-		{
-			return A->GetUniqueID() < B->GetUniqueID();
-		}));
+
+	const int32 Index = FECSTypeRegistry::Get().FindTypeIndex(Type);
+	checkf(RegisteredTags.IsValidIndex(Index), TEXT("Tag %s isn't registered in this world. Missing ECS_REGISTER_TYPE(%s)?"), *Type->GetName(), *Type->GetStructCPPName());
+	return FTagTypeID(Index);
+}
+
+int32 UECSSubsystem::AllocateArchetypeSlot()
+{
+	return ArchetypeSlotCounter.Increment() - 1;
+}
+
+void UECSSubsystem::SetArchetypePacked(const FArchetypeID ArchetypeID, const bool bPacked)
+{
+	GetArchetype(ArchetypeID).SetPacked(bPacked, [this](const FEntityID EntityID, const int32 NewColumnIndex)
+	{
+		EntityRecords[EntityID.GetIndex()].ColumnIndex = NewColumnIndex;
+	});
 }
 
 UE_NODISCARD FArchetypeID UECSSubsystem::FindArchetypeID(const TConstArrayView<FCompTypeID>& CompIDs, const TConstArrayView<FTagTypeID>& TagIDs) const
 {
 	checkf(!RegisteredComponents.IsEmpty(), TEXT("Attempted to retrieve a archetype ID before any components have been registered!"));
-	checkf(!RegisteredTags.IsEmpty(), TEXT("Attempted to retrieve a archetype ID before any components have been registered!"));
 	check(!CompIDs.IsEmpty());
-	
-	if (TagIDs.IsEmpty())
+
+	TBitArray<> Signature(false, RegisteredComponents.Num() + RegisteredTags.Num());
+	for (const FCompTypeID& ID : CompIDs)
 	{
-		const int32 NumWords = FMath::DivideAndRoundUp(RegisteredComponents.Num(), 8);
-		uint8* CompIDsBitMask = (uint8*)FMemory_Alloca(NumWords);
-		FMemory::Memset(CompIDsBitMask, 0, NumWords);
-		for (const FCompTypeID& ID : CompIDs)
-			CompIDsBitMask[(int32)ID / 8] |= (1 << (int32)ID % 8);
+		check(RegisteredComponents.IsValidIndex(ID.ToInt()));
+		Signature[ID.ToInt()] = true;
 	}
 
-	return FArchetypeID(INDEX_NONE);
+	for (const FTagTypeID& ID : TagIDs)
+	{
+		check(RegisteredTags.IsValidIndex(ID.ToInt()));
+		Signature[ID.ToInt() + RegisteredComponents.Num()] = true;
+	}
+
+	return FindOrCreateArchetypeID(Signature);
+}
+
+UE_NODISCARD FArchetypeID UECSSubsystem::FindOrCreateArchetypeID(const TBitArray<>& Signature) const
+{
+	checkf(Signature.Num() == RegisteredComponents.Num() + RegisteredTags.Num(), TEXT("Invalid archetype signature size %i"), Signature.Num());
+
+	if (const FArchetypeID* ExistingID = ArchetypeSignatures.Find(Signature))
+		return *ExistingID;
+
+	// If there was no matching archetype, generate a new archetype. Rows are ordered by FCompTypeID
+	TArray<const UScriptStruct*, TInlineAllocator<16>> CompTypes;
+	for (TConstSetBitIterator<> It(Signature); It && It.GetIndex() < RegisteredComponents.Num(); ++It)
+		CompTypes.Add(RegisteredComponents[It.GetIndex()].Type);
+
+	const FArchetypeID NewID(RegisteredArchetypes.Emplace(Signature, TConstArrayView<const UScriptStruct*>(CompTypes)));
+	ArchetypeSignatures.Add(Signature, NewID);
+
+	// Add newly generated archetype to the component and tag descriptions' referenced archetypes arrays. The new ID is always the largest so appending keeps them sorted
+	int32 CompRowIndex = 0, TagIndex = 0;
+	for (TConstSetBitIterator<> It(Signature); It; ++It)
+	{
+		if (It.GetIndex() < RegisteredComponents.Num())
+		{
+			RegisteredComponents[It.GetIndex()].ReferencedArchetypes.Emplace(NewID, CompRowIndex++);
+		}
+		else
+		{
+			RegisteredTags[It.GetIndex() - RegisteredComponents.Num()].ReferencedArchetypes.Emplace(NewID, TagIndex++);
+		}
+	}
+
+	// Push the new archetype to every cached query that requires any of its components or tags
+	const FArchetype& NewArchetype = RegisteredArchetypes[NewID.ToInt()];
+	for (TConstSetBitIterator<> It(Signature); It; ++It)
+	{
+		const TArray<FQueryID>& ReferencedQueries = It.GetIndex() < RegisteredComponents.Num()
+			? RegisteredComponents[It.GetIndex()].ReferencedQueries
+			: RegisteredTags[It.GetIndex() - RegisteredComponents.Num()].ReferencedQueries;
+
+		for (const FQueryID& QueryID : ReferencedQueries)
+		{
+			FQueryDescription& Query = RegisteredQueries[QueryID.ToInt()];
+			const bool bAlreadyMatched = !Query.MatchingArchetypes.IsEmpty() && Query.MatchingArchetypes.Last() == NewID;
+			if (!bAlreadyMatched && IsQueryMatch(Query, NewArchetype))
+			{
+				AddQueryMatch(Query, NewID);
+			}
+		}
+	}
+
+	return NewID;
+}
+
+UE_NODISCARD FQueryID UECSSubsystem::FindOrAddQuery(const TBitArray<>& RequiredSignature, const TBitArray<>& ExcludedSignature, const TBitArray<>& AnyOfSignature, const TBitArray<>& OptionalSignature) const
+{
+	const int32 NumCompsAndTags = RegisteredComponents.Num() + RegisteredTags.Num();
+	checkf(RequiredSignature.Num() == NumCompsAndTags, TEXT("Invalid query signature size %i"), RequiredSignature.Num());
+
+	// Key on every signature so queries only differing by filters are cached separately
+	const TBitArray<>* Signatures[] = { &RequiredSignature, &ExcludedSignature, &AnyOfSignature, &OptionalSignature };
+	TBitArray<> Key(false, NumCompsAndTags * UE_ARRAY_COUNT(Signatures));
+	for (int32 i = 0; i < UE_ARRAY_COUNT(Signatures); ++i)
+	{
+		checkf(Signatures[i]->Num() == 0 || Signatures[i]->Num() == NumCompsAndTags, TEXT("Invalid query filter signature size %i"), Signatures[i]->Num());
+		for (TConstSetBitIterator<> It(*Signatures[i]); It; ++It)
+			Key[i * NumCompsAndTags + It.GetIndex()] = true;
+	}
+
+	if (const FQueryID* ExistingID = QuerySignatures.Find(Key))
+		return *ExistingID;
+
+	const FQueryID NewID(RegisteredQueries.Num());
+	QuerySignatures.Add(MoveTemp(Key), NewID);
+
+	// Optional components are resolved alongside the required ones
+	TBitArray<> RowSignature = RequiredSignature;
+	for (TConstSetBitIterator<> It(OptionalSignature); It; ++It)
+	{
+		checkf(It.GetIndex() < RegisteredComponents.Num(), TEXT("Optional query signature may only contain components!"));
+		RowSignature[It.GetIndex()] = true;
+	}
+
+	int32 NumComps = 0;
+	for (TConstSetBitIterator<> It(RowSignature); It && It.GetIndex() < RegisteredComponents.Num(); ++It)
+		++NumComps;
+
+	const bool bHasRequired = RequiredSignature.Contains(true);
+	const bool bHasAnyOf = AnyOfSignature.Contains(true);
+	FQueryDescription& Query = RegisteredQueries.Emplace_GetRef(RequiredSignature, ExcludedSignature.Contains(true) ? ExcludedSignature : TBitArray<>(), bHasAnyOf ? AnyOfSignature : TBitArray<>(), RowSignature, NumComps);
+
+	// Every match has all required types so register on those. Without any, every match has at least one of the any-of types
+	checkf(bHasRequired || bHasAnyOf, TEXT("Attempted to register a query without any components or tags!"));
+	const TBitArray<>& ReferencingSignature = bHasRequired ? RequiredSignature : AnyOfSignature;
+
+	const TArray<FArchetypeCompRecord>* Candidates = nullptr;
+	for (TConstSetBitIterator<> It(ReferencingSignature); It; ++It)
+	{
+		const bool bIsComp = It.GetIndex() < RegisteredComponents.Num();
+		const TArray<FArchetypeCompRecord>& ReferencedArchetypes = bIsComp
+			? RegisteredComponents[It.GetIndex()].ReferencedArchetypes
+			: RegisteredTags[It.GetIndex() - RegisteredComponents.Num()].ReferencedArchetypes;
+
+		if (!Candidates || ReferencedArchetypes.Num() < Candidates->Num())
+		{
+			Candidates = &ReferencedArchetypes;
+		}
+
+		// Register for archetypes created later
+		TArray<FQueryID>& ReferencedQueries = bIsComp
+			? RegisteredComponents[It.GetIndex()].ReferencedQueries
+			: RegisteredTags[It.GetIndex() - RegisteredComponents.Num()].ReferencedQueries;
+		ReferencedQueries.Add(NewID);
+	}
+
+	if (bHasRequired)
+	{
+		// Only the archetypes referencing the least referenced required type can match
+		for (const FArchetypeCompRecord& Candidate : *Candidates)
+		{
+			if (IsQueryMatch(Query, RegisteredArchetypes[Candidate.ID.ToInt()]))
+			{
+				AddQueryMatch(Query, Candidate.ID);
+			}
+		}
+	}
+	else
+	{
+		for (int32 i = 0; i < RegisteredArchetypes.Num(); ++i)
+		{
+			if (IsQueryMatch(Query, RegisteredArchetypes[i]))
+			{
+				AddQueryMatch(Query, FArchetypeID(i));
+			}
+		}
+	}
+
+	return NewID;
+}
+
+bool UECSSubsystem::IsQueryMatch(const FQueryDescription& Query, const FArchetype& Archetype)
+{
+	return Archetype.HasAllOf(Query.RequiredSignature) && !Archetype.HasAnyOf(Query.ExcludedSignature) && (Query.AnyOfSignature.Num() == 0 || Archetype.HasAnyOf(Query.AnyOfSignature));
+}
+
+void UECSSubsystem::DestroyEntities(const TConstArrayView<FEntityID>& EntityIDs)
+{
+	struct FPendingDestroy
+	{
+		FArchetypeID ArchetypeID;
+		int32 ColumnIndex;
+	};
+
+	TArray<FPendingDestroy> PendingDestroys;
+	PendingDestroys.Reserve(EntityIDs.Num());
+	for (const FEntityID& EntityID : EntityIDs)
+	{
+		checkf(IsValidEntity(EntityID), TEXT("Attempted to destroy invalid entity %i (generation %u)"), EntityID.GetIndex(), EntityID.GetGeneration());
+
+		const FArchetypeEntityRecord& Record = EntityRecords[EntityID.GetIndex()];
+		PendingDestroys.Add({ Record.ArchetypeID, Record.ColumnIndex });
+		RemoveEntityRecord(EntityID);
+	}
+
+	RemoveFromSparseSets(EntityIDs);
+
+	PendingDestroys.Sort([](const FPendingDestroy& A, const FPendingDestroy& B)
+	{
+		return A.ArchetypeID != B.ArchetypeID ? A.ArchetypeID < B.ArchetypeID : A.ColumnIndex < B.ColumnIndex;
+	});
+
+	for (int32 GroupStart = 0; GroupStart < PendingDestroys.Num();)
+	{
+		const FArchetypeID ArchetypeID = PendingDestroys[GroupStart].ArchetypeID;
+		FArchetype& Archetype = GetArchetype(ArchetypeID);
+
+		// Destroy runs of consecutive columns
+		int32 RunStart = GroupStart, i = GroupStart + 1;
+		for (; i < PendingDestroys.Num() && PendingDestroys[i].ArchetypeID == ArchetypeID; ++i)
+		{
+			if (PendingDestroys[i].ColumnIndex == PendingDestroys[i - 1].ColumnIndex + 1) continue;
+
+			Archetype.DestructRange(PendingDestroys[RunStart].ColumnIndex, i - RunStart);
+			RunStart = i;
+		}
+
+		Archetype.DestructRange(PendingDestroys[RunStart].ColumnIndex, i - RunStart);
+
+		// Fill the holes once instead of swap-removing each entity
+		if (Archetype.IsPacked())
+		{
+			Archetype.Compact([this](const FEntityID EntityID, const int32 NewColumnIndex)
+			{
+				EntityRecords[EntityID.GetIndex()].ColumnIndex = NewColumnIndex;
+			});
+		}
+
+		GroupStart = i;
+	}
+}
+
+void UECSSubsystem::RemoveFromSparseSets(const TConstArrayView<FEntityID>& EntityIDs)
+{
+	TBitArray<> RemovedIndices;// Built on first use. Index via FEntityID::GetIndex()
+	for (FECSSparseSet* SparseSet : ActiveSparseSets)
+	{
+		if (SparseSet->Num() == 0) continue;
+
+		// Probe the set per entity, or scan the set when it's the smaller side
+		if (SparseSet->Num() >= EntityIDs.Num())
+		{
+			for (const FEntityID& EntityID : EntityIDs)
+				SparseSet->Remove(EntityID.GetIndex());
+
+			continue;
+		}
+
+		if (RemovedIndices.Num() == 0)
+		{
+			RemovedIndices.Init(false, EntityGenerations.Num());
+			for (const FEntityID& EntityID : EntityIDs)
+				RemovedIndices[EntityID.GetIndex()] = true;
+		}
+
+		// Backwards so swap-removes only move entries that were already visited
+		for (int32 DenseIndex = SparseSet->Num() - 1; DenseIndex >= 0; --DenseIndex)
+		{
+			const int32 EntityIndex = SparseSet->GetEntity(DenseIndex).GetIndex();
+			if (RemovedIndices[EntityIndex])
+			{
+				SparseSet->Remove(EntityIndex);
+			}
+		}
+	}
+}
+
+void UECSSubsystem::DestroyAllEntities()
+{
+	TArray<FEntityID> EntityIDs;
+	EntityIDs.Reserve(EntityRecords.Num());
+	for (FEntityRecordSparseArray::TConstIterator It(EntityRecords); It; ++It)
+		EntityIDs.Add(FEntityID(It.GetIndex(), EntityGenerations[It.GetIndex()]));
+
+	DestroyEntities(EntityIDs);
+}
+
+bool UECSSubsystem::RemoveComp(const FEntityID EntityID, const FCompTypeID CompTypeID)
+{
+	check(IsValidEntity(EntityID));
+
+	if (IsSparseStorage(CompTypeID.ToInt()))
+	{
+		FECSSparseSet* SparseSet = FindSparseSet(CompTypeID.ToInt());
+		return SparseSet && SparseSet->Remove(EntityID.GetIndex());
+	}
+
+	if (!EntityHasComp(EntityID, CompTypeID)) return false;
+
+	MoveEntityToArchetype(EntityID, FindTransitionArchetypeID(EntityRecords[EntityID.GetIndex()].ArchetypeID, CompTypeID.ToInt(), false));
+	return true;
+}
+
+bool UECSSubsystem::AddTag(const FEntityID EntityID, const FTagTypeID TagTypeID)
+{
+	check(IsValidEntity(EntityID));
+	if (EntityHasTag(EntityID, TagTypeID)) return false;
+
+	if (IsSparseStorage(TagTypeID.ToInt() + RegisteredComponents.Num()))
+	{
+		FindOrAddSparseSet(TagTypeID.ToInt() + RegisteredComponents.Num()).AddUninitialized(EntityID);
+		return true;
+	}
+
+	MoveEntityToArchetype(EntityID, FindTransitionArchetypeID(EntityRecords[EntityID.GetIndex()].ArchetypeID, TagTypeID.ToInt() + RegisteredComponents.Num(), true));
+	return true;
+}
+
+bool UECSSubsystem::RemoveTag(const FEntityID EntityID, const FTagTypeID TagTypeID)
+{
+	check(IsValidEntity(EntityID));
+
+	if (IsSparseStorage(TagTypeID.ToInt() + RegisteredComponents.Num()))
+	{
+		FECSSparseSet* SparseSet = FindSparseSet(TagTypeID.ToInt() + RegisteredComponents.Num());
+		return SparseSet && SparseSet->Remove(EntityID.GetIndex());
+	}
+
+	if (!EntityHasTag(EntityID, TagTypeID)) return false;
+
+	MoveEntityToArchetype(EntityID, FindTransitionArchetypeID(EntityRecords[EntityID.GetIndex()].ArchetypeID, TagTypeID.ToInt() + RegisteredComponents.Num(), false));
+	return true;
+}
+
+UE_NODISCARD FArchetypeID UECSSubsystem::FindTransitionArchetypeID(const FArchetypeID ArchetypeID, const int32 SignatureIndex, const bool bAdd) const
+{
+	check(SignatureIndex >= 0 && SignatureIndex < RegisteredComponents.Num() + RegisteredTags.Num());
+
+	if (const FArchetype::FEdge* Edge = GetArchetype(ArchetypeID).Edges.Find(SignatureIndex))
+	{
+		const FArchetypeID& CachedID = bAdd ? Edge->Add : Edge->Remove;
+		if (CachedID != FArchetypeID())
+			return CachedID;
+	}
+
+	TBitArray<> Signature;
+	GetArchetype(ArchetypeID).GetSignature(Signature, RegisteredComponents.Num() + RegisteredTags.Num());
+	checkf(Signature[SignatureIndex] != bAdd, TEXT("Archetype %i already %s signature bit %i"), ArchetypeID.ToInt(), bAdd ? TEXT("has") : TEXT("lacks"), SignatureIndex);
+	Signature[SignatureIndex] = bAdd;
+
+	// May reallocate the archetypes so only take references afterwards
+	const FArchetypeID TargetID = FindOrCreateArchetypeID(Signature);
+
+	FArchetype::FEdge& Edge = GetArchetype(ArchetypeID).Edges.FindOrAdd(SignatureIndex);
+	(bAdd ? Edge.Add : Edge.Remove) = TargetID;
+
+	FArchetype::FEdge& ReverseEdge = GetArchetype(TargetID).Edges.FindOrAdd(SignatureIndex);
+	(bAdd ? ReverseEdge.Remove : ReverseEdge.Add) = ArchetypeID;
+
+	return TargetID;
+}
+
+int32 UECSSubsystem::MoveEntityToArchetype(const FEntityID EntityID, const FArchetypeID NewArchetypeID)
+{
+	check(IsValidEntity(EntityID));
+
+	FArchetypeEntityRecord& Record = EntityRecords[EntityID.GetIndex()];
+	if (Record.ArchetypeID == NewArchetypeID) return Record.ColumnIndex;
+
+	FArchetype& OldArchetype = GetArchetype(Record.ArchetypeID);
+	FArchetype& NewArchetype = GetArchetype(NewArchetypeID);
+	const int32 OldColumnIndex = Record.ColumnIndex;
+
+	int32 NewColumnIndex = NewArchetype.FindFirstUninitializedRow();
+	if (NewColumnIndex == INDEX_NONE)
+	{
+		NewColumnIndex = NewArchetype.AddUninitialized(ENTITY_ALLOC_CHUNK_SIZE);
+	}
+
+	check(!NewArchetype.IsColumnInitialized(NewColumnIndex));
+
+	bool bSameRows = OldArchetype.NumRows == NewArchetype.NumRows;
+	for (int32 i = 0; bSameRows && i < OldArchetype.NumRows; ++i)
+		bSameRows = OldArchetype.Rows[i].GetType() == NewArchetype.Rows[i].GetType();
+
+	// Tag transitions keep every row so they only need to relocate row to row
+	if (bSameRows)
+	{
+		for (int32 i = 0; i < OldArchetype.NumRows; ++i)
+			FMemory::Memcpy(NewArchetype.Rows[i][NewColumnIndex], OldArchetype.Rows[i][OldColumnIndex], OldArchetype.Rows[i].GetSize());
+	}
+	else
+	{
+		// Relocate the components both archetypes share and destroy the ones being removed
+		for (int32 CompIndex = 0; CompIndex < OldArchetype.CompRowLookupNum; ++CompIndex)
+		{
+			const int32 OldRowIndex = OldArchetype.FindCompRow(FCompTypeID(CompIndex));
+			if (OldRowIndex == INDEX_NONE) continue;
+
+			FArchetype::FComponentsRow& OldRow = OldArchetype[OldRowIndex];
+			const int32 NewRowIndex = NewArchetype.FindCompRow(FCompTypeID(CompIndex));
+			if (NewRowIndex != INDEX_NONE)
+			{
+				FMemory::Memcpy(NewArchetype[NewRowIndex][NewColumnIndex], OldRow[OldColumnIndex], OldRow.GetSize());
+			}
+			else
+			{
+				OldRow.DestroyItems(OldRow[OldColumnIndex]);
+			}
+		}
+	}
+
+	// Packed archetypes move their last entity into the released column
+	FEntityID MovedEntity;
+	if (OldArchetype.ReleaseAt(OldColumnIndex, &MovedEntity) && MovedEntity != FEntityID())
+	{
+		EntityRecords[MovedEntity.GetIndex()].ColumnIndex = OldColumnIndex;
+	}
+
+	NewArchetype.SetColumnInitializedFlag(true, NewColumnIndex);
+	NewArchetype.MarkColumnsChanged(NewColumnIndex, 1, AdvanceChangeVersion());
+	NewArchetype.SetColumnEntity(NewColumnIndex, EntityID);
+
+	Record.ArchetypeID = NewArchetypeID;
+	Record.ColumnIndex = NewColumnIndex;
+	return NewColumnIndex;
+}
+
+void UECSSubsystem::AddQueryMatch(FQueryDescription& Query, const FArchetypeID ArchetypeID) const
+{
+	const FArchetype& Archetype = RegisteredArchetypes[ArchetypeID.ToInt()];
+	while (Query.MatchIndices.Num() <= ArchetypeID.ToInt())
+		Query.MatchIndices.Add(INDEX_NONE);
+
+	Query.MatchIndices[ArchetypeID.ToInt()] = Query.MatchingArchetypes.Add(ArchetypeID);
+	for (TConstSetBitIterator<> It(Query.RowSignature); It && It.GetIndex() < RegisteredComponents.Num(); ++It)
+		Query.RowIndices.Add(Archetype.FindCompRow(FCompTypeID(It.GetIndex())));
 }
@@ -0,0 +1,382 @@
+﻿
+#include "ECSSubsystem.h"
+
+#include "Algo/Count.h"
+#include "Serialization/ObjectAndNameAsStringProxyArchive.h"
+#include "Types/ECSStructReferences.h"
+#include "Types/ECSTypeRegistry.h"
+
+namespace
+{
+	constexpr uint32 SNAPSHOT_MAGIC = 0x53534345;// "ECSS"
+	constexpr int32 SNAPSHOT_VERSION = 1;
+
+	// Raw bytes are only safe to write for plain old data that doesn't reference objects
+	bool IsBulkSerializable(const UScriptStruct* Type)
+	{
+		return (Type->StructFlags & STRUCT_IsPlainOldData) && !FECSStructReferences::Get(Type).HasReferences();
+	}
+
+	// Entry of the snapshot's type table. Signature indices in the snapshot index into it
+	struct FSnapshotType
+	{
+		FString Path;
+		int32 Size = 0;// 0 for tags
+		int32 Alignment = 0;
+		bool bBulk = false;// Values were written as raw bytes
+	};
+
+	FArchive& operator<<(FArchive& Ar, FSnapshotType& Type)
+	{
+		return Ar << Type.Path << Type.Size << Type.Alignment << Type.bBulk;
+	}
+
+	FORCEINLINE void SerializeTaggedItem(FArchive& Ar, const UScriptStruct* Type, void* Item)
+	{
+		const_cast<UScriptStruct*>(Type)->SerializeItem(Ar, Item, nullptr);
+	}
+}
+
+void UECSSubsystem::SaveSnapshot(FArchive& Ar) const
+{
+	check(Ar.IsSaving());
+	check(IsInGameThread());
+
+	uint32 Magic = SNAPSHOT_MAGIC;
+	int32 Version = SNAPSHOT_VERSION;
+	Ar << Magic << Version;
+
+	int32 NumComps = GetNumComps();
+	int32 NumCompsAndTags = GetNumComps() + GetNumTags();
+	Ar << NumComps << NumCompsAndTags;
+
+	for (int32 i = 0; i < NumCompsAndTags; ++i)
+	{
+		const bool bIsComp = i < NumComps;
+		const UScriptStruct* Type = bIsComp ? RegisteredComponents[i].Type : RegisteredTags[i - NumComps].Type;
+
+		FSnapshotType SnapshotType;
+		SnapshotType.Path = Type->GetPathName();
+		if (bIsComp)
+		{
+			SnapshotType.Size = Type->GetStructureSize();
+			SnapshotType.Alignment = Type->GetMinAlignment();
+			SnapshotType.bBulk = IsBulkSerializable(Type);
+		}
+
+		Ar << SnapshotType;
+	}
+
+	// Generations of every slot, including free ones, so handles that were stale before saving stay stale after loading
+	int32 NumGenerations = EntityGenerations.Num();
+	Ar << NumGenerations;
+	Ar.Serialize(const_cast<uint32*>(EntityGenerations.GetData()), NumGenerations * sizeof(uint32));
+
+	FObjectAndNameAsStringProxyArchive TaggedAr(Ar, false);
+
+	int32 NumArchetypes = Algo::CountIf(RegisteredArchetypes, [](const FArchetype& Archetype) { return Archetype.GetNumInitializedColumns() > 0; });
+	Ar << NumArchetypes;
+
+	TBitArray<> Signature;
+	TArray<int32> SignatureIndices;
+	TArray<FEntityID> EntityIDs;
+	TArray<TPair<int32, int32>> Runs;// Start column and number of initialized columns. Contiguous within every row
+	for (const FArchetype& Archetype : RegisteredArchetypes)
+	{
+		if (Archetype.GetNumInitializedColumns() == 0) continue;
+
+		// Rows are ordered by FCompTypeID so they're written in the same order as their signature bits
+		Archetype.GetSignature(Signature, NumCompsAndTags);
+		SignatureIndices.Reset();
+		for (TConstSetBitIterator<> It(Signature); It; ++It)
+			SignatureIndices.Add(It.GetIndex());
+
+		Ar << SignatureIndices;
+
+		EntityIDs.Reset(Archetype.GetNumInitializedColumns());
+		Runs.Reset();
+		Archetype.ForEachColumnRange(0, Archetype.GetColumnEnd(), [&](const int32 StartColumn, const int32 Num)
+		{
+			int32 RunStart = INDEX_NONE;
+			for (int32 Column = StartColumn; Column <= StartColumn + Num; ++Column)
+			{
+				if (Column < StartColumn + Num && Archetype.IsColumnInitialized(Column))
+				{
+					EntityIDs.Add(Archetype.GetColumnEntity(Column));
+					if (RunStart == INDEX_NONE)
+					{
+						RunStart = Column;
+					}
+				}
+				else if (RunStart != INDEX_NONE)
+				{
+					Runs.Emplace(RunStart, Column - RunStart);
+					RunStart = INDEX_NONE;
+				}
+			}
+		});
+
+		int32 NumEntities = EntityIDs.Num();
+		Ar << NumEntities;
+		Ar.Serialize(EntityIDs.GetData(), NumEntities * sizeof(FEntityID));
+
+		for (int32 RowIndex = 0; RowIndex < Archetype.GetNumRows(); ++RowIndex)
+		{
+			const FArchetype::FComponentsRow& Row = Archetype[RowIndex];
+			const bool bBulk = IsBulkSerializable(Row.GetType());
+			for (const TPair<int32, int32>& Run : Runs)
+			{
+				if (bBulk)
+				{
+					Ar.Serialize(const_cast<uint8*>(Row[Run.Key]), Run.Value * Row.GetSize());
+					continue;
+				}
+
+				for (int32 Column = Run.Key; Column < Run.Key + Run.Value; ++Column)
+					SerializeTaggedItem(TaggedAr, Row.GetType(), const_cast<uint8*>(Row[Column]));
+			}
+		}
+	}
+
+	int32 NumSparseSets = Algo::CountIf(ActiveSparseSets, [](const FECSSparseSet* SparseSet) { return SparseSet->Num() > 0; });
+	Ar << NumSparseSets;
+
+	for (int32 SignatureIndex = 0; SignatureIndex < SparseSets.Num(); ++SignatureIndex)
+	{
+		const FECSSparseSet* SparseSet = SparseSets[SignatureIndex].Get();
+		if (!SparseSet || SparseSet->Num() == 0) continue;
+
+		int32 Num = SparseSet->Num();
+		Ar << SignatureIndex << Num;
+
+		for (int32 DenseIndex = 0; DenseIndex < Num; ++DenseIndex)
+		{
+			FEntityID EntityID = SparseSet->GetEntity(DenseIndex);
+			Ar << EntityID.ID;
+		}
+
+		// Tags only store membership
+		const UScriptStruct* Type = SparseSet->GetType();
+		if (!Type) continue;
+
+		const bool bBulk = IsBulkSerializable(Type);
+		for (int32 DenseIndex = 0; DenseIndex < Num; ++DenseIndex)
+		{
+			if (bBulk)
+			{
+				Ar.Serialize(SparseSet->GetData(DenseIndex), Type->GetStructureSize());
+			}
+			else
+			{
+				SerializeTaggedItem(TaggedAr, Type, SparseSet->GetData(DenseIndex));
+			}
+		}
+	}
+}
+
+bool UECSSubsystem::LoadSnapshot(FArchive& Ar)
+{
+	check(Ar.IsLoading());
+	check(IsInGameThread());
+
+	uint32 Magic = 0;
+	int32 Version = 0;
+	Ar << Magic << Version;
+	if (Ar.IsError() || Magic != SNAPSHOT_MAGIC || Version != SNAPSHOT_VERSION) return false;
+
+	int32 SavedNumComps = 0, SavedNumTypes = 0;
+	Ar << SavedNumComps << SavedNumTypes;
+	if (Ar.IsError() || SavedNumComps < 0 || SavedNumTypes < SavedNumComps) return false;
+
+	// Signature index in this world of each saved type. INDEX_NONE if the type no longer exists or its raw layout changed
+	TArray<FSnapshotType> SavedTypes;
+	TArray<int32> TypeRemap;
+	SavedTypes.SetNum(SavedNumTypes);
+	TypeRemap.Init(INDEX_NONE, SavedNumTypes);
+	for (int32 i = 0; i < SavedNumTypes; ++i)
+	{
+		FSnapshotType& SavedType = SavedTypes[i];
+		Ar << SavedType;
+		if (Ar.IsError()) return false;
+
+		const UScriptStruct* Type = FindObject<UScriptStruct>(nullptr, *SavedType.Path);
+		const int32 TypeIndex = Type ? FECSTypeRegistry::Get().FindTypeIndex(Type) : INDEX_NONE;
+		if (TypeIndex == INDEX_NONE) continue;
+
+		if (i < SavedNumComps)
+		{
+			if (!RegisteredComponents.IsValidIndex(TypeIndex) || RegisteredComponents[TypeIndex].Type != Type) continue;
+			if (SavedType.bBulk && (!IsBulkSerializable(Type) || Type->GetStructureSize() != SavedType.Size || Type->GetMinAlignment() != SavedType.Alignment)) continue;
+
+			TypeRemap[i] = TypeIndex;
+		}
+		else
+		{
+			if (!RegisteredTags.IsValidIndex(TypeIndex) || RegisteredTags[TypeIndex].Type != Type) continue;
+
+			TypeRemap[i] = TypeIndex + GetNumComps();
+		}
+	}
+
+	TArray<uint32> Generations;
+	int32 NumGenerations = 0;
+	Ar << NumGenerations;
+	if (Ar.IsError() || NumGenerations < 0) return false;
+
+	Generations.SetNumUninitialized(NumGenerations);
+	Ar.Serialize(Generations.GetData(), NumGenerations * sizeof(uint32));
+	if (Ar.IsError()) return false;
+
+	// Everything after this point is only validated while it's read, so from here on failing leaves the world empty
+	DestroyAllEntities();
+	EntityRecords.Empty(NumGenerations);
+	EntityGenerations = MoveTemp(Generations);
+
+	bool bFailed = false;
+	FObjectAndNameAsStringProxyArchive TaggedAr(Ar, false);
+
+	int32 NumArchetypes = 0;
+	Ar << NumArchetypes;
+	bFailed |= Ar.IsError() || NumArchetypes < 0;
+
+	const int32 NumCompsAndTags = GetNumComps() + GetNumTags();
+	TBitArray<> Signature;
+	TArray<int32> SignatureIndices;
+	TArray<FEntityID> EntityIDs;
+	for (int32 ArchetypeIndex = 0; ArchetypeIndex < NumArchetypes && !bFailed; ++ArchetypeIndex)
+	{
+		int32 NumEntities = 0;
+		Ar << SignatureIndices << NumEntities;
+		if (Ar.IsError() || NumEntities <= 0 || NumEntities > EntityGenerations.Num())
+		{
+			bFailed = true;
+			break;
+		}
+
+		EntityIDs.SetNumUninitialized(NumEntities);
+		Ar.Serialize(EntityIDs.GetData(), NumEntities * sizeof(FEntityID));
+
+		Signature.Init(false, NumCompsAndTags);
+		for (const int32 SavedIndex : SignatureIndices)
+		{
+			// Types switched to sparse set storage since saving can't be restored into an archetype
+			if (!TypeRemap.IsValidIndex(SavedIndex) || TypeRemap[SavedIndex] == INDEX_NONE || IsSparseStorage(TypeRemap[SavedIndex]))
+			{
+				bFailed = true;
+				break;
+			}
+
+			Signature[TypeRemap[SavedIndex]] = true;
+		}
+
+		if (bFailed || Ar.IsError()) break;
+
+		const FArchetypeID ArchetypeID = FindOrCreateArchetypeID(Signature);
+		FArchetype& Archetype = GetArchetype(ArchetypeID);
+		const int32 FirstColumn = Archetype.ReserveColumnRange(NumEntities);
+
+		// Restore the records before constructing anything so an invalid ID never leaves initialized columns without an owner
+		for (int32 i = 0; i < NumEntities; ++i)
+		{
+			const FEntityID EntityID = EntityIDs[i];
+			const int32 Index = EntityID.GetIndex();
+			if (!EntityGenerations.IsValidIndex(Index) || EntityGenerations[Index] != EntityID.GetGeneration() || EntityRecords.IsValidIndex(Index))
+			{
+				for (int32 j = 0; j < i; ++j)
+					EntityRecords.RemoveAt(EntityIDs[j].GetIndex());
+
+				bFailed = true;
+				break;
+			}
+
+			new (EntityRecords.InsertUninitialized(Index)) FArchetypeEntityRecord(ArchetypeID, FirstColumn + i);
+		}
+
+		if (bFailed) break;
+
+		// Saved rows follow the saved signature's component bits, which may be ordered differently in this world
+		for (const int32 SavedIndex : SignatureIndices)
+		{
+			if (SavedIndex >= SavedNumComps) continue;
+
+			FArchetype::FComponentsRow& Row = Archetype[Archetype.GetCompRow(FCompTypeID(TypeRemap[SavedIndex]))];
+			const bool bBulk = SavedTypes[SavedIndex].bBulk;
+			Archetype.ForEachColumnRange(FirstColumn, NumEntities, [&](const int32 StartColumn, const int32 Num)
+			{
+				if (bBulk)
+				{
+					Ar.Serialize(Row[StartColumn], Num * Row.GetSize());
+					return;
+				}
+
+				Row.InitializeItems(Row[StartColumn], Num);
+				for (int32 Column = StartColumn; Column < StartColumn + Num; ++Column)
+					SerializeTaggedItem(TaggedAr, Row.GetType(), Row[Column]);
+			});
+		}
+
+		// Components are constructed even if reading failed, so the columns are always owned and destroyed with the world on failure
+		Archetype.SetColumnRangeInitializedFlag(true, FirstColumn, NumEntities);
+		for (int32 i = 0; i < NumEntities; ++i)
+			Archetype.SetColumnEntity(FirstColumn + i, EntityIDs[i]);
+
+		Archetype.MarkColumnsChanged(FirstColumn, NumEntities, AdvanceChangeVersion());
+		bFailed |= Ar.IsError();
+	}
+
+	int32 NumSparseSets = 0;
+	if (!bFailed)
+	{
+		Ar << NumSparseSets;
+		bFailed |= Ar.IsError() || NumSparseSets < 0;
+	}
+
+	for (int32 SetIndex = 0; SetIndex < NumSparseSets && !bFailed; ++SetIndex)
+	{
+		int32 SavedIndex = INDEX_NONE, Num = 0;
+		Ar << SavedIndex << Num;
+		if (Ar.IsError() || !TypeRemap.IsValidIndex(SavedIndex) || TypeRemap[SavedIndex] == INDEX_NONE || !IsSparseStorage(TypeRemap[SavedIndex]) || Num <= 0 || Num > EntityGenerations.Num())
+		{
+			bFailed = true;
+			break;
+		}
+
+		EntityIDs.SetNumUninitialized(Num);
+		for (FEntityID& EntityID : EntityIDs)
+			Ar << EntityID.ID;
+
+		FECSSparseSet& SparseSet = FindOrAddSparseSet(TypeRemap[SavedIndex]);
+		const UScriptStruct* Type = SparseSet.GetType();
+		const bool bBulk = SavedTypes[SavedIndex].bBulk;
+		for (const FEntityID EntityID : EntityIDs)
+		{
+			// Free slots keep their generation, so also require the entity to have been restored by an archetype
+			if (Ar.IsError() || !IsValidEntity(EntityID) || !EntityRecords.IsValidIndex(EntityID.GetIndex()) || SparseSet.Contains(EntityID.GetIndex()))
+			{
+				bFailed = true;
+				break;
+			}
+
+			uint8* Item = SparseSet.AddUninitialized(EntityID);
+			if (!Type) continue;
+
+			if (bBulk)
+			{
+				Ar.Serialize(Item, Type->GetStructureSize());
+			}
+			else
+			{
+				Type->InitializeStruct(Item);
+				SerializeTaggedItem(TaggedAr, Type, Item);
+			}
+		}
+	}
+
+	if (bFailed || Ar.IsError())
+	{
+		DestroyAllEntities();
+		return false;
+	}
+
+	return true;
+}
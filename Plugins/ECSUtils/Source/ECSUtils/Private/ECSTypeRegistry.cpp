@@ -0,0 +1,73 @@
+﻿
+#include "Types/ECSTypeRegistry.h"
+
+#include "Types/ECSBaseTypes.h"
+
+FECSTypeRegistry& FECSTypeRegistry::Get()
+{
+	static FECSTypeRegistry Registry;
+	return Registry;
+}
+
+void FECSTypeRegistry::ProcessPendingTypes()
+{
+	check(IsInGameThread());
+
+	if (PendingTypes.IsEmpty()) return;
+
+	TArray<const UScriptStruct*> NewCompTypes, NewTagTypes;
+	TMap<const UScriptStruct*, EECSStorage> NewStorages;
+	for (const FPendingType& PendingType : PendingTypes)
+	{
+		const UScriptStruct* Type = PendingType.StaticStructFunc();
+		check(Type);
+		checkf(Type->IsChildOf(FECSCompBase::StaticStruct()) || Type->IsChildOf(FECSTagBase::StaticStruct()),
+			TEXT("%s is registered as an ECS type but doesn't derive from FECSCompBase or FECSTagBase"), *Type->GetName());
+
+		if (TypeIndices.Contains(Type)) continue;
+
+		const bool bIsComp = Type->IsChildOf(FECSCompBase::StaticStruct());
+
+		// Reloaded struct replacing a previous one. Keep the previous index
+		if (const int32* Index = TypePathIndices.Find(FName(Type->GetPathName())))
+		{
+			TArray<const UScriptStruct*>& Types = bIsComp ? CompTypes : TagTypes;
+			TypeIndices.Remove(Types[*Index]);
+			TypeIndices.Add(Type, *Index);
+			Types[*Index] = Type;
+			(bIsComp ? CompStorages : TagStorages)[*Index] = PendingType.Storage;
+			continue;
+		}
+
+		(bIsComp ? NewCompTypes : NewTagTypes).AddUnique(Type);
+		NewStorages.Add(Type, PendingType.Storage);
+	}
+	PendingTypes.Empty();
+
+	NewCompTypes.Sort([](const UScriptStruct& A, const UScriptStruct& B)->bool
+		{
+			const int32 SizeA = A.GetStructureSize(), SizeB = B.GetStructureSize();
+			return SizeA != SizeB ? SizeA < SizeB : A.GetUniqueID() < B.GetUniqueID();
+		});
+
+	NewTagTypes.Sort([](const UScriptStruct& A, const UScriptStruct& B)->bool
+		{
+			return A.GetUniqueID() < B.GetUniqueID();
+		});
+
+	for (const UScriptStruct* Type : NewCompTypes)
+	{
+		const int32 Index = CompTypes.Add(Type);
+		CompStorages.Add(NewStorages[Type]);
+		TypeIndices.Add(Type, Index);
+		TypePathIndices.Add(FName(Type->GetPathName()), Index);
+	}
+
+	for (const UScriptStruct* Type : NewTagTypes)
+	{
+		const int32 Index = TagTypes.Add(Type);
+		TagStorages.Add(NewStorages[Type]);
+		TypeIndices.Add(Type, Index);
+		TypePathIndices.Add(FName(Type->GetPathName()), Index);
+	}
+}
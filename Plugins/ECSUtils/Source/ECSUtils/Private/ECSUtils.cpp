@@ -2,17 +2,39 @@
 
 #include "ECSUtils.h"
 
+#include "Misc/CoreDelegates.h"
+#include "Types/ECSFrameAllocator.h"
+#include "Types/ECSStructReferences.h"
+#include "Types/ECSTypeRegistry.h"
+#include "UObject/UObjectGlobals.h"
+
 #define LOCTEXT_NAMESPACE "FECSUtilsModule"
 
 void FECSUtilsModule::StartupModule()
 {
 	// This code will execute after your module is loaded into memory; the exact timing is specified in the .uplugin file per-module
+	EndFrameHandle = FCoreDelegates::OnEndFrame.AddStatic(&FECSFrameArena::AdvanceFrame);
+
+#if WITH_RELOAD
+	// Reloaded modules queue their types again. Patch the registry right away rather than on the next world initialization.
+	// Reference schemas are rebuilt lazily since replaced structs' addresses may be reused
+	ReloadCompleteHandle = FCoreUObjectDelegates::ReloadCompleteDelegate.AddLambda([](EReloadCompleteReason)
+		{
+			FECSTypeRegistry::Get().ProcessPendingTypes();
+			FECSStructReferences::Reset();
+		});
+#endif
 }
 
 void FECSUtilsModule::ShutdownModule()
 {
 	// This function may be called during shutdown to clean up your module.  For modules that support dynamic reloading,
 	// we call this function before unloading the module.
+	FCoreDelegates::OnEndFrame.Remove(EndFrameHandle);
+
+#if WITH_RELOAD
+	FCoreUObjectDelegates::ReloadCompleteDelegate.Remove(ReloadCompleteHandle);
+#endif
 }
 
 #undef LOCTEXT_NAMESPACE
@@ -0,0 +1,46 @@
+
+#include "Misc/AutomationTest.h"
+#include "Types/AnyStruct.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FAnyStructRelocationTest, "ECSUtils.AnyStruct.Relocation", EAutomationTestFlags::EditorContext | EAutomationTestFlags::EngineFilter)
+
+bool FAnyStructRelocationTest::RunTest(const FString& Parameters)
+{
+	static_assert(FAnyStruct::FitsInline(sizeof(FVector), alignof(FVector)), "FVector is expected to be stored inline");
+
+	// TArray growth and RemoveAtSwap relocate elements with a memcpy rather than the move constructor
+	TArray<FAnyStruct> Values;
+	for (int32 i = 0; i < 1000; ++i)
+	{
+		FAnyStruct& Value = Values.Emplace_GetRef(FAnyStruct::Make<FVector>(i, i, i));
+		if (i % 10 == 0)
+		{
+			Value.Set<FTransform>(FTransform(FVector(i)));// Heap allocated
+		}
+	}
+
+	Values.RemoveAtSwap(0);
+	Values.RemoveAtSwap(1);
+	Values.Shrink();
+
+	for (const FAnyStruct& Value : Values)
+	{
+		if (const FVector* Vector = Value.Get<FVector>())
+		{
+			TestTrue(TEXT("Inline payload stays inline after relocation"), Value.IsInline());
+			TestEqual(TEXT("Inline payload survives relocation"), Vector->X, Vector->Y);
+		}
+		else
+		{
+			TestFalse(TEXT("Heap payload stays on the heap after relocation"), Value.IsInline());
+			TestTrue(TEXT("Heap payload survives relocation"), Value.IsA<FTransform>());
+		}
+	}
+
+	Values.Empty();// Must not free inline payloads
+	return true;
+}
+
+#endif
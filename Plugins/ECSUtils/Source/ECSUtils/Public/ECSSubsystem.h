@@ -3,14 +3,35 @@
 
 #include "CoreMinimal.h"
 #include "Algo/IndexOf.h"
+#include "Engine/EngineBaseTypes.h"
 #include "Types/AnyStructArray.h"
 #include "Types/Archetype.h"
 #include "Types/ECSBaseTypes.h"
 #include "Types/ECSIDs.h"
+#include "Types/ECSSparseSet.h"
+#include "Types/ECSSystem.h"
 #include "Types/ECSTypeDescriptions.h"
 #include "Utilities/Metaprogramming.h"
+#include <atomic>
 #include "ECSSubsystem.generated.h"
 
+class FECSCommandBuffer;
+
+// ID of a statically known component / tag type. Every world shares the same registered types so the ID is resolved once per process
+// and read without a function-local static guard
+template<typename T>
+struct TECSTypeIDCache
+{
+	static inline std::atomic<int32> ID{ INDEX_NONE };
+};
+
+// Process-wide slot of a statically known component / tag list. Each world caches its archetype ID for the list at this slot
+template<typename InTCompTypes, typename InTTagTypes>
+struct TECSArchetypeSlotCache
+{
+	static inline std::atomic<int32> Slot{ INDEX_NONE };
+};
+
 UCLASS()
 class ECSUTILS_API UECSSubsystem final : public UWorldSubsystem
 {
@@ -29,6 +50,14 @@ public:
 	template<typename InTCompTypes, typename InTTagTypes = TTagTypes<>, typename... ParamTypes>
 	typename TEnableIf<TIsTCompTypes<InTCompTypes>::Value && TIsTTagTypes<InTTagTypes>::Value && GetTypeListNum(InTCompTypes{}) == sizeof...(ParamTypes), FEntityID>::Type SpawnEntity(ParamTypes&&... Params);
 
+	// Spawns Num entities of one archetype into contiguous columns, default constructing their components. Returns the IDs in column order
+	template<typename InTCompTypes, typename InTTagTypes = TTagTypes<>>
+	typename TEnableIf<TIsTCompTypes<InTCompTypes>::Value && TIsTTagTypes<InTTagTypes>::Value, TArray<FEntityID>>::Type SpawnEntities(const int32 Num);
+
+	// Inits holds one TConstArrayView per component in order. Empty views default construct their component, otherwise they must hold Num values to copy construct from
+	template<typename InTCompTypes, typename InTTagTypes = TTagTypes<>, typename... ViewTypes>
+	typename TEnableIf<TIsTCompTypes<InTCompTypes>::Value && TIsTTagTypes<InTTagTypes>::Value && GetTypeListNum(InTCompTypes{}) == sizeof...(ViewTypes), TArray<FEntityID>>::Type SpawnEntities(const int32 Num, const ViewTypes&... Inits);
+
 	template<typename T>
 	typename TEnableIf<TIsDerivedFrom<T, FECSCompBase>::Value, T*>::Type GetEntityComp(const FEntityID EntityID) const;
 
@@ -37,11 +66,80 @@ public:
 
 	void DestroyEntity(const FEntityID EntityID);
 
+	// Destroys every entity, grouped by archetype so contiguous columns are destroyed in one pass. Packed archetypes are compacted once afterwards
+	void DestroyEntities(const TConstArrayView<FEntityID>& EntityIDs);
+
+	void DestroyAllEntities();
+
+	//~
+	// Snapshots. Each archetype is written as its signature, its entity IDs and one contiguous blob per component row. Rows of plain old data
+	// without object references are bulk copied, others go through tagged properties so they survive layout changes. Sparse sets are written
+	// after the archetypes. Snapshots are native endian. Game thread only, command buffers must be flushed
+
+	void SaveSnapshot(FArchive& Ar) const;
+
+	// Replaces every entity with the snapshot's, keeping their IDs and the generations of free slots. Returns false and leaves the world
+	// empty if the snapshot is invalid or references types that no longer exist
+	bool LoadSnapshot(FArchive& Ar);
+	//~
+
+	//~
+	// Structural changes. Move the entity to the archetype with the component / tag added or removed. Game thread only, use FECSCommandBuffer from queries.
+	// Sparse set stored types (see TECSStorageTraits) are added to / removed from their sparse set instead and never move the entity
+
+	// Constructs the component from Params, replacing its value if the entity already has it
+	template<typename T, typename... ParamTypes>
+	typename TEnableIf<TIsDerivedFrom<T, FECSCompBase>::Value, T&>::Type AddComp(const FEntityID EntityID, ParamTypes&&... Params);
+
+	template<typename T>
+	typename TEnableIf<TIsDerivedFrom<T, FECSCompBase>::Value, bool>::Type RemoveComp(const FEntityID EntityID);
+
+	template<typename T>
+	typename TEnableIf<TIsDerivedFrom<T, FECSTagBase>::Value, bool>::Type AddTag(const FEntityID EntityID);
+
+	template<typename T>
+	typename TEnableIf<TIsDerivedFrom<T, FECSTagBase>::Value, bool>::Type RemoveTag(const FEntityID EntityID);
+
+	// Return whether the entity's archetype or sparse set membership changed
+	bool RemoveComp(const FEntityID EntityID, const FCompTypeID CompTypeID);
+	bool AddTag(const FEntityID EntityID, const FTagTypeID TagTypeID);
+	bool RemoveTag(const FEntityID EntityID, const FTagTypeID TagTypeID);
+	//~
+
+	// Packed archetypes swap-remove destroyed entities to keep their columns contiguous. Enabling compacts the archetype
+	void SetArchetypePacked(const FArchetypeID ArchetypeID, const bool bPacked);
+
 	bool IsValidEntity(const FEntityID EntityID) const;
 	bool EntityHasComp(const FEntityID EntityID, const FCompTypeID CompTypeID) const;
 	bool EntityHasTag(const FEntityID EntityID, const FTagTypeID TagTypeID) const;
 	//~
 
+	//~
+	// Systems
+
+	// Registers a system that runs every frame in the given phase. Functor(const QueryType& Query, const float DeltaTime) is called from a worker thread
+	// concurrently with every other system in the phase whose TReads / TWrites don't conflict with QueryType's
+	template<typename QueryType, typename FunctorType>
+	void RegisterSystem(const FName Name, const EECSSystemPhase Phase, FunctorType&& Functor);
+
+	// Returns a new change version. Queries and structural changes stamp the chunks they write with it. Thread-safe
+	uint32 AdvanceChangeVersion() const;
+
+	// Runs every system registered to the phase, waits for them to complete then flushes the command buffers they recorded
+	void RunSystems(const EECSSystemPhase Phase, const float DeltaTime);
+	//~
+
+	//~
+	// Command buffers
+
+	// Returns the calling thread's command buffer. Thread-safe. Use to make structural changes from within queries and systems
+	FECSCommandBuffer& GetCommandBuffer() const;
+
+	// Plays back every thread's recorded commands. Changes to existing entities are applied in recording order, then spawns are inserted
+	// grouped by archetype. Game thread only. No thread may record while flushing
+	void FlushCommandBuffers();
+	//~
+
 	//~
 	// ID Getters
 	FCompTypeID FindCompTypeID(const UScriptStruct* Type) const;
@@ -53,6 +151,10 @@ public:
 	template<typename T>
 	typename TEnableIf<TIsDerivedFrom<T, FECSTagBase>::Value, FTagTypeID>::Type GetTagTypeID() const;
 
+	// FCompTypeID, or FTagTypeID offset by GetNumComps(), of the type within archetype / query signatures
+	template<typename T>
+	int32 GetSignatureIndex() const;
+
 	const FCompDescription& GetCompDescription(const FCompTypeID ID) const;
 	const FTagDescription& GetTagDescription(const FTagTypeID ID) const;
 
@@ -62,10 +164,19 @@ public:
 	template<typename T>
 	typename TEnableIf<TIsDerivedFrom<T, FECSTagBase>::Value, const FTagDescription&>::Type GetTagDescription() const;
 
+	// Finds the archetype matching the given components and tags. Creates it if it doesn't exist yet
 	FArchetypeID FindArchetypeID(const TConstArrayView<FCompTypeID>& CompIDs, const TConstArrayView<FTagTypeID>& TagIDs) const;
 
+	// Signature is a bitmask of component IDs followed by tag IDs offset by GetNumComps(). Creates the archetype if it doesn't exist yet
+	FArchetypeID FindOrCreateArchetypeID(const TBitArray<>& Signature) const;
+
 	template<typename InTCompTypes, typename InTTagTypes = TTagTypes<>>
 	typename TEnableIf<TIsTCompTypes<InTCompTypes>::Value && TIsTTagTypes<InTTagTypes>::Value, FArchetypeID>::Type GetArchetypeID() const;
+
+	// Registers a cached query for the signatures if one doesn't exist yet. Its matching archetypes are kept up to date as archetypes are created.
+	// Matches have every RequiredSignature bit, none of ExcludedSignature's and at least one of AnyOfSignature's. OptionalSignature components get a row per match
+	// that's INDEX_NONE if missing. Filter signatures may be left empty
+	FQueryID FindOrAddQuery(const TBitArray<>& RequiredSignature, const TBitArray<>& ExcludedSignature = TBitArray<>(), const TBitArray<>& AnyOfSignature = TBitArray<>(), const TBitArray<>& OptionalSignature = TBitArray<>()) const;
 	//~
 
 	//~
@@ -74,7 +185,22 @@ public:
 
 	FArchetype& GetArchetype(const FArchetypeID ArchetypeID) const;
 
+	const FQueryDescription& GetQueryDescription(const FQueryID QueryID) const;
+
+	// Whether the type is sparse set stored, as recorded from its TECSStorageTraits at registration. Holds whether or not its sparse set exists yet
+	bool IsSparseStorage(const int32 SignatureIndex) const;
+
+	// Returns null if the type isn't sparse set stored or nothing has used its sparse set yet
+	FECSSparseSet* FindSparseSet(const int32 SignatureIndex) const;
+
+	// Creates the sparse set on first use. Only valid for sparse set stored types. Game thread only
+	FECSSparseSet& FindOrAddSparseSet(const int32 SignatureIndex) const;
+
+	template<typename T>
+	FECSSparseSet& GetSparseSet() const;
+
 	FORCEINLINE const TArray<FArchetype>& GetArchetypes() const { return RegisteredArchetypes; }
+	FORCEINLINE const TArray<TUniquePtr<FECSSystem>>& GetSystems(const EECSSystemPhase Phase) const { return SystemPhases[(int32)Phase].Systems; }
 	FORCEINLINE int32 GetNumComps() const { return RegisteredComponents.Num(); }
 	FORCEINLINE int32 GetNumTags() const { return RegisteredTags.Num(); }
 	//~
@@ -83,6 +209,7 @@ protected:
 	// Index via FEntityID
 	using FEntityRecordSparseArray = TSparseArray<FArchetypeEntityRecord, TSparseArrayAllocator<TSizedDefaultAllocator<64>, TSizedDefaultAllocator<64>>>;
 	FEntityRecordSparseArray EntityRecords;
+	TArray<uint32> EntityGenerations;// Current generation of each entity record slot, wrapping on overflow. Index via FEntityID::GetIndex()
 	
 	//~
 	// Registered types
@@ -91,24 +218,88 @@ protected:
 	UPROPERTY() mutable TArray<FArchetype> RegisteredArchetypes;// Archetypes are lazily loaded. Index via FArchetypeID
 	//~
 
+	// Index via archetype signature
+	mutable TMap<TBitArray<>, FArchetypeID, FDefaultSetAllocator, TSignatureKeyFuncs<FArchetypeID>> ArchetypeSignatures;
+	mutable TArray<FArchetypeID> StaticArchetypeIDs;// Archetype of each statically known type list. Index via TECSArchetypeSlotCache::Slot
+
+	//~
+	// Cached queries
+	mutable TArray<FQueryDescription> RegisteredQueries;// Index via FQueryID
+	mutable TMap<TBitArray<>, FQueryID, FDefaultSetAllocator, TSignatureKeyFuncs<FQueryID>> QuerySignatures;
+	//~
+
+	FECSSystemPhase SystemPhases[(int32)EECSSystemPhase::Num];// Index via EECSSystemPhase
+
+	mutable FThreadSafeCounter ChangeVersion;// Most recently handed out change version
+
+	//~
+	// Sparse set storage
+	mutable TArray<TUniquePtr<FECSSparseSet>> SparseSets;// Null until first used. Index via signature index
+	mutable TArray<FECSSparseSet*> ActiveSparseSets;// Every created sparse set so destroyed entities can be removed from them. Empty unless a sparse set stored type was used
+	//~
+
+	//~
+	// Command buffers
+	mutable TMap<uint32, FECSCommandBuffer*> CommandBuffers;// Index via thread ID
+	mutable FCriticalSection CommandBuffersMutex;
+	uint32 CommandBuffersSerial;// Unique per initialization. Invalidates thread local caches of previous subsystems' buffers
+	//~
+
 private:
 	// Number of entities to allocate at once when space runs out
 	static constexpr SIZE_T ENTITY_ALLOC_CHUNK_SIZE = 64;
 	
 	void RegisterComponentsAndTags();
 
+	static int32 AllocateArchetypeSlot();
+
+	void OnWorldPreActorTick(UWorld* World, ELevelTick TickType, float DeltaSeconds);
+	void OnWorldPostActorTick(UWorld* World, ELevelTick TickType, float DeltaSeconds);
+
+	FDelegateHandle PreActorTickHandle;
+	FDelegateHandle PostActorTickHandle;
+
 	template<typename... InTCompTypes, typename... InTTagTypes>
 	FEntityID InternalSpawnEntity(TCompTypes<InTCompTypes...>&&, TTagTypes<InTTagTypes...>&&);
 
 	template<typename... InTCompTypes, typename... InTTagTypes, typename... ParamTypes>
 	FEntityID InternalSpawnEntityWithEmplace(TCompTypes<InTCompTypes...>&&, TTagTypes<InTTagTypes...>&&, ParamTypes&&... Params);
 	
+	template<typename... InTCompTypes, typename... InTTagTypes, typename... ViewTypes>
+	TArray<FEntityID> InternalSpawnEntities(TCompTypes<InTCompTypes...>&&, TTagTypes<InTTagTypes...>&&, const int32 Num, const ViewTypes&... Inits);
+
+	template<typename T>
+	static void InternalConstructRowRange(FArchetype& Archetype, FArchetype::FComponentsRow& Row, const int32 FirstColumn, const int32 Num, const TConstArrayView<T>& Init);
+	
 	template<typename... InTCompTypes, typename... InTTagTypes>
 	FArchetypeID InternalFindArchetypeID(TCompTypes<InTCompTypes...>&&, TTagTypes<InTTagTypes...>&&) const;
 
+	// Allocates an entity record at the lowest free slot. Pass the same LowestFreeIndex across batched calls to resume the free slot search
+	FEntityID AddEntityRecord(int32& LowestFreeIndex, const FArchetypeID ArchetypeID, const int32 ColumnIndex);
+
+	// Frees the entity's record slot and invalidates every handle to it. Sparse set membership is left to the caller
+	void RemoveEntityRecord(const FEntityID EntityID);
+
+	// Removes the entities from every sparse set once per batch. Free when no sparse set has been used
+	void RemoveFromSparseSets(const TConstArrayView<FEntityID>& EntityIDs);
+
+	static bool IsQueryMatch(const FQueryDescription& Query, const FArchetype& Archetype);
+
+	// Appends the archetype and its resolved rows to the query's matches
+	void AddQueryMatch(FQueryDescription& Query, const FArchetypeID ArchetypeID) const;
+
+	// Archetype with the signature bit (FCompTypeID, or FTagTypeID offset by GetNumComps()) set or cleared. Cached on the archetypes' edges in both directions
+	FArchetypeID FindTransitionArchetypeID(const FArchetypeID ArchetypeID, const int32 SignatureIndex, const bool bAdd) const;
+
+	// Relocates the entity's shared components into a column of the new archetype and destroys the rest. Components only in the new archetype are left uninitialized. Returns the new column
+	int32 MoveEntityToArchetype(const FEntityID EntityID, const FArchetypeID NewArchetypeID);
+
 	template<typename InTCompType, typename... OtherInTCompTypes, typename ParamType, typename... OtherParamTypes>
 	void InternalConstructCompsAtColumn(TCompTypes<InTCompType, OtherInTCompTypes...>&&, FArchetype& Archetype, const int32 ColumnIndex, ParamType&& Param, OtherParamTypes&&... OtherParams);
 
+public:
+	static void AddReferencedObjects(UObject* InThis, FReferenceCollector& Collector);
+
 protected:
 	//~ Begin USubsystem interface
 	virtual void Initialize(FSubsystemCollectionBase& Collection) override;
@@ -140,10 +331,12 @@ UE_NODISCARD inline FEntityID UECSSubsystem::InternalSpawnEntity(TCompTypes<InTC
 	
 	FArchetype& Archetype = RegisteredArchetypes[(int32)ArchetypeID];
 	const int32 ColumnIndex = Archetype.AddAtFirstUninitialized(nullptr, ENTITY_ALLOC_CHUNK_SIZE);// @TODO Make non-defaulted versions as well
+	Archetype.MarkColumnsChanged(ColumnIndex, 1, AdvanceChangeVersion());
 
 	int32 Zero = 0;
-	const int32 EntityIndex = EntityRecords.EmplaceAtLowestFreeIndex(Zero, ArchetypeID, ColumnIndex);
-	return FEntityID(EntityIndex);
+	const FEntityID EntityID = AddEntityRecord(Zero, ArchetypeID, ColumnIndex);
+	Archetype.SetColumnEntity(ColumnIndex, EntityID);
+	return EntityID;
 }
 
 template<typename... InTCompTypes, typename... InTTagTypes, typename... ParamTypes>
@@ -167,10 +360,85 @@ UE_NODISCARD inline FEntityID UECSSubsystem::InternalSpawnEntityWithEmplace(TCom
 	
 	InternalConstructCompsAtColumn(TCompTypes<InTCompTypes...>{}, Archetype, ColumnIndex, Forward<ParamTypes>(Params)...);
 	Archetype.SetColumnInitializedFlag(true, ColumnIndex);
+	Archetype.MarkColumnsChanged(ColumnIndex, 1, AdvanceChangeVersion());
 
 	int32 Zero = 0;
-	const int32 EntityIndex = EntityRecords.EmplaceAtLowestFreeIndex(Zero, ArchetypeID, ColumnIndex);
-	return FEntityID(EntityIndex);
+	const FEntityID EntityID = AddEntityRecord(Zero, ArchetypeID, ColumnIndex);
+	Archetype.SetColumnEntity(ColumnIndex, EntityID);
+	return EntityID;
+}
+
+template<typename InTCompTypes, typename InTTagTypes>
+UE_NODISCARD FORCEINLINE typename TEnableIf<TIsTCompTypes<InTCompTypes>::Value && TIsTTagTypes<InTTagTypes>::Value, TArray<FEntityID>>::Type UECSSubsystem::SpawnEntities(const int32 Num)
+{
+	return InternalSpawnEntities(InTCompTypes{}, InTTagTypes{}, Num);
+}
+
+template<typename InTCompTypes, typename InTTagTypes, typename... ViewTypes>
+UE_NODISCARD FORCEINLINE typename TEnableIf<TIsTCompTypes<InTCompTypes>::Value && TIsTTagTypes<InTTagTypes>::Value && GetTypeListNum(InTCompTypes{}) == sizeof...(ViewTypes), TArray<FEntityID>>::Type UECSSubsystem::SpawnEntities(const int32 Num, const ViewTypes&... Inits)
+{
+	return InternalSpawnEntities(InTCompTypes{}, InTTagTypes{}, Num, Inits...);
+}
+
+template<typename... InTCompTypes, typename... InTTagTypes, typename... ViewTypes>
+UE_NODISCARD inline TArray<FEntityID> UECSSubsystem::InternalSpawnEntities(TCompTypes<InTCompTypes...>&&, TTagTypes<InTTagTypes...>&&, const int32 Num, const ViewTypes&... Inits)
+{
+	check(Num >= 0);
+
+	TArray<FEntityID> EntityIDs;
+	if (Num == 0) return EntityIDs;
+
+	using FInitViews = TTuple<TConstArrayView<InTCompTypes>...>;
+	FInitViews InitViews;
+	if constexpr (sizeof...(ViewTypes) != 0)
+	{
+		InitViews = FInitViews(TConstArrayView<InTCompTypes>(Inits)...);
+	}
+
+	const FArchetypeID ArchetypeID = GetArchetypeID<TCompTypes<InTCompTypes...>, TTagTypes<InTTagTypes...>>();
+	FArchetype& Archetype = GetArchetype(ArchetypeID);
+
+	// Grow once and construct every row over the whole range
+	const int32 FirstColumn = Archetype.ReserveColumnRange(Num);
+	InitViews.ApplyAfter([&](const auto&... Views)
+	{
+		(InternalConstructRowRange(Archetype, Archetype[Archetype.GetCompRow(GetCompTypeID<InTCompTypes>())], FirstColumn, Num, Views), ...);
+	});
+
+	Archetype.SetColumnRangeInitializedFlag(true, FirstColumn, Num);
+	Archetype.MarkColumnsChanged(FirstColumn, Num, AdvanceChangeVersion());
+
+	EntityRecords.Reserve(EntityRecords.Num() + Num);
+	EntityIDs.SetNumUninitialized(Num);
+
+	int32 LowestFreeIndex = 0;
+	for (int32 i = 0; i < Num; ++i)
+	{
+		EntityIDs[i] = AddEntityRecord(LowestFreeIndex, ArchetypeID, FirstColumn + i);
+		Archetype.SetColumnEntity(FirstColumn + i, EntityIDs[i]);
+	}
+
+	return EntityIDs;
+}
+
+template<typename T>
+inline void UECSSubsystem::InternalConstructRowRange(FArchetype& Archetype, FArchetype::FComponentsRow& Row, const int32 FirstColumn, const int32 Num, const TConstArrayView<T>& Init)
+{
+	checkf(Init.IsEmpty() || Init.Num() == Num, TEXT("Expected %i initial values for %s, got %i"), Num, *Row.GetType()->GetName(), Init.Num());
+	check(Row.GetSize() == sizeof(T));
+
+	// Ranges are contiguous within a chunk
+	Archetype.ForEachColumnRange(FirstColumn, Num, [&](const int32 StartColumn, const int32 RangeNum)
+	{
+		if (Init.IsEmpty())
+		{
+			Row.InitializeItems(Row[StartColumn], RangeNum);
+		}
+		else
+		{
+			ConstructItems<T>(Row[StartColumn], Init.GetData() + (StartColumn - FirstColumn), RangeNum);
+		}
+	});
 }
 
 template<typename InTCompType, typename... OtherInTCompTypes, typename ParamType, typename... OtherParamTypes>
@@ -186,44 +454,170 @@ FORCEINLINE void UECSSubsystem::InternalConstructCompsAtColumn(TCompTypes<InTCom
 	}
 }
 
+template<typename T, typename... ParamTypes>
+inline typename TEnableIf<TIsDerivedFrom<T, FECSCompBase>::Value, T&>::Type UECSSubsystem::AddComp(const FEntityID EntityID, ParamTypes&&... Params)
+{
+	check(IsValidEntity(EntityID));
+
+	if constexpr (TIsSparseStorage<T>::Value)
+	{
+		FECSSparseSet& SparseSet = GetSparseSet<T>();
+		T* Comp = (T*)SparseSet.Find(EntityID.GetIndex());
+		if (Comp)
+		{
+			DestructItem(Comp);
+		}
+		else
+		{
+			Comp = (T*)SparseSet.AddUninitialized(EntityID);
+		}
+
+		return *new (Comp) T{Forward<ParamTypes>(Params)...};
+	}
+	else
+	{
+		const FCompTypeID CompID = GetCompTypeID<T>();
+		const bool bReplace = EntityHasComp(EntityID, CompID);
+		if (!bReplace)
+		{
+			MoveEntityToArchetype(EntityID, FindTransitionArchetypeID(EntityRecords[EntityID.GetIndex()].ArchetypeID, CompID.ToInt(), true));
+		}
+
+		const FArchetypeEntityRecord& Record = EntityRecords[EntityID.GetIndex()];
+		FArchetype& Archetype = GetArchetype(Record.ArchetypeID);
+		const int32 RowIndex = Archetype.GetCompRow(CompID);
+		T* Comp = (T*)Archetype[RowIndex][Record.ColumnIndex];
+		if (bReplace)
+		{
+			DestructItem(Comp);
+			Archetype.MarkRowChanged(RowIndex, Record.ColumnIndex / Archetype.GetChunkCapacity(), AdvanceChangeVersion());
+		}
+
+		return *new (Comp) T{Forward<ParamTypes>(Params)...};
+	}
+}
+
+template<typename T>
+FORCEINLINE typename TEnableIf<TIsDerivedFrom<T, FECSCompBase>::Value, bool>::Type UECSSubsystem::RemoveComp(const FEntityID EntityID)
+{
+	if constexpr (TIsSparseStorage<T>::Value)
+	{
+		check(IsValidEntity(EntityID));
+		return GetSparseSet<T>().Remove(EntityID.GetIndex());
+	}
+	else
+	{
+		return RemoveComp(EntityID, GetCompTypeID<T>());
+	}
+}
+
+template<typename T>
+FORCEINLINE typename TEnableIf<TIsDerivedFrom<T, FECSTagBase>::Value, bool>::Type UECSSubsystem::AddTag(const FEntityID EntityID)
+{
+	return AddTag(EntityID, GetTagTypeID<T>());
+}
+
+template<typename T>
+FORCEINLINE typename TEnableIf<TIsDerivedFrom<T, FECSTagBase>::Value, bool>::Type UECSSubsystem::RemoveTag(const FEntityID EntityID)
+{
+	return RemoveTag(EntityID, GetTagTypeID<T>());
+}
+
+template<typename QueryType, typename FunctorType>
+inline void UECSSubsystem::RegisterSystem(const FName Name, const EECSSystemPhase Phase, FunctorType&& Functor)
+{
+	check(Phase < EECSSystemPhase::Num);
+
+	FECSSystemPhase& SystemPhase = SystemPhases[(int32)Phase];
+	SystemPhase.Systems.Emplace(MakeUnique<TECSQuerySystem<QueryType, typename TDecay<FunctorType>::Type>>(Name, this, Forward<FunctorType>(Functor)));
+	SystemPhase.bGraphDirty = true;
+}
+
 inline void UECSSubsystem::DestroyEntity(const FEntityID EntityID)
 {
 	check(IsValidEntity(EntityID));
 
-	const FArchetypeEntityRecord& Record = EntityRecords[EntityID.ToInt()];
+	const FArchetypeEntityRecord& Record = EntityRecords[EntityID.GetIndex()];
 	check(RegisteredArchetypes.IsValidIndex(Record.ArchetypeID.ToInt()));
 
 	FArchetype& Archetype = RegisteredArchetypes[Record.ArchetypeID.ToInt()];
-	Archetype.DestructAt(Record.ColumnIndex);
 
-	EntityRecords.RemoveAt(EntityID.ToInt());
+	// Packed archetypes move their last entity into the freed column
+	FEntityID MovedEntity;
+	if (Archetype.DestructAt(Record.ColumnIndex, &MovedEntity) && MovedEntity != FEntityID())
+	{
+		EntityRecords[MovedEntity.GetIndex()].ColumnIndex = Record.ColumnIndex;
+	}
+
+	for (FECSSparseSet* SparseSet : ActiveSparseSets)
+		SparseSet->Remove(EntityID.GetIndex());
+
+	RemoveEntityRecord(EntityID);
+}
+
+FORCEINLINE FEntityID UECSSubsystem::AddEntityRecord(int32& LowestFreeIndex, const FArchetypeID ArchetypeID, const int32 ColumnIndex)
+{
+	const int32 Index = EntityRecords.EmplaceAtLowestFreeIndex(LowestFreeIndex, ArchetypeID, ColumnIndex);
+	if (Index >= EntityGenerations.Num())
+	{
+		EntityGenerations.SetNumZeroed(Index + 1);
+	}
+
+	return FEntityID(Index, EntityGenerations[Index]);
+}
+
+FORCEINLINE void UECSSubsystem::RemoveEntityRecord(const FEntityID EntityID)
+{
+	check(IsValidEntity(EntityID));
+
+	EntityRecords.RemoveAt(EntityID.GetIndex());
+	++EntityGenerations[EntityID.GetIndex()];
+}
+
+FORCEINLINE uint32 UECSSubsystem::AdvanceChangeVersion() const
+{
+	return (uint32)ChangeVersion.Increment();
 }
 
 FORCEINLINE bool UECSSubsystem::IsValidEntity(const FEntityID EntityID) const
 {
-	return EntityRecords.IsValidIndex(EntityID.ToInt());
+	// Freed slots bump their generation so a single compare rejects both stale and never allocated handles
+	const int32 Index = EntityID.GetIndex();
+	return (uint32)Index < (uint32)EntityGenerations.Num() && EntityGenerations[Index] == EntityID.GetGeneration();
 }
 
 
 inline bool UECSSubsystem::EntityHasComp(const FEntityID EntityID, const FCompTypeID CompTypeID) const
 {
 	if (!ensure(IsValidEntity(EntityID))) return false;
+
+	const int32 Index = CompTypeID.ToInt();
+	if (IsSparseStorage(Index))
+	{
+		const FECSSparseSet* SparseSet = FindSparseSet(Index);
+		return SparseSet && SparseSet->Contains(EntityID.GetIndex());
+	}
 	
-	const FArchetypeEntityRecord& Record = EntityRecords[EntityID.ToInt()];
+	const FArchetypeEntityRecord& Record = EntityRecords[EntityID.GetIndex()];
 	check(RegisteredArchetypes.IsValidIndex(Record.ArchetypeID.ToInt()));
 	
-	const int32 Index = CompTypeID.ToInt();
 	return RegisteredArchetypes[Record.ArchetypeID.ToInt()].IncludedCompTagBitMask[Index / FArchetype::BITELEM_SIZE_BITS] & 1ull << Index % FArchetype::BITELEM_SIZE_BITS;
 }
 
 inline bool UECSSubsystem::EntityHasTag(const FEntityID EntityID, const FTagTypeID TagTypeID) const
 {
 	if (!ensure(IsValidEntity(EntityID))) return false;
+
+	const int32 Index = TagTypeID.ToInt() + RegisteredComponents.Num();
+	if (IsSparseStorage(Index))
+	{
+		const FECSSparseSet* SparseSet = FindSparseSet(Index);
+		return SparseSet && SparseSet->Contains(EntityID.GetIndex());
+	}
 	
-	const FArchetypeEntityRecord& Record = EntityRecords[(int32)EntityID];
+	const FArchetypeEntityRecord& Record = EntityRecords[EntityID.GetIndex()];
 	check(RegisteredArchetypes.IsValidIndex((int32)Record.ArchetypeID));
 	
-	const int32 Index = TagTypeID.ToInt() + RegisteredComponents.Num();
 	return RegisteredArchetypes[Record.ArchetypeID.ToInt()].IncludedCompTagBitMask[Index / FArchetype::BITELEM_SIZE_BITS] & 1ull << Index % FArchetype::BITELEM_SIZE_BITS;
 }
 
@@ -232,6 +626,9 @@ UE_NODISCARD inline typename TEnableIf<TIsDerivedFrom<T, FECSCompBase>::Value, T
 {
 	check(IsValidEntity(EntityID));
 
+	if constexpr (TIsSparseStorage<T>::Value)
+		return (T*)GetSparseSet<T>().Find(EntityID.GetIndex());
+
 	const FCompTypeID CompID = GetCompTypeID<T>();
 	if (!EntityHasComp(EntityID, CompID)) return nullptr;
 
@@ -248,6 +645,14 @@ template<typename T>
 UE_NODISCARD inline typename TEnableIf<TIsDerivedFrom<T, FECSCompBase>::Value, T&>::Type UECSSubsystem::GetEntityCompChecked(const FEntityID EntityID) const
 {
 	check(IsValidEntity(EntityID));
+
+	if constexpr (TIsSparseStorage<T>::Value)
+	{
+		T* Comp = (T*)GetSparseSet<T>().Find(EntityID.GetIndex());
+		check(Comp);
+		return *Comp;
+	}
+
 	const FCompTypeID CompID = GetCompTypeID<T>();
 	check(EntityHasComp(EntityID, CompID));
 
@@ -264,15 +669,42 @@ UE_NODISCARD inline typename TEnableIf<TIsDerivedFrom<T, FECSCompBase>::Value, T
 template<typename T>
 UE_NODISCARD FORCEINLINE typename TEnableIf<TIsDerivedFrom<T, FECSCompBase>::Value, FCompTypeID>::Type UECSSubsystem::GetCompTypeID() const
 {
-	static const auto ID = FindCompTypeID(T::StaticStruct());
-	return ID;
+	int32 ID = TECSTypeIDCache<T>::ID.load(std::memory_order_relaxed);
+	if (UNLIKELY(ID == INDEX_NONE))
+	{
+		ID = FindCompTypeID(T::StaticStruct()).ToInt();
+		TECSTypeIDCache<T>::ID.store(ID, std::memory_order_relaxed);
+	}
+
+	checkSlow(RegisteredComponents.IsValidIndex(ID));
+	return FCompTypeID(ID);
 }
 
 template<typename T>
 UE_NODISCARD FORCEINLINE typename TEnableIf<TIsDerivedFrom<T, FECSTagBase>::Value, FTagTypeID>::Type UECSSubsystem::GetTagTypeID() const
 {
-	static const auto ID = FindTagTypeID(T::StaticStruct());
-	return ID;
+	int32 ID = TECSTypeIDCache<T>::ID.load(std::memory_order_relaxed);
+	if (UNLIKELY(ID == INDEX_NONE))
+	{
+		ID = FindTagTypeID(T::StaticStruct()).ToInt();
+		TECSTypeIDCache<T>::ID.store(ID, std::memory_order_relaxed);
+	}
+
+	checkSlow(RegisteredTags.IsValidIndex(ID));
+	return FTagTypeID(ID);
+}
+
+template<typename T>
+UE_NODISCARD FORCEINLINE int32 UECSSubsystem::GetSignatureIndex() const
+{
+	if constexpr (TIsDerivedFrom<T, FECSCompBase>::Value)
+	{
+		return GetCompTypeID<T>().ToInt();
+	}
+	else
+	{
+		return GetTagTypeID<T>().ToInt() + GetNumComps();
+	}
 }
 
 UE_NODISCARD FORCEINLINE const FCompDescription& UECSSubsystem::GetCompDescription(const FCompTypeID ID) const
@@ -308,69 +740,45 @@ UE_NODISCARD FORCEINLINE typename TEnableIf<TIsTCompTypes<InTCompTypes>::Value &
 template<typename... InTCompTypes, typename... InTTagTypes>
 UE_NODISCARD inline FArchetypeID UECSSubsystem::InternalFindArchetypeID(TCompTypes<InTCompTypes...>&&, TTagTypes<InTTagTypes...>&&) const
 {
-	// Statically generate a bitmask from the template parameters for searching for a valid Archetype
-	static const TBitArray<> BitMask([this]
-		{
-			TBitArray<> Bitmask(false, RegisteredComponents.Num() + RegisteredTags.Num());
-			for (const FCompTypeID& ID : { GetCompTypeID<InTCompTypes>()... })
-				Bitmask[(int32)ID] = true;
-
-			if constexpr (sizeof...(InTTagTypes) != 0)
-				for (const FTagTypeID& ID : { GetTagTypeID<InTTagTypes>()... })
-					Bitmask[(int32)ID + RegisteredComponents.Num()] = true;
-		
-			return Bitmask;
-		}());
-
-	// @TODO: Improve linear search with a map or binary search
-	// Find a matching archetype
-	int32 Index = RegisteredArchetypes.IndexOfByPredicate([](const FArchetype& Archetype)->bool{ return FMemory::Memcmp(BitMask.GetData(), Archetype.IncludedCompTagBitMask, FMath::DivideAndRoundUp(Archetype.NumRows, 8)) == 0; });
-	if (LIKELY(Index != INDEX_NONE))
-		return FArchetypeID(Index);
-
-	// If there was no matching archetype, generate a new archetype. Should only happen once per template instantiation
-	const UScriptStruct* CompTypes[] = { InTCompTypes::StaticStruct()... };
-	Algo::Sort(CompTypes, [](const UScriptStruct* A, const UScriptStruct* B)->bool
-		{
-			const int32 SizeA = A->GetStructureSize(), SizeB = B->GetStructureSize();
-			return SizeA != SizeB ? SizeA < SizeB : A->GetUniqueID() < B->GetUniqueID();
-		});
+	static_assert(!TOr<TIsSparseStorage<InTCompTypes>..., TIsSparseStorage<InTTagTypes>...>::Value, "Sparse set stored types aren't part of archetypes. Add them with AddComp / AddTag instead!");
 
-	Index = RegisteredArchetypes.Emplace(BitMask, TConstArrayView<const UScriptStruct*>(CompTypes, sizeof...(InTCompTypes)));
-	const FArchetypeID NewID(Index);
-	
-	// Add newly generated archetype to component description's referenced archetypes array
-	for (const FCompTypeID& CompTypeID : { GetCompTypeID<InTCompTypes>()... })
+	// Look the archetype up by the type list's slot instead of hashing its signature on every spawn
+	std::atomic<int32>& SlotCache = TECSArchetypeSlotCache<TCompTypes<InTCompTypes...>, TTagTypes<InTTagTypes...>>::Slot;
+	int32 Slot = SlotCache.load(std::memory_order_relaxed);
+	if (UNLIKELY(Slot == INDEX_NONE))
 	{
-		FCompDescription& CompDescription = RegisteredComponents[(int32)CompTypeID];
-		TArray<FArchetypeCompRecord>& ArchetypeIDs = CompDescription.ReferencedArchetypes;
-		ArchetypeIDs.EmplaceAt(Algo::LowerBoundBy(ArchetypeIDs, NewID, &FArchetypeCompRecord::ID), NewID, Algo::IndexOf(CompTypes, CompDescription.Type));
+		// Another thread may have allocated one first, in which case Slot receives it
+		const int32 NewSlot = AllocateArchetypeSlot();
+		if (SlotCache.compare_exchange_strong(Slot, NewSlot))
+		{
+			Slot = NewSlot;
+		}
 	}
 
-	// Add newly generated archetype to tag description's referenced archetypes array
+	if (LIKELY(StaticArchetypeIDs.IsValidIndex(Slot) && StaticArchetypeIDs[Slot] != FArchetypeID()))
+		return StaticArchetypeIDs[Slot];
+
+	TBitArray<> Signature(false, RegisteredComponents.Num() + RegisteredTags.Num());
+	for (const FCompTypeID& ID : { GetCompTypeID<InTCompTypes>()... })
+		Signature[ID.ToInt()] = true;
+
 	if constexpr (sizeof...(InTTagTypes) != 0)
+		for (const FTagTypeID& ID : { GetTagTypeID<InTTagTypes>()... })
+			Signature[ID.ToInt() + RegisteredComponents.Num()] = true;
+
+	if (Slot >= StaticArchetypeIDs.Num())
 	{
-		const UScriptStruct* TagTypes[] = { InTTagTypes::StaticStruct()... };
-		Algo::Sort(TagTypes, [](const UScriptStruct* A, const UScriptStruct* B)->bool
-			{
-				return A->GetUniqueID() < B->GetUniqueID();
-			});
-		
-		for (const FTagTypeID& TagTypeID : { GetTagTypeID<InTTagTypes>()... })
-		{
-			FTagDescription& TagDescription = RegisteredTags[(int32)TagTypeID];
-			TArray<FArchetypeCompRecord>& ArchetypeIDs = TagDescription.ReferencedArchetypes;
-			ArchetypeIDs.EmplaceAt(Algo::LowerBoundBy(ArchetypeIDs, NewID, &FArchetypeCompRecord::ID), NewID, Algo::IndexOf(TagTypes, TagDescription.Type));
-		}
+		StaticArchetypeIDs.SetNum(Slot + 1);
 	}
-	
-	return NewID;
+
+	StaticArchetypeIDs[Slot] = FindOrCreateArchetypeID(Signature);
+	return StaticArchetypeIDs[Slot];
 }
 
 UE_NODISCARD FORCEINLINE const FArchetypeEntityRecord& UECSSubsystem::GetEntityRecord(const FEntityID EntityID) const
 {
 	check(IsValidEntity(EntityID));
-	return EntityRecords[(int32)EntityID];
+	return EntityRecords[EntityID.GetIndex()];
 }
 
 UE_NODISCARD FORCEINLINE FArchetype& UECSSubsystem::GetArchetype(const FArchetypeID ArchetypeID) const
@@ -379,6 +787,35 @@ UE_NODISCARD FORCEINLINE FArchetype& UECSSubsystem::GetArchetype(const FArchetyp
 	return RegisteredArchetypes[ArchetypeID.ToInt()];
 }
 
+UE_NODISCARD FORCEINLINE const FQueryDescription& UECSSubsystem::GetQueryDescription(const FQueryID QueryID) const
+{
+	check(RegisteredQueries.IsValidIndex(QueryID.ToInt()));
+	return RegisteredQueries[QueryID.ToInt()];
+}
+
+UE_NODISCARD FORCEINLINE bool UECSSubsystem::IsSparseStorage(const int32 SignatureIndex) const
+{
+	const EECSStorage Storage = SignatureIndex < RegisteredComponents.Num()
+		? GetCompDescription(FCompTypeID(SignatureIndex)).Storage
+		: GetTagDescription(FTagTypeID(SignatureIndex - RegisteredComponents.Num())).Storage;
+
+	return Storage == EECSStorage::SparseSet;
+}
+
+UE_NODISCARD FORCEINLINE FECSSparseSet* UECSSubsystem::FindSparseSet(const int32 SignatureIndex) const
+{
+	check(SparseSets.IsValidIndex(SignatureIndex));
+	return SparseSets[SignatureIndex].Get();
+}
+
+template<typename T>
+UE_NODISCARD FORCEINLINE FECSSparseSet& UECSSubsystem::GetSparseSet() const
+{
+	static_assert(TIsSparseStorage<T>::Value, "GetSparseSet: T isn't sparse set stored. Specialize TECSStorageTraits for it!");
+	checkSlow(IsSparseStorage(GetSignatureIndex<T>()));// Registered before its TECSStorageTraits specialization was visible
+	return FindOrAddSparseSet(GetSignatureIndex<T>());
+}
+
 USTRUCT()
 struct ECSUTILS_API FComp1 : public FECSCompBase
 {
@@ -415,6 +852,19 @@ struct ECSUTILS_API FComp2 : public FECSCompBase
 	FVector Something;
 };
 
+// Only holds a FVector so rows can be zero initialized and skip destruction. Reflected so archetypes pick it up from the struct flags
+static_assert(TIsTriviallyDestructible<FComp2>::Value, "FComp2 no longer trivially destructible, remove WithNoDestructor");
+
+template<>
+struct TStructOpsTypeTraits<FComp2> : TStructOpsTypeTraitsBase2<FComp2>
+{
+	enum
+	{
+		WithZeroConstructor = true,
+		WithNoDestructor = true,
+	};
+};
+
 USTRUCT()
 struct ECSUTILS_API FComp3 : public FECSCompBase
 {
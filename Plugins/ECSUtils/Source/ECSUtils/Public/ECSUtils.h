@@ -11,4 +11,11 @@ public:
 	/** IModuleInterface implementation */
 	virtual void StartupModule() override;
 	virtual void ShutdownModule() override;
+
+private:
+	FDelegateHandle EndFrameHandle;
+
+#if WITH_RELOAD
+	FDelegateHandle ReloadCompleteHandle;
+#endif
 };
\ No newline at end of file
@@ -2,19 +2,23 @@
 #pragma once
 
 #include "CoreMinimal.h"
+#include "ECSStructReferences.h"
 #include "AnyStruct.generated.h"
 
 /**
- *
+ * Type-erased struct value. Payloads up to INLINE_SIZE bytes are stored inline, larger ones are heap allocated
  */
 USTRUCT(BlueprintType)
 struct ECSUTILS_API FAnyStruct
 {
 	GENERATED_BODY()
 
-	constexpr FAnyStruct();
+	static constexpr int32 INLINE_SIZE = 48;
+	static constexpr int32 INLINE_ALIGNMENT = 16;
+
+	FAnyStruct();
 	FAnyStruct(const FAnyStruct& Other);
-	constexpr FAnyStruct(FAnyStruct&& Other) noexcept;
+	FAnyStruct(FAnyStruct&& Other) noexcept;
 	explicit FAnyStruct(const UScriptStruct* InType);
 	explicit FAnyStruct(const UScriptStruct* InType, const void* InCopy);
 	explicit FAnyStruct(ENoInit);
@@ -72,9 +76,34 @@ struct ECSUTILS_API FAnyStruct
 	bool NetSerialize(FArchive& Ar, UPackageMap* Map, bool& bOutSuccess);
 	//~
 
+	static constexpr bool FitsInline(const int32 Size, const int32 Alignment) { return Size <= INLINE_SIZE && Alignment <= INLINE_ALIGNMENT; }
+	FORCEINLINE bool IsInline() const { return bInline; }
+
+	// Payload address. Derived from the storage flag on every access so a bitwise copy of this struct stays valid
+	FORCEINLINE uint8* GetMemory() { return bInline ? (uint8*)&InlineMemory : HeapMemory; }
+	FORCEINLINE const uint8* GetMemory() const { return bInline ? (const uint8*)&InlineMemory : HeapMemory; }
+
 private:
-	uint8* RawMemory;
+	// Sets up uninitialized storage for the payload. Inline if the type fits
+	void AllocateMemory(const int32 Size, const int32 Alignment);
+
+	// Keeps the current storage if it can hold the new type. Must be called before Type is replaced
+	void ReallocateMemory(const int32 Size, const int32 Alignment);
+
+	void FreeMemory();
+
+	// Moves Other's value into this (uninitialized) struct without calling the move constructor. Heap values only hand over the pointer
+	void RelocateFrom(FAnyStruct& Other);
+
 	const UScriptStruct* Type;
+	bool bInline;
+
+	// Heap pointer or the inline payload, selected by bInline
+	union
+	{
+		uint8* HeapMemory;
+		TAlignedBytes<INLINE_SIZE, INLINE_ALIGNMENT> InlineMemory;
+	};
 };
 
 template<>
@@ -94,17 +123,15 @@ struct TStructOpsTypeTraits<FAnyStruct> : TStructOpsTypeTraitsBase2<FAnyStruct>
  *
  */
 
-FORCEINLINE constexpr FAnyStruct::FAnyStruct()
-	: RawMemory(nullptr), Type(nullptr) {}
+FORCEINLINE FAnyStruct::FAnyStruct()
+	: Type(nullptr), bInline(false), HeapMemory(nullptr) {}
 
 FORCEINLINE FAnyStruct::FAnyStruct(const FAnyStruct& Other)
-	: FAnyStruct(Other.Type, Other.RawMemory) {}
+	: FAnyStruct(Other.Type, Other.GetMemory()) {}
 
-FORCEINLINE constexpr FAnyStruct::FAnyStruct(FAnyStruct&& Other) noexcept
-	: RawMemory(Other.RawMemory), Type(Other.Type)
+FORCEINLINE FAnyStruct::FAnyStruct(FAnyStruct&& Other) noexcept
 {
-	Other.RawMemory = nullptr;
-	Other.Type = nullptr;
+	RelocateFrom(Other);
 }
 
 FORCEINLINE FAnyStruct::FAnyStruct(ENoInit) {}
@@ -113,14 +140,15 @@ inline FAnyStruct::FAnyStruct(const UScriptStruct* InType)
 {
 	if (!InType)
 	{
-		RawMemory = nullptr;
 		Type = nullptr;
+		bInline = false;
+		HeapMemory = nullptr;
 		return;
 	}
 
 	Type = InType;
-	RawMemory = (uint8*)FMemory::Malloc(Type->GetStructureSize(), Type->GetMinAlignment());
-	Type->InitializeStruct(RawMemory);
+	AllocateMemory(Type->GetStructureSize(), Type->GetMinAlignment());
+	Type->InitializeStruct(GetMemory());
 }
 
 FORCEINLINE FAnyStruct::FAnyStruct(const UScriptStruct* InType, const void* InCopy)
@@ -128,15 +156,15 @@ FORCEINLINE FAnyStruct::FAnyStruct(const UScriptStruct* InType, const void* InCo
 {
 	if (!Type) return;
 	check(InCopy);
-	Type->CopyScriptStruct(RawMemory, InCopy);
+	Type->CopyScriptStruct(GetMemory(), InCopy);
 }
 
 FORCEINLINE FAnyStruct::~FAnyStruct()
 {
 	if (!IsValid()) return;
 
-	Type->DestroyStruct(RawMemory);
-	FMemory::Free(RawMemory);
+	Type->DestroyStruct(GetMemory());
+	FreeMemory();
 }
 
 FORCEINLINE FAnyStruct& FAnyStruct::operator=(const FAnyStruct& Other)
@@ -147,17 +175,17 @@ FORCEINLINE FAnyStruct& FAnyStruct::operator=(const FAnyStruct& Other)
 		return *this;
 	}
 
-	Set(Other.Type, Other.RawMemory);
+	Set(Other.Type, Other.GetMemory());
 	return *this;
 }
 
 FORCEINLINE FAnyStruct& FAnyStruct::operator=(FAnyStruct&& Other) noexcept
 {
-	Destroy();
-	RawMemory = Other.RawMemory;
-	Type = Other.Type;
-	Other.RawMemory = nullptr;
-	Other.Type = nullptr;
+	if (this != &Other)
+	{
+		Destroy();
+		RelocateFrom(Other);
+	}
 	return *this;
 }
 
@@ -166,13 +194,13 @@ inline bool FAnyStruct::operator==(const FAnyStruct& Other) const
 	if (IsValid() != Other.IsValid()) return false;
 	if (!IsValid()) return true;
 	if (Type != Other.Type) return false;
-	return Type->CompareScriptStruct(RawMemory, Other.RawMemory, EPropertyPortFlags::PPF_None);
+	return Type->CompareScriptStruct(GetMemory(), Other.GetMemory(), EPropertyPortFlags::PPF_None);
 }
 
 template<typename T>
 FORCEINLINE typename TEnableIf<!TOr<TIsSame<T,FAnyStruct>, TIsPointer<T>>::Value, bool>::Type FAnyStruct::operator==(const T& Other) const
 {
-	return IsValid() && Type == TBaseStructure<T>::Get() && Type->CompareScriptStruct(RawMemory, &Other, EPropertyPortFlags::PPF_None);
+	return IsValid() && Type == TBaseStructure<T>::Get() && Type->CompareScriptStruct(GetMemory(), &Other, EPropertyPortFlags::PPF_None);
 }
 
 template<typename T>
@@ -190,10 +218,62 @@ inline void FAnyStruct::Destroy()
 {
 	if (!IsValid()) return;
 
-	Type->DestroyStruct(RawMemory);
-	FMemory::Free(RawMemory);
-	RawMemory = nullptr;
+	Type->DestroyStruct(GetMemory());
+	FreeMemory();
 	Type = nullptr;
+	bInline = false;
+	HeapMemory = nullptr;
+}
+
+inline void FAnyStruct::AllocateMemory(const int32 Size, const int32 Alignment)
+{
+	bInline = FitsInline(Size, Alignment);
+	if (!bInline)
+	{
+		HeapMemory = (uint8*)FMemory::Malloc(Size, Alignment);
+	}
+}
+
+inline void FAnyStruct::ReallocateMemory(const int32 Size, const int32 Alignment)
+{
+	check(IsValid());
+
+	// Inline storage fits anything that fits inline. Heap storage is reused if the new type isn't bigger or more aligned
+	const bool bCanReuse = FitsInline(Size, Alignment)
+		? IsInline()
+		: !IsInline() && Size <= Type->GetStructureSize() && Alignment <= Type->GetMinAlignment();
+
+	if (!bCanReuse)
+	{
+		FreeMemory();
+		AllocateMemory(Size, Alignment);
+	}
+}
+
+FORCEINLINE void FAnyStruct::FreeMemory()
+{
+	if (!bInline)
+	{
+		FMemory::Free(HeapMemory);
+	}
+}
+
+FORCEINLINE void FAnyStruct::RelocateFrom(FAnyStruct& Other)
+{
+	Type = Other.Type;
+	bInline = Other.bInline;
+	if (bInline)
+	{
+		FMemory::Memcpy(&InlineMemory, &Other.InlineMemory, Type->GetStructureSize());
+	}
+	else
+	{
+		HeapMemory = Other.HeapMemory;
+	}
+
+	Other.Type = nullptr;
+	Other.bInline = false;
+	Other.HeapMemory = nullptr;
 }
 
 template<typename T, typename... ParamTypes>
@@ -201,8 +281,8 @@ UE_NODISCARD FORCEINLINE FAnyStruct FAnyStruct::Make(ParamTypes&&... Params)
 {
 	FAnyStruct Out(NoInit);
 	Out.Type = TBaseStructure<T>::Get();
-	Out.RawMemory = (uint8*)FMemory::Malloc(sizeof(T), alignof(T));
-	new (Out.RawMemory) T(Forward<ParamTypes>(Params)...);
+	Out.AllocateMemory(sizeof(T), alignof(T));
+	new (Out.GetMemory()) T(Forward<ParamTypes>(Params)...);
 	return Out;
 }
 
@@ -215,26 +295,22 @@ inline T& FAnyStruct::Set(ParamTypes&&... Params)
 		const bool bSameType = Type == NewType;
 		if (bSameType)
 		{
-			((T*)RawMemory)->~T();
+			((T*)GetMemory())->~T();
 		}
 		else
 		{
-			Type->DestroyStruct(RawMemory);
-		}
-		
-		if (!bSameType || Type->GetStructureSize() != sizeof(T) || Type->GetMinAlignment() != alignof(T))
-		{
-			RawMemory = (uint8*)FMemory::Realloc(RawMemory, sizeof(T), alignof(T));
+			Type->DestroyStruct(GetMemory());
+			ReallocateMemory(sizeof(T), alignof(T));
 		}
 	}
 	else
 	{
-		RawMemory = (uint8*)FMemory::Malloc(sizeof(T), alignof(T));
+		AllocateMemory(sizeof(T), alignof(T));
 	}
 
 	Type = NewType;
-	new (RawMemory) T(Forward<ParamTypes>(Params)...);
-	return *(T*)RawMemory;
+	new (GetMemory()) T(Forward<ParamTypes>(Params)...);
+	return *(T*)GetMemory();
 }
 
 inline void FAnyStruct::Set(const UScriptStruct* InType)
@@ -246,26 +322,26 @@ inline void FAnyStruct::Set(const UScriptStruct* InType)
 
 	if (IsValid())
 	{
-		Type->DestroyStruct(RawMemory);
-		if (Type != InType || Type->GetStructureSize() != NewSize || Type->GetMinAlignment() != NewAlignment)
+		Type->DestroyStruct(GetMemory());
+		if (Type != InType)
 		{
-			RawMemory = (uint8*)FMemory::Realloc(RawMemory, NewSize, NewAlignment);
+			ReallocateMemory(NewSize, NewAlignment);
 		}
 	}
 	else
 	{
-		RawMemory = (uint8*)FMemory::Malloc(NewSize, NewAlignment);
+		AllocateMemory(NewSize, NewAlignment);
 	}
 
 	Type = InType;
-	Type->InitializeStruct(RawMemory);
+	Type->InitializeStruct(GetMemory());
 }
 
 inline void FAnyStruct::Set(const UScriptStruct* InType, const void* InCopy)
 {
 	check(InCopy != nullptr);
 	Set(InType);
-	Type->CopyScriptStruct(RawMemory, InCopy);
+	Type->CopyScriptStruct(GetMemory(), InCopy);
 }
 
 UE_NODISCARD FORCEINLINE bool FAnyStruct::IsValid() const
@@ -298,27 +374,27 @@ UE_NODISCARD FORCEINLINE bool FAnyStruct::IsAExact() const
 template<typename T>
 UE_NODISCARD FORCEINLINE T* FAnyStruct::Get()
 {
-	return IsA<T>() ? (T*)RawMemory : nullptr;
+	return IsA<T>() ? (T*)GetMemory() : nullptr;
 }
 
 template<typename T>
 UE_NODISCARD FORCEINLINE const T* FAnyStruct::Get() const
 {
-	return IsA<T>() ? (T*)RawMemory : nullptr;
+	return IsA<T>() ? (T*)GetMemory() : nullptr;
 }
 
 template<typename T>
 UE_NODISCARD FORCEINLINE T& FAnyStruct::GetChecked()
 {
 	checkf(IsA<T>(), TEXT("AnyStruct could not be casted to %s"), *TBaseStructure<T>::Get()->GetName());
-	return *(T*)RawMemory;
+	return *(T*)GetMemory();
 }
 
 template<typename T>
 UE_NODISCARD FORCEINLINE const T& FAnyStruct::GetChecked() const
 {
 	checkf(IsA<T>(), TEXT("AnyStruct could not be casted to %s"), *TBaseStructure<T>::Get()->GetName());
-	return *(T*)RawMemory;
+	return *(T*)GetMemory();
 }
 
 inline void FAnyStruct::AddStructReferencedObjects(FReferenceCollector& Collector)
@@ -327,16 +403,10 @@ inline void FAnyStruct::AddStructReferencedObjects(FReferenceCollector& Collecto
 
 	Collector.AddReferencedObject(Type);
 
-	if (Type->StructFlags & STRUCT_AddStructReferencedObjects)
-	{
-		Type->GetCppStructOps()->AddStructReferencedObjects()(RawMemory, Collector);
-	}
-
-	// Iterate through all properties (even within nested structs) for object properties
-	for (TPropertyValueIterator<FObjectProperty> It(Type, RawMemory); It; ++It)
+	const FECSStructReferences& References = FECSStructReferences::Get(Type);
+	if (References.HasReferences())
 	{
-		UObject*& ReferencedObject = *(UObject**)It.Value();
-		Collector.AddReferencedObject(ReferencedObject);
+		References.AddReferencedObjects(GetMemory(), Collector);
 	}
 }
 
@@ -356,7 +426,7 @@ inline bool FAnyStruct::Serialize(FArchive& Ar)
 			Set(NewType);
 		}
 
-		Type->SerializeBin(Ar, RawMemory);
+		Type->SerializeBin(Ar, GetMemory());
 	}
 	else if (Ar.IsLoading())
 	{
@@ -448,7 +518,7 @@ inline bool FAnyStruct::NetSerialize(FArchive& Ar, UPackageMap* Map, bool& bOutS
 		Set(NewType);
 	}
 
-	NetSerializeStructProps(Ar, Map, bOutSuccess, Type, RawMemory);
+	NetSerializeStructProps(Ar, Map, bOutSuccess, Type, GetMemory());
 
 	return true;
 }
\ No newline at end of file
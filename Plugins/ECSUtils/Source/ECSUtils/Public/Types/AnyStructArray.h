@@ -1,44 +1,64 @@
-﻿
 #pragma once
 
 #include "CoreMinimal.h"
+#include "ECSStructReferences.h"
 #include "AnyStructArray.generated.h"
 
 /**
- *
+ * Type-erased array of a single UScriptStruct type with a pluggable allocator policy, e.g. TInlineAllocator, TMemStackAllocator or
+ * FECSFrameAllocator for transient per-frame buffers. The elements are stored in 16 byte blocks so allocator element counts are in blocks,
+ * e.g. TInlineAllocator<4> stores 64 bytes inline. Like TArray, it assumes its elements are bitwise relocatable: growing, inserting and
+ * removing move them with memcpy / memmove instead of their move constructors.
+ * Not reflected, so UPROPERTYs and Blueprints use the FAnyStructArray wrapper
  */
-USTRUCT(BlueprintType)
-struct ECSUTILS_API FAnyStructArray
+template<typename InAllocatorType = FDefaultAllocator>
+class TAnyStructArray
 {
-	GENERATED_BODY()
+	struct alignas(16) FBlock
+	{
+		uint8 Bytes[16];
+	};
+
+	using FAllocatorInstance = typename InAllocatorType::template ForElementType<FBlock>;
 
-	constexpr FAnyStructArray();
-	explicit FAnyStructArray(ENoInit);
-	explicit FAnyStructArray(const UScriptStruct* ScriptStruct);
-	explicit FAnyStructArray(const UScriptStruct* ScriptStruct, const void* Copy, const int32 ArrNum = 1);
-	FAnyStructArray(const FAnyStructArray& Other);
-	FAnyStructArray(FAnyStructArray&& Other) noexcept;
-	template<typename T> FAnyStructArray(const std::initializer_list<T>& InitList);
-	~FAnyStructArray();
+public:
+	using AllocatorType = InAllocatorType;
+
+	FORCEINLINE TAnyStructArray() : ScriptStruct(nullptr), NumElems(0), MaxBlocks(AllocatorInstance.GetInitialCapacity()) {}
+	explicit TAnyStructArray(const UScriptStruct* ScriptStruct);
+	explicit TAnyStructArray(const UScriptStruct* ScriptStruct, const void* Copy, const int32 ArrNum = 1);
+	TAnyStructArray(const TAnyStructArray& Other);
+	TAnyStructArray(TAnyStructArray&& Other) noexcept;
+	template<typename T> TAnyStructArray(const std::initializer_list<T>& InitList);
+	~TAnyStructArray();
 
 	template<typename T>
-	static FAnyStructArray Make();
+	static TAnyStructArray Make();
 
 	template<typename T>
-	static FAnyStructArray Make(const int32 Num);
+	static TAnyStructArray Make(const int32 Num);
 
 	template<typename T, typename SizeType = int32>
-	static FAnyStructArray Make(const TConstArrayView<T, SizeType>& ArrayView);
+	static TAnyStructArray Make(const TConstArrayView<T, SizeType>& ArrayView);
 
-	FAnyStructArray& operator=(const FAnyStructArray& Other);
-	FAnyStructArray& operator=(FAnyStructArray&& Other) noexcept;
-	template<typename T> FAnyStructArray& operator=(const std::initializer_list<T>& InitList);
+	TAnyStructArray& operator=(const TAnyStructArray& Other);
+	TAnyStructArray& operator=(TAnyStructArray&& Other) noexcept;
+	template<typename T> TAnyStructArray& operator=(const std::initializer_list<T>& InitList);
 
-	bool operator==(const FAnyStructArray& Other) const;
-	bool operator!=(const FAnyStructArray& Other) const;
+	bool operator==(const TAnyStructArray& Other) const;
+	bool operator!=(const TAnyStructArray& Other) const;
 
 	void Empty();
 
+	// Destroys all elements but keeps the allocation, so refilling doesn't reallocate
+	void Reset(const int32 NewSize = 0);
+
+	// Ensures capacity for at least Num elements without changing Num()
+	void Reserve(const int32 Num);
+
+	// Frees unused capacity
+	void Shrink();
+
 	template<typename T, typename... ParamTypes>
 	int32 Emplace(ParamTypes&&... Params);
 
@@ -46,13 +66,13 @@ struct ECSUTILS_API FAnyStructArray
 	T& Emplace_GetRef(ParamTypes&&... Params);
 
 	template<typename T>
-	int32 Add(T&& Other);
+	FORCEINLINE int32 Add(T&& Value) { return Emplace<std::decay_t<T>>(Forward<T>(Value)); }
 
 	template<typename T>
-	T& Add_GetRef(T&& Other);
+	FORCEINLINE std::decay_t<T>& Add_GetRef(T&& Value) { return Emplace_GetRef<std::decay_t<T>>(Forward<T>(Value)); }
 
 	template<typename T>
-	T& Insert(T&& Value, const int32 Index);
+	std::decay_t<T>& Insert(T&& Value, const int32 Index);
 
 	template<typename T, typename SizeType = int32>
 	void Append(const TConstArrayView<T, SizeType>& ArrayView);
@@ -60,23 +80,24 @@ struct ECSUTILS_API FAnyStructArray
 	template<typename T>
 	void Append(const std::initializer_list<T>& InitList);
 
-	int32 AddDefaulted(const int32 Num);
-	int32 AddUninitialized(const int32 Num);
-
+	int32 AddDefaulted(const int32 Num = 1);
+	int32 AddUninitialized(const int32 Num = 1);
 	int32 AddFromBuffer(const void* CopyValue);
-
 	void AppendFromBuffer(const void* CopyValues, const int32 Num);
-
 	void* InsertAtFromBuffer(const void* CopyValue, const int32 Index);
 
+	void RemoveAt(const int32 Index, const int32 Num = 1);
+	void RemoveAtSwap(const int32 Index);
+
 	void SetNumUninitialized(const int32 Num);
 	void SetNum(const int32 Num);
 
-	void RemoveAt(const int32 Index, const int32 Num = 1);
-
 	// Resizes array without calling constructors / destructors. VERY DANGEROUS!
 	void Resize(const int32 NewSize);
 
+	// Sets Num() within the current capacity without calling constructors / destructors or touching the allocator. VERY DANGEROUS!
+	void SetNumUnsafe(const int32 Num);
+
 	template<typename T>
 	T& Get(const int32 Index);
 
@@ -91,192 +112,185 @@ struct ECSUTILS_API FAnyStructArray
 
 	template<typename T>
 	const T& Last() const;
-	
+
 	void* Last();
 	const void* Last() const;
-	
-	bool IsEmpty() const;
-	bool IsValidIndex(const int32 Index) const;
-
-	bool IsA(const UScriptStruct* InType) const;
 
 	template<typename T>
-	bool IsA() const;
+	TArrayView<T> ForEach();
 
-	int32 Num() const;
-	int32 GetStructureSize() const;
-	int32 GetAlignment() const;
-
-	//~ Type traits
-	void AddStructReferencedObjects(FReferenceCollector& Collector);
-	//~
+	template<typename T>
+	TArrayView<const T> ForEach() const;
 
-	//~ Simple getters
-	FORCEINLINE const void* GetAllocation() const { return Memory; }
-	FORCEINLINE const UScriptStruct* GetType() const { return ScriptStruct; }
-	//~
-	
-	//~ Iterator
-	template<typename T> class TIterator;
-	template<typename T> class TConstIterator;
+	void AddReferencedObjects(FReferenceCollector& Collector);
 
 	template<typename T>
-	TIterator<T> ForEach();
+	FORCEINLINE bool IsA() const { return IsA(TBaseStructure<T>::Get()); }
+
+	FORCEINLINE bool IsEmpty() const { return NumElems == 0; }
+	FORCEINLINE bool IsValidIndex(const int32 Index) const { return Index < NumElems && Index > INDEX_NONE; }
+	FORCEINLINE bool IsA(const UScriptStruct* InType) const { return ensure(ScriptStruct) && ScriptStruct->IsChildOf(InType); }
+	FORCEINLINE int32 Num() const { return NumElems; }
+	FORCEINLINE int32 Max() const { return ScriptStruct ? MaxBlocks * (int32)sizeof(FBlock) / GetStructureSize() : 0; }
+	FORCEINLINE int32 GetSlack() const { return Max() - NumElems; }
+	FORCEINLINE const UScriptStruct* GetType() const { return ScriptStruct; }
+	FORCEINLINE const void* GetAllocation() const { return GetData(); }
+	FORCEINLINE int32 GetStructureSize() const { check(ScriptStruct); return ScriptStruct->GetStructureSize(); }
+	FORCEINLINE int32 GetAlignment() const { check(ScriptStruct); return ScriptStruct->GetMinAlignment(); }
 
-	template<typename T>
-	TConstIterator<T> ForEach() const;
-	//~
+private:
+	FORCEINLINE uint8* GetData() const { return (uint8*)AllocatorInstance.GetAllocation(); }
+	FORCEINLINE int32 GetNumBlocks(const int32 Num) const { return (Num * GetStructureSize() + (int32)sizeof(FBlock) - 1) / (int32)sizeof(FBlock); }
 
-protected:
-	uint8* Memory;
+	// Grows the allocation with the allocator's slack policy to fit at least NewNum elements
+	void ReserveForGrow(const int32 NewNum);
+	void ResizeAllocation(const int32 NewMaxBlocks);
 
-	UPROPERTY(BlueprintReadOnly, EditDefaultsOnly, DisplayName="Type")
+	FAllocatorInstance AllocatorInstance;
 	const UScriptStruct* ScriptStruct;
-	
 	int32 NumElems;
+	int32 MaxBlocks;// Allocated capacity in FBlocks
 };
 
-template<>
-struct TStructOpsTypeTraits<FAnyStructArray> : TStructOpsTypeTraitsBase2<FAnyStructArray>
+template<typename InAllocatorType>
+FORCEINLINE TAnyStructArray<InAllocatorType>::TAnyStructArray(const UScriptStruct* ScriptStruct)
+	: ScriptStruct(ScriptStruct), NumElems(0), MaxBlocks(AllocatorInstance.GetInitialCapacity())
 {
-	enum
-	{
-		WithCopy = true,
-		WithIdenticalViaEquality = true,
-		WithAddStructReferencedObjects = true,
-	};
-};
-
-FORCEINLINE constexpr FAnyStructArray::FAnyStructArray()
-	: Memory(nullptr), ScriptStruct(nullptr), NumElems(0) {}
-
-FORCEINLINE FAnyStructArray::FAnyStructArray(ENoInit) {}
-
-FORCEINLINE FAnyStructArray::FAnyStructArray(const UScriptStruct* ScriptStruct)
-	: Memory(nullptr), ScriptStruct(ScriptStruct), NumElems(0) { check(ScriptStruct != nullptr); }
-
-template<typename T>
-FORCEINLINE FAnyStructArray::FAnyStructArray(const std::initializer_list<T>& InitList)
-	: FAnyStructArray(FAnyStructArray::Make<T, int32>(InitList)) {}
+	check(ScriptStruct);
+	checkf(ScriptStruct->GetMinAlignment() <= alignof(FBlock), TEXT("TAnyStructArray: %s is over aligned!"), *ScriptStruct->GetName());
+}
 
-inline FAnyStructArray::FAnyStructArray(const UScriptStruct* ScriptStruct, const void* Copy, const int32 ArrNum)
-	: ScriptStruct(ScriptStruct), NumElems(ArrNum)
+template<typename InAllocatorType>
+inline TAnyStructArray<InAllocatorType>::TAnyStructArray(const UScriptStruct* ScriptStruct, const void* Copy, const int32 ArrNum)
+	: TAnyStructArray(ScriptStruct)
 {
-	check(ScriptStruct);
-	check(NumElems > INDEX_NONE);
+	check(ArrNum > INDEX_NONE);
 	check(Copy);
-	if (NumElems == 0) return;
+	if (ArrNum == 0) return;
 
-	Memory = (uint8*)FMemory::Malloc(NumElems * GetStructureSize(), GetAlignment());
-	ScriptStruct->InitializeStruct(Memory, NumElems);
-	ScriptStruct->CopyScriptStruct(Memory, Copy, NumElems);
+	Reserve(ArrNum);
+	AppendFromBuffer(Copy, ArrNum);
 }
 
-inline FAnyStructArray::FAnyStructArray(const FAnyStructArray& Other)
-	: ScriptStruct(Other.ScriptStruct), NumElems(Other.NumElems)
+template<typename InAllocatorType>
+inline TAnyStructArray<InAllocatorType>::TAnyStructArray(const TAnyStructArray& Other)
+	: ScriptStruct(Other.ScriptStruct), NumElems(0), MaxBlocks(AllocatorInstance.GetInitialCapacity())
 {
-	if (Other.IsEmpty())
-	{
-		Memory = nullptr;
-		return;
-	}
+	if (Other.IsEmpty()) return;
 
-	check(ScriptStruct != nullptr);
-	Memory = (uint8*)FMemory::Malloc(NumElems * ScriptStruct->GetStructureSize(), ScriptStruct->GetMinAlignment());
-	ScriptStruct->InitializeStruct(Memory, NumElems);
-	ScriptStruct->CopyScriptStruct(Memory, Other.Memory, NumElems);
+	Reserve(Other.NumElems);
+	NumElems = Other.NumElems;
+	ScriptStruct->InitializeStruct(GetData(), NumElems);
+	ScriptStruct->CopyScriptStruct(GetData(), Other.GetData(), NumElems);
 }
 
-FORCEINLINE FAnyStructArray::FAnyStructArray(FAnyStructArray&& Other) noexcept
-	: Memory(Other.Memory), ScriptStruct(Other.ScriptStruct), NumElems(Other.NumElems)
+template<typename InAllocatorType>
+FORCEINLINE TAnyStructArray<InAllocatorType>::TAnyStructArray(TAnyStructArray&& Other) noexcept
+	: ScriptStruct(Other.ScriptStruct), NumElems(Other.NumElems), MaxBlocks(Other.MaxBlocks)
 {
-	Other.Memory = nullptr;
-	Other.ScriptStruct = nullptr;
+	AllocatorInstance.MoveToEmpty(Other.AllocatorInstance);
 	Other.NumElems = 0;
+	Other.MaxBlocks = Other.AllocatorInstance.GetInitialCapacity();
 }
 
-FORCEINLINE FAnyStructArray::~FAnyStructArray()
-{
-	if (IsEmpty()) return;
+template<typename InAllocatorType>
+template<typename T>
+FORCEINLINE TAnyStructArray<InAllocatorType>::TAnyStructArray(const std::initializer_list<T>& InitList)
+	: TAnyStructArray(Make<T, int32>(InitList)) {}
 
-	ScriptStruct->DestroyStruct(Memory, NumElems);
-	FMemory::Free(Memory);
+template<typename InAllocatorType>
+FORCEINLINE TAnyStructArray<InAllocatorType>::~TAnyStructArray()
+{
+	// The allocator instance releases the memory
+	if (NumElems > 0)
+	{
+		ScriptStruct->DestroyStruct(GetData(), NumElems);
+	}
 }
 
+template<typename InAllocatorType>
 template<typename T>
-FORCEINLINE FAnyStructArray FAnyStructArray::Make()
+FORCEINLINE TAnyStructArray<InAllocatorType> TAnyStructArray<InAllocatorType>::Make()
 {
-	FAnyStructArray Out(NoInit);
-	Out.Memory = nullptr;
-	Out.ScriptStruct = TBaseStructure<T>::Get();
-	Out.NumElems = 0;
-	return Out;
+	return TAnyStructArray(TBaseStructure<T>::Get());
 }
 
+template<typename InAllocatorType>
 template<typename T>
-inline FAnyStructArray FAnyStructArray::Make(const int32 Num)
+inline TAnyStructArray<InAllocatorType> TAnyStructArray<InAllocatorType>::Make(const int32 Num)
 {
-	FAnyStructArray Out(NoInit);
-	Out.ScriptStruct = TBaseStructure<T>::Get();
-	Out.NumElems = FMath::Max(Num, 0);
+	TAnyStructArray Out(TBaseStructure<T>::Get());
+	if (Num <= 0) return Out;
 
-	Out.Memory = (uint8*)FMemory::Malloc(Num * sizeof(T), alignof(T));
-	for (int32 i = 0; i < Out.NumElems; ++i)
+	Out.Reserve(Num);
+	Out.NumElems = Num;
+	for (int32 i = 0; i < Num; ++i)
 	{
 		if constexpr (TStructOpsTypeTraits<T>::WithNoInitConstructor)
 		{
-			new (Out.Memory + i * sizeof(T)) T(ForceInit);
+			new (Out.GetData() + i * sizeof(T)) T(ForceInit);
 		}
 		else
 		{
-			new (Out.Memory + i * sizeof(T)) T();
+			new (Out.GetData() + i * sizeof(T)) T();
 		}
 	}
 
 	return Out;
 }
 
+template<typename InAllocatorType>
 template<typename T, typename SizeType>
-inline FAnyStructArray FAnyStructArray::Make(const TConstArrayView<T, SizeType>& ArrayView)
+inline TAnyStructArray<InAllocatorType> TAnyStructArray<InAllocatorType>::Make(const TConstArrayView<T, SizeType>& ArrayView)
 {
-	FAnyStructArray Out(NoInit);
-	Out.ScriptStruct = TBaseStructure<T>::Get();
-	Out.NumElems = ArrayView.Num();
-	if (Out.NumElems == 0)
-	{
-		Out.Memory = nullptr;
-		return Out;
-	}
-	
-	Out.Memory = (uint8*)FMemory::Malloc(ArrayView.Num() * sizeof(T), alignof(T));
-	for (int32 i = 0; i < Out.NumElems; ++i)
-	{
-		new (Out.Memory + i * sizeof(T)) T{ArrayView[i]};
-	}
-	
+	TAnyStructArray Out(TBaseStructure<T>::Get());
+	Out.Reserve(ArrayView.Num());
+	Out.Append(ArrayView);
 	return Out;
 }
 
-FORCEINLINE FAnyStructArray& FAnyStructArray::operator=(const FAnyStructArray& Other)
+template<typename InAllocatorType>
+FORCEINLINE TAnyStructArray<InAllocatorType>& TAnyStructArray<InAllocatorType>::operator=(const TAnyStructArray& Other)
 {
-	Empty();
-	return *new (this) FAnyStructArray{Other};
+	if (this != &Other)
+	{
+		Reset();
+		ScriptStruct = Other.ScriptStruct;
+		if (!Other.IsEmpty())
+		{
+			AddUninitialized(Other.NumElems);
+			ScriptStruct->InitializeStruct(GetData(), NumElems);
+			ScriptStruct->CopyScriptStruct(GetData(), Other.GetData(), NumElems);
+		}
+	}
+	return *this;
 }
 
-FORCEINLINE FAnyStructArray& FAnyStructArray::operator=(FAnyStructArray&& Other) noexcept
+template<typename InAllocatorType>
+FORCEINLINE TAnyStructArray<InAllocatorType>& TAnyStructArray<InAllocatorType>::operator=(TAnyStructArray&& Other) noexcept
 {
-	Empty();
-	return *new (this) FAnyStructArray{MoveTemp(Other)};
+	if (this != &Other)
+	{
+		Empty();
+		AllocatorInstance.MoveToEmpty(Other.AllocatorInstance);
+		ScriptStruct = Other.ScriptStruct;
+		NumElems = Other.NumElems;
+		MaxBlocks = Other.MaxBlocks;
+		Other.NumElems = 0;
+		Other.MaxBlocks = Other.AllocatorInstance.GetInitialCapacity();
+	}
+	return *this;
 }
 
+template<typename InAllocatorType>
 template<typename T>
-FORCEINLINE FAnyStructArray& FAnyStructArray::operator=(const std::initializer_list<T>& InitList)
+FORCEINLINE TAnyStructArray<InAllocatorType>& TAnyStructArray<InAllocatorType>::operator=(const std::initializer_list<T>& InitList)
 {
-	Empty();
-	return *new (this) FAnyStructArray{InitList};
+	return *this = Make<T, int32>(InitList);
 }
 
-UE_NODISCARD inline bool FAnyStructArray::operator==(const FAnyStructArray& Other) const
+template<typename InAllocatorType>
+UE_NODISCARD inline bool TAnyStructArray<InAllocatorType>::operator==(const TAnyStructArray& Other) const
 {
 	if (NumElems != Other.NumElems) return false;
 	if (IsEmpty()) return true;
@@ -284,194 +298,222 @@ UE_NODISCARD inline bool FAnyStructArray::operator==(const FAnyStructArray& Othe
 
 	const int32 StructureSize = GetStructureSize();
 	for (int32 Offset = 0; Offset < NumElems * StructureSize; Offset += StructureSize)
-		if (!ScriptStruct->CompareScriptStruct(Memory + Offset, Other.Memory + Offset, EPropertyPortFlags::PPF_None))
+		if (!ScriptStruct->CompareScriptStruct(GetData() + Offset, Other.GetData() + Offset, EPropertyPortFlags::PPF_None))
 			return false;
 
 	return true;
 }
 
-UE_NODISCARD FORCEINLINE bool FAnyStructArray::operator!=(const FAnyStructArray& Other) const
+template<typename InAllocatorType>
+UE_NODISCARD FORCEINLINE bool TAnyStructArray<InAllocatorType>::operator!=(const TAnyStructArray& Other) const
 {
 	return !(*this == Other);
 }
 
-inline void FAnyStructArray::Empty()
+template<typename InAllocatorType>
+inline void TAnyStructArray<InAllocatorType>::Empty()
 {
-	if (IsEmpty()) return;
-
-	ScriptStruct->DestroyStruct(Memory, NumElems);
-	FMemory::Free(Memory);
-	Memory = nullptr;
-	NumElems = 0;
+	Reset();
+	if (ScriptStruct)
+	{
+		ResizeAllocation(0);
+	}
 }
 
-template<typename T, typename... ParamTypes>
-inline int32 FAnyStructArray::Emplace(ParamTypes&&... Params)
+template<typename InAllocatorType>
+FORCEINLINE void TAnyStructArray<InAllocatorType>::Reset(const int32 NewSize)
 {
-	checkf(ScriptStruct, TEXT("FAnyStructArray: Type is uninitialized!"));
-	checkf(ScriptStruct == TBaseStructure<T>::Get(), TEXT("FAnyStructArray: Type mismatch!"));
-
-	const int32 Index = NumElems++;
-	if (!Memory)
+	check(NewSize > INDEX_NONE);
+	if (NumElems > 0)
 	{
-		check(NumElems == 1);
-		Memory = (uint8*)FMemory::Malloc(sizeof(T), alignof(T));
+		ScriptStruct->DestroyStruct(GetData(), NumElems);
+		NumElems = 0;
 	}
-	else
+
+	if (NewSize > 0)
 	{
-		Memory = (uint8*)FMemory::Realloc(Memory, NumElems * sizeof(T), alignof(T));
+		Reserve(NewSize);
 	}
-	checkf(Memory, TEXT("FAnyStructArray: Memory allocation failed!"));
-
-	new (Memory + Index * sizeof(T)) T{Forward<ParamTypes>(Params)...};
-	return Index;
 }
 
-template<typename T, typename... ParamTypes>
-inline T& FAnyStructArray::Emplace_GetRef(ParamTypes&&... Params)
+template<typename InAllocatorType>
+FORCEINLINE void TAnyStructArray<InAllocatorType>::Reserve(const int32 Num)
 {
-	checkf(ScriptStruct, TEXT("FAnyStructArray: Type is uninitialized!"));
-	checkf(ScriptStruct == TBaseStructure<T>::Get(), TEXT("FAnyStructArray: Type mismatch!"));
-
-	const int32 Index = NumElems++;
-	if (!Memory)
+	checkf(ScriptStruct, TEXT("TAnyStructArray: Type is uninitialized!"));
+	const int32 NumBlocks = GetNumBlocks(Num);
+	if (NumBlocks > MaxBlocks)
 	{
-		check(NumElems == 1);
-		Memory = (uint8*)FMemory::Malloc(sizeof(T), alignof(T));
+		ResizeAllocation(NumBlocks);
 	}
-	else
-	{
-		Memory = (uint8*)FMemory::Realloc(Memory, NumElems * sizeof(T), alignof(T));
-	}
-	checkf(Memory, TEXT("FAnyStructArray: Memory allocation failed!"));
-
-	return *new (Memory + Index * sizeof(T)) T{Forward<ParamTypes>(Params)...};
 }
 
-template<typename T>
-FORCEINLINE int32 FAnyStructArray::Add(T&& Other)
+template<typename InAllocatorType>
+FORCEINLINE void TAnyStructArray<InAllocatorType>::Shrink()
 {
-	return Emplace<T>(Forward<T>(Other));
+	if (!ScriptStruct) return;
+
+	const int32 NumBlocks = GetNumBlocks(NumElems);
+	if (NumBlocks < MaxBlocks)
+	{
+		ResizeAllocation(NumBlocks);
+	}
 }
 
-template<typename T>
-FORCEINLINE T& FAnyStructArray::Add_GetRef(T&& Other)
+template<typename InAllocatorType>
+FORCEINLINE void TAnyStructArray<InAllocatorType>::ReserveForGrow(const int32 NewNum)
 {
-	return Emplace_GetRef<T>(Forward<T>(Other));
+	checkf(ScriptStruct, TEXT("TAnyStructArray: Type is uninitialized!"));
+	const int32 NumBlocks = GetNumBlocks(NewNum);
+	if (NumBlocks > MaxBlocks)
+	{
+		if constexpr (TAllocatorTraits<InAllocatorType>::SupportsElementAlignment)
+		{
+			ResizeAllocation(AllocatorInstance.CalculateSlackGrow(NumBlocks, MaxBlocks, sizeof(FBlock), alignof(FBlock)));
+		}
+		else
+		{
+			ResizeAllocation(AllocatorInstance.CalculateSlackGrow(NumBlocks, MaxBlocks, sizeof(FBlock)));
+		}
+	}
 }
 
-template<typename T, typename SizeType>
-inline void FAnyStructArray::Append(const TConstArrayView<T, SizeType>& ArrayView)
+template<typename InAllocatorType>
+inline void TAnyStructArray<InAllocatorType>::ResizeAllocation(const int32 NewMaxBlocks)
 {
-	checkf(ScriptStruct, TEXT("FAnyStructArray: Type is uninitialized!"));
-	checkf(ScriptStruct == TBaseStructure<T>::Get(), TEXT("FAnyStructArray: Type mismatch!"));
-	if (ArrayView.Num() == 0) return;
+	const int32 NumUsedBlocks = GetNumBlocks(NumElems);
+	check(NewMaxBlocks >= NumUsedBlocks);
 
-	const int32 Index = NumElems;
-	NumElems += ArrayView.Num();
-	if (!Memory)
+	if constexpr (TAllocatorTraits<InAllocatorType>::SupportsElementAlignment)
 	{
-		check(NumElems > 0);
-		Memory = (uint8*)FMemory::Malloc(NumElems * sizeof(T), alignof(T));
+		AllocatorInstance.ResizeAllocation(NumUsedBlocks, NewMaxBlocks, sizeof(FBlock), alignof(FBlock));
 	}
 	else
 	{
-		Memory = (uint8*)FMemory::Realloc(Memory, NumElems * sizeof(T), alignof(T));
+		AllocatorInstance.ResizeAllocation(NumUsedBlocks, NewMaxBlocks, sizeof(FBlock));
 	}
-	checkf(Memory, TEXT("FAnyStructArray: Memory allocation failed!"));
 
-	for (int32 i = Index; i < NumElems; i++)
-	{
-		new (Memory + i * sizeof(T)) T{ArrayView[i]};
-	}
+	// Inline allocators never drop below their inline capacity
+	MaxBlocks = FMath::Max(NewMaxBlocks, (int32)AllocatorInstance.GetInitialCapacity());
 }
 
-template<typename T>
-FORCEINLINE void FAnyStructArray::Append(const std::initializer_list<T>& InitList)
+template<typename InAllocatorType>
+template<typename T, typename... ParamTypes>
+FORCEINLINE int32 TAnyStructArray<InAllocatorType>::Emplace(ParamTypes&&... Params)
 {
-	Append<T, int32>(InitList);
+	checkf(ScriptStruct == TBaseStructure<T>::Get(), TEXT("TAnyStructArray: Type mismatch!"));
+
+	ReserveForGrow(NumElems + 1);
+	const int32 Index = NumElems++;
+	new (GetData() + Index * sizeof(T)) T{Forward<ParamTypes>(Params)...};
+	return Index;
+}
+
+template<typename InAllocatorType>
+template<typename T, typename... ParamTypes>
+FORCEINLINE T& TAnyStructArray<InAllocatorType>::Emplace_GetRef(ParamTypes&&... Params)
+{
+	checkf(ScriptStruct == TBaseStructure<T>::Get(), TEXT("TAnyStructArray: Type mismatch!"));
+
+	ReserveForGrow(NumElems + 1);
+	const int32 Index = NumElems++;
+	return *new (GetData() + Index * sizeof(T)) T{Forward<ParamTypes>(Params)...};
 }
 
+template<typename InAllocatorType>
 template<typename T>
-inline T& FAnyStructArray::Insert(T&& Value, const int32 Index)
+inline std::decay_t<T>& TAnyStructArray<InAllocatorType>::Insert(T&& Value, const int32 Index)
 {
-	checkf(ScriptStruct, TEXT("FAnyStructArray: Type is uninitialized!"));
-	checkf(ScriptStruct == TBaseStructure<T>::Get(), TEXT("FAnyStructArray: Type mismatch!"));
+	using ElementType = std::decay_t<T>;
+	checkf(ScriptStruct == TBaseStructure<ElementType>::Get(), TEXT("TAnyStructArray: Type mismatch!"));
 	check(Index <= NumElems && Index > INDEX_NONE);
 
+	ReserveForGrow(NumElems + 1);
 	NumElems += 1;
-	if (!Memory)
-	{
-		check(NumElems == 1);
-		Memory = (uint8*)FMemory::Malloc(sizeof(T), alignof(T));
-	}
-	else
-	{
-		Memory = (uint8*)FMemory::Realloc(Memory, NumElems * sizeof(T), alignof(T));
-	}
-	checkf(Memory, TEXT("FAnyStructArray: Memory allocation failed!"));
 
-	uint8* InsertItem = Memory + Index * sizeof(T);
+	uint8* InsertItem = GetData() + Index * sizeof(ElementType);
 	const int32 MoveNum = NumElems - (Index + 1);
 	if (MoveNum != 0)
 	{
-		FMemory::Memmove(InsertItem + sizeof(T), InsertItem, MoveNum * sizeof(T));
+		FMemory::Memmove(InsertItem + sizeof(ElementType), InsertItem, MoveNum * sizeof(ElementType));
 	}
 
-	return *new (InsertItem) T{Forward<T>(Value)};
+	return *new (InsertItem) ElementType{Forward<T>(Value)};
 }
 
-FORCEINLINE int32 FAnyStructArray::AddDefaulted(const int32 Num)
+template<typename InAllocatorType>
+template<typename T, typename SizeType>
+inline void TAnyStructArray<InAllocatorType>::Append(const TConstArrayView<T, SizeType>& ArrayView)
+{
+	checkf(ScriptStruct == TBaseStructure<T>::Get(), TEXT("TAnyStructArray: Type mismatch!"));
+	if (ArrayView.Num() == 0) return;
+
+	const int32 Index = AddUninitialized(ArrayView.Num());
+	for (int32 i = Index; i < NumElems; i++)
+	{
+		new (GetData() + i * sizeof(T)) T{ArrayView[i - Index]};
+	}
+}
+
+template<typename InAllocatorType>
+template<typename T>
+FORCEINLINE void TAnyStructArray<InAllocatorType>::Append(const std::initializer_list<T>& InitList)
+{
+	Append<T, int32>(InitList);
+}
+
+template<typename InAllocatorType>
+FORCEINLINE int32 TAnyStructArray<InAllocatorType>::AddDefaulted(const int32 Num)
 {
 	const int32 FirstIndex = AddUninitialized(Num);
 	ScriptStruct->InitializeStruct(GetRawPtr(FirstIndex), Num);
 	return FirstIndex;
 }
 
-inline int32 FAnyStructArray::AddUninitialized(const int32 Num)
+template<typename InAllocatorType>
+FORCEINLINE int32 TAnyStructArray<InAllocatorType>::AddUninitialized(const int32 Num)
 {
-	checkf(ScriptStruct, TEXT("FAnyStructArray: Type is uninitialized!"));
 	check(Num > 0);
 
-	const int32 Size = GetStructureSize();
-	const int32 Alignment = GetAlignment();
-
+	ReserveForGrow(NumElems + Num);
 	const int32 OldNumElems = NumElems;
 	NumElems += Num;
-	if (!Memory)
-	{
-		check(NumElems > 0);
-		Memory = (uint8*)FMemory::Malloc(NumElems * Size, Alignment);
-	}
-	else
-	{
-		Memory = (uint8*)FMemory::Realloc(Memory, NumElems * Size, Alignment);
-	}
-	checkf(Memory, TEXT("FAnyStructArray: Memory allocation failed!"));
-
 	return OldNumElems;
 }
 
-inline void* FAnyStructArray::InsertAtFromBuffer(const void* CopyValue, const int32 Index)
+template<typename InAllocatorType>
+inline int32 TAnyStructArray<InAllocatorType>::AddFromBuffer(const void* CopyValue)
+{
+	check(CopyValue);
+
+	const int32 Index = AddUninitialized(1);
+	void* Item = GetRawPtr(Index);
+	ScriptStruct->InitializeStruct(Item);
+	ScriptStruct->CopyScriptStruct(Item, CopyValue);
+	return Index;
+}
+
+template<typename InAllocatorType>
+inline void TAnyStructArray<InAllocatorType>::AppendFromBuffer(const void* CopyValues, const int32 Num)
 {
-	checkf(ScriptStruct, TEXT("FAnyStructArray: Type is uninitialized!"));
+	check(Num > INDEX_NONE);
+	if (!CopyValues || Num == 0) return;
+
+	void* FirstItem = GetRawPtr(AddUninitialized(Num));
+	ScriptStruct->InitializeStruct(FirstItem, Num);
+	ScriptStruct->CopyScriptStruct(FirstItem, CopyValues, Num);
+}
+
+template<typename InAllocatorType>
+inline void* TAnyStructArray<InAllocatorType>::InsertAtFromBuffer(const void* CopyValue, const int32 Index)
+{
+	check(CopyValue);
 	check(Index <= NumElems && Index > INDEX_NONE);
 
-	const int32 Size = GetStructureSize();
-	const int32 Alignment = GetAlignment();
+	ReserveForGrow(NumElems + 1);
 	NumElems += 1;
-	if (!Memory)
-	{
-		check(NumElems == 1);
-		Memory = (uint8*)FMemory::Malloc(Size, Alignment);
-	}
-	else
-	{
-		Memory = (uint8*)FMemory::Realloc(Memory, NumElems * Size, Alignment);
-	}
-	checkf(Memory, TEXT("FAnyStructArray: Memory allocation failed!"));
 
-	uint8* InsertItem = Memory + Index * Size;
+	const int32 Size = GetStructureSize();
+	uint8* InsertItem = GetData() + Index * Size;
 	const int32 MoveNum = NumElems - (Index + 1);
 	if (MoveNum != 0)
 	{
@@ -483,319 +525,319 @@ inline void* FAnyStructArray::InsertAtFromBuffer(const void* CopyValue, const in
 	return InsertItem;
 }
 
-inline int32 FAnyStructArray::AddFromBuffer(const void* CopyValue)
+template<typename InAllocatorType>
+inline void TAnyStructArray<InAllocatorType>::RemoveAt(const int32 Index, const int32 Num)
 {
-	check(CopyValue);
-	checkf(ScriptStruct, TEXT("FAnyStructArray: Type is uninitialized!"));
+	check(IsValidIndex(Index));
+	check(Num > 0);
 
-	const int32 Index = NumElems++;
+	const int32 RemoveNum = FMath::Min(Num, NumElems - Index);
 	const int32 Size = GetStructureSize();
-	const int32 Alignment = GetAlignment();
-	if (!Memory)
-	{
-		check(NumElems == 1);
-		Memory = (uint8*)FMemory::Malloc(Size, Alignment);
-	}
-	else
+	uint8* RemoveItem = GetData() + Index * Size;
+	ScriptStruct->DestroyStruct(RemoveItem, RemoveNum);
+
+	const int32 MoveNum = NumElems - (Index + RemoveNum);
+	if (MoveNum != 0)
 	{
-		Memory = (uint8*)FMemory::Realloc(Memory, NumElems * Size, Alignment);
+		FMemory::Memmove(RemoveItem, RemoveItem + RemoveNum * Size, MoveNum * Size);
 	}
-	checkf(Memory, TEXT("FAnyStructArray: Memory allocation failed!"));
 
-	uint8* Item = Memory + Index * Size;
-	ScriptStruct->InitializeStruct(Item);
-	ScriptStruct->CopyScriptStruct(Item, CopyValue);
+	// Keep the capacity. Call Shrink to release it
+	NumElems -= RemoveNum;
+}
 
-	return Index;
+template<typename InAllocatorType>
+inline void TAnyStructArray<InAllocatorType>::RemoveAtSwap(const int32 Index)
+{
+	check(IsValidIndex(Index));
+
+	const int32 Size = GetStructureSize();
+	uint8* RemoveItem = GetData() + Index * Size;
+	ScriptStruct->DestroyStruct(RemoveItem);
+
+	if (Index != --NumElems)
+	{
+		FMemory::Memcpy(RemoveItem, GetData() + NumElems * Size, Size);
+	}
 }
 
-inline void FAnyStructArray::AppendFromBuffer(const void* CopyValues, const int32 Num)
+template<typename InAllocatorType>
+inline void TAnyStructArray<InAllocatorType>::SetNumUninitialized(const int32 Num)
 {
 	check(Num > INDEX_NONE);
-	if (!CopyValues || Num == 0) return;
+	if (Num == NumElems) return;
 
-	const int32 Index = NumElems;
-	NumElems += Num;
-	const int32 Size = GetStructureSize();
-	const int32 Alignment = GetAlignment();
-	if (!Memory)
+	if (Num < NumElems)
 	{
-		check(NumElems >= 1);
-		Memory = (uint8*)FMemory::Malloc(NumElems * Size, Alignment);
+		ScriptStruct->DestroyStruct(GetData() + Num * GetStructureSize(), NumElems - Num);
+		NumElems = Num;
 	}
 	else
 	{
-		Memory = (uint8*)FMemory::Realloc(Memory, NumElems * Size, Alignment);
+		AddUninitialized(Num - NumElems);
 	}
-	checkf(Memory, TEXT("FAnyStructArray: Memory allocation failed!"));
-
-	uint8* FirstItem = Memory + Index * Size;
-	ScriptStruct->InitializeStruct(FirstItem, Num);
-	ScriptStruct->CopyScriptStruct(FirstItem, CopyValues, Num);
 }
 
-inline void FAnyStructArray::RemoveAt(const int32 Index, const int32 Num)
+template<typename InAllocatorType>
+inline void TAnyStructArray<InAllocatorType>::SetNum(const int32 Num)
 {
-	check(IsValidIndex(Index));
-	check(Num > 0);
-
-	// Destroy the desired elements of the array
-	const int32 RemoveNum = FMath::Min(Num, NumElems - Index);
-	const int32 Size = GetStructureSize();
-	uint8* RemoveItem = Memory + Index * Size;
-	ScriptStruct->DestroyStruct(RemoveItem, RemoveNum);
+	check(Num > INDEX_NONE);
+	if (Num == NumElems) return;
 
-	// Move all other elements down
-	const int32 MoveNum = NumElems - (Index + RemoveNum);
-	if (MoveNum != 0)
+	if (Num < NumElems)
 	{
-		const uint8* MoveItem = Memory + (Index + RemoveNum) * Size;
-		FMemory::Memmove(RemoveItem, MoveItem, MoveNum * Size);
+		ScriptStruct->DestroyStruct(GetData() + Num * GetStructureSize(), NumElems - Num);
+		NumElems = Num;
 	}
-
-	// Resize memory to fit new element count
-	NumElems -= RemoveNum;
-	if (NumElems == 0)
+	else
 	{
-		FMemory::Free(Memory);
-		Memory = nullptr;
+		AddDefaulted(Num - NumElems);
 	}
-	else
+}
+
+template<typename InAllocatorType>
+inline void TAnyStructArray<InAllocatorType>::Resize(const int32 NewSize)
+{
+	check(NewSize > INDEX_NONE);
+	if (NumElems == NewSize) return;
+
+	// The allocator only carries over the blocks in use, so shrink Num() before the allocation and grow it after
+	if (NewSize < NumElems)
 	{
-		Memory = (uint8*)FMemory::Realloc(Memory, NumElems * Size, GetAlignment());
+		NumElems = NewSize;
 	}
+	ResizeAllocation(GetNumBlocks(NewSize));
+	NumElems = NewSize;
 }
 
+template<typename InAllocatorType>
+FORCEINLINE void TAnyStructArray<InAllocatorType>::SetNumUnsafe(const int32 Num)
+{
+	check(Num > INDEX_NONE && Num <= Max());
+	NumElems = Num;
+}
+
+template<typename InAllocatorType>
 template<typename T>
-UE_NODISCARD FORCEINLINE T& FAnyStructArray::Get(const int32 Index)
+UE_NODISCARD FORCEINLINE T& TAnyStructArray<InAllocatorType>::Get(const int32 Index)
 {
-	checkf(ScriptStruct == TBaseStructure<T>::Get(), TEXT("FAnyStructArray: Type mismatch!"));
+	checkf(ScriptStruct == TBaseStructure<T>::Get(), TEXT("TAnyStructArray: Type mismatch!"));
 	check(IsValidIndex(Index));
-	return ((T*)Memory)[Index];
+	return ((T*)GetData())[Index];
 }
 
+template<typename InAllocatorType>
 template<typename T>
-UE_NODISCARD FORCEINLINE const T& FAnyStructArray::Get(const int32 Index) const
+UE_NODISCARD FORCEINLINE const T& TAnyStructArray<InAllocatorType>::Get(const int32 Index) const
 {
-	return const_cast<FAnyStructArray*>(this)->Get<T>(Index);
+	return const_cast<TAnyStructArray*>(this)->Get<T>(Index);
 }
 
-UE_NODISCARD FORCEINLINE void* FAnyStructArray::GetRawPtr(const int32 Index)
+template<typename InAllocatorType>
+UE_NODISCARD FORCEINLINE void* TAnyStructArray<InAllocatorType>::GetRawPtr(const int32 Index)
 {
 	check(IsValidIndex(Index));
-	return Memory + Index * GetStructureSize();
+	return GetData() + Index * GetStructureSize();
 }
 
-UE_NODISCARD FORCEINLINE const void* FAnyStructArray::GetRawPtr(const int32 Index) const
+template<typename InAllocatorType>
+UE_NODISCARD FORCEINLINE const void* TAnyStructArray<InAllocatorType>::GetRawPtr(const int32 Index) const
 {
 	check(IsValidIndex(Index));
-	return Memory + Index * GetStructureSize();
+	return GetData() + Index * GetStructureSize();
 }
 
+template<typename InAllocatorType>
 template<typename T>
-UE_NODISCARD FORCEINLINE T& FAnyStructArray::Last()
+UE_NODISCARD FORCEINLINE T& TAnyStructArray<InAllocatorType>::Last()
 {
-	checkf(!IsEmpty(), TEXT("FAnyStructArray: Attempted to retrieve last element from an empty array!"));
+	checkf(!IsEmpty(), TEXT("TAnyStructArray: Attempted to retrieve last element from an empty array!"));
 	return Get<T>(NumElems - 1);
 }
 
+template<typename InAllocatorType>
 template<typename T>
-UE_NODISCARD FORCEINLINE const T& FAnyStructArray::Last() const
+UE_NODISCARD FORCEINLINE const T& TAnyStructArray<InAllocatorType>::Last() const
 {
-	checkf(!IsEmpty(), TEXT("FAnyStructArray: Attempted to retrieve last element from an empty array!"));
+	checkf(!IsEmpty(), TEXT("TAnyStructArray: Attempted to retrieve last element from an empty array!"));
 	return Get<T>(NumElems - 1);
 }
 
-UE_NODISCARD FORCEINLINE void* FAnyStructArray::Last()
+template<typename InAllocatorType>
+UE_NODISCARD FORCEINLINE void* TAnyStructArray<InAllocatorType>::Last()
 {
-	checkf(!IsEmpty(), TEXT("FAnyStructArray: Attempted to retrieve last element from an empty array!"));
+	checkf(!IsEmpty(), TEXT("TAnyStructArray: Attempted to retrieve last element from an empty array!"));
 	return GetRawPtr(NumElems - 1);
 }
 
-UE_NODISCARD FORCEINLINE const void* FAnyStructArray::Last() const
+template<typename InAllocatorType>
+UE_NODISCARD FORCEINLINE const void* TAnyStructArray<InAllocatorType>::Last() const
 {
-	checkf(!IsEmpty(), TEXT("FAnyStructArray: Attempted to retrieve last element from an empty array!"));
+	checkf(!IsEmpty(), TEXT("TAnyStructArray: Attempted to retrieve last element from an empty array!"));
 	return GetRawPtr(NumElems - 1);
 }
 
-inline void FAnyStructArray::SetNumUninitialized(const int32 Num)
+template<typename InAllocatorType>
+template<typename T>
+UE_NODISCARD FORCEINLINE TArrayView<T> TAnyStructArray<InAllocatorType>::ForEach()
 {
-	check(Num > INDEX_NONE);
-	if (Num == NumElems) return;
+	checkf(ScriptStruct == TBaseStructure<T>::Get(), TEXT("TAnyStructArray: Type mismatch!"));
+	return TArrayView<T>((T*)GetData(), NumElems);
+}
 
-	const int32 StructureSize = GetStructureSize();
-	if (Num < NumElems)
-	{
-		ScriptStruct->DestroyStruct(Memory + (Num - 1) * StructureSize, NumElems - Num);
-	}
+template<typename InAllocatorType>
+template<typename T>
+UE_NODISCARD FORCEINLINE TArrayView<const T> TAnyStructArray<InAllocatorType>::ForEach() const
+{
+	checkf(ScriptStruct == TBaseStructure<T>::Get(), TEXT("TAnyStructArray: Type mismatch!"));
+	return TArrayView<const T>((const T*)GetData(), NumElems);
+}
 
-	if (Num == 0)
-	{
-		FMemory::Free(Memory);
-		Memory = nullptr;
-	}
-	else
-	{
-		Memory = (uint8*)FMemory::Realloc(Memory, Num * StructureSize, ScriptStruct->GetMinAlignment());
-	}
+template<typename InAllocatorType>
+inline void TAnyStructArray<InAllocatorType>::AddReferencedObjects(FReferenceCollector& Collector)
+{
+	Collector.AddReferencedObject(ScriptStruct);
 
-	NumElems = Num;
+	if (!ScriptStruct || NumElems == 0) return;
+	FECSStructReferences::Get(ScriptStruct).AddReferencedObjects(GetData(), NumElems, GetStructureSize(), Collector);
 }
 
-inline void FAnyStructArray::SetNum(const int32 Num)
+/**
+ * Reflected wrapper around a heap allocated TAnyStructArray so it can be used in UPROPERTYs and Blueprints. UHT can't reflect the
+ * template, so this only adds the struct ops hooks and forwards everything else
+ */
+USTRUCT(BlueprintType)
+struct ECSUTILS_API FAnyStructArray
 {
-	check(Num > INDEX_NONE);
-	if (Num == NumElems) return;
+	GENERATED_BODY()
 
-	const int32 StructureSize = GetStructureSize();
-	if (Num < NumElems)
-	{
-		ScriptStruct->DestroyStruct(Memory + (Num - 1) * StructureSize, NumElems - Num);
-	}
-	else
-	{
-		ScriptStruct->InitializeStruct(Memory + (NumElems - 1) * StructureSize, Num - NumElems);
-	}
+	using FArrayType = TAnyStructArray<FDefaultAllocator>;
 
-	if (Num == 0)
-	{
-		FMemory::Free(Memory);
-		Memory = nullptr;
-	}
-	else
-	{
-		Memory = (uint8*)FMemory::Realloc(Memory, Num * StructureSize, ScriptStruct->GetMinAlignment());
-	}
+	FAnyStructArray() = default;
+	explicit FAnyStructArray(ENoInit) {}
+	explicit FAnyStructArray(const UScriptStruct* ScriptStruct) : Array(ScriptStruct) {}
+	explicit FAnyStructArray(const UScriptStruct* ScriptStruct, const void* Copy, const int32 ArrNum = 1) : Array(ScriptStruct, Copy, ArrNum) {}
+	explicit FAnyStructArray(FArrayType&& InArray) : Array(MoveTemp(InArray)) {}
+	template<typename T> FAnyStructArray(const std::initializer_list<T>& InitList) : Array(InitList) {}
 
-	NumElems = Num;
-}
+	template<typename T>
+	static FAnyStructArray Make() { return FAnyStructArray(FArrayType::Make<T>()); }
 
-inline void FAnyStructArray::Resize(const int32 NewSize)
-{
-	check(NewSize > INDEX_NONE);
-	if (NumElems == NewSize) return;
-	NumElems = NewSize;
-	if (NumElems == 0)
-	{
-		FMemory::Free(Memory);
-		Memory = nullptr;
-	}
-	else if (Memory)
-	{
-		Memory = (uint8*)FMemory::Malloc(NumElems * GetStructureSize(), GetAlignment());
-	}
-	else
-	{
-		Memory = (uint8*)FMemory::Realloc(Memory, NumElems * GetStructureSize(), GetAlignment());
-	}
-}
+	template<typename T>
+	static FAnyStructArray Make(const int32 Num) { return FAnyStructArray(FArrayType::Make<T>(Num)); }
 
-FORCEINLINE bool FAnyStructArray::IsEmpty() const
-{
-	return NumElems == 0;
-}
+	template<typename T, typename SizeType = int32>
+	static FAnyStructArray Make(const TConstArrayView<T, SizeType>& ArrayView) { return FAnyStructArray(FArrayType::Make<T, SizeType>(ArrayView)); }
 
-FORCEINLINE bool FAnyStructArray::IsValidIndex(const int32 Index) const
-{
-	return Index < NumElems && Index > INDEX_NONE;
-}
+	template<typename T>
+	FORCEINLINE FAnyStructArray& operator=(const std::initializer_list<T>& InitList) { Array = InitList; return *this; }
 
-FORCEINLINE int32 FAnyStructArray::Num() const
-{
-	return NumElems;
-}
+	FORCEINLINE bool operator==(const FAnyStructArray& Other) const { return Array == Other.Array; }
+	FORCEINLINE bool operator!=(const FAnyStructArray& Other) const { return Array != Other.Array; }
 
-FORCEINLINE bool FAnyStructArray::IsA(const UScriptStruct* InType) const
-{
-	return ensure(ScriptStruct) && ScriptStruct->IsChildOf(InType);
-}
+	FORCEINLINE void Empty() { Array.Empty(); }
+	FORCEINLINE void Reset(const int32 NewSize = 0) { Array.Reset(NewSize); }
+	FORCEINLINE void Reserve(const int32 Num) { Array.Reserve(Num); }
+	FORCEINLINE void Shrink() { Array.Shrink(); }
 
-template<typename T>
-FORCEINLINE bool FAnyStructArray::IsA() const
-{
-	return IsA(TBaseStructure<T>::Get());
-}
+	template<typename T, typename... ParamTypes>
+	FORCEINLINE int32 Emplace(ParamTypes&&... Params) { return Array.Emplace<T>(Forward<ParamTypes>(Params)...); }
 
-FORCEINLINE int32 FAnyStructArray::GetStructureSize() const
-{
-	check(ScriptStruct != nullptr);
-	return ScriptStruct->GetStructureSize();
-}
+	template<typename T, typename... ParamTypes>
+	FORCEINLINE T& Emplace_GetRef(ParamTypes&&... Params) { return Array.Emplace_GetRef<T>(Forward<ParamTypes>(Params)...); }
 
-FORCEINLINE int32 FAnyStructArray::GetAlignment() const
-{
-	check(ScriptStruct != nullptr);
-	return ScriptStruct->GetMinAlignment();
-}
+	template<typename T>
+	FORCEINLINE int32 Add(T&& Value) { return Array.Add(Forward<T>(Value)); }
 
-inline void FAnyStructArray::AddStructReferencedObjects(FReferenceCollector& Collector)
-{
-	Collector.AddReferencedObject(ScriptStruct);
+	template<typename T>
+	FORCEINLINE std::decay_t<T>& Add_GetRef(T&& Value) { return Array.Add_GetRef(Forward<T>(Value)); }
 
-	if (!ScriptStruct) return;
-	if (ScriptStruct->StructFlags & STRUCT_AddStructReferencedObjects)
-	{
-		ScriptStruct->GetCppStructOps()->AddStructReferencedObjects()(Memory, Collector);
-	}
+	template<typename T>
+	FORCEINLINE std::decay_t<T>& Insert(T&& Value, const int32 Index) { return Array.Insert(Forward<T>(Value), Index); }
 
-	// Iterate through all properties (even within nested structs) for object properties
-	const int32 StructureSize = GetStructureSize();
-	for (int32 Offset = 0; Offset < NumElems * StructureSize; Offset += StructureSize)
-	{
-		for (TPropertyValueIterator<FObjectProperty> It(ScriptStruct, Memory + Offset); It; ++It)
-		{
-			UObject*& ReferencedObject = *(UObject**)It.Value();
-			Collector.AddReferencedObject(ReferencedObject);
-		}
-	}
-}
+	template<typename T, typename SizeType = int32>
+	FORCEINLINE void Append(const TConstArrayView<T, SizeType>& ArrayView) { Array.Append(ArrayView); }
 
-//~ Iterator
-template<typename T>
-class FAnyStructArray::TIterator
-{
-	friend FAnyStructArray;
-	TIterator() = delete;
-	FORCEINLINE explicit TIterator(FAnyStructArray& Arr)
-		: Arr(Arr)
-	{
-		checkf(Arr.GetType() == TBaseStructure<T>::Get(), TEXT("FAnyStructArray: Type mismatch!"));
-	}
-public:
-	UE_NODISCARD FORCEINLINE T* begin() const { return (T*)Arr.Memory; }
-	UE_NODISCARD FORCEINLINE T* end() const { return (T*)Arr.Memory + Arr.NumElems; }
+	template<typename T>
+	FORCEINLINE void Append(const std::initializer_list<T>& InitList) { Array.Append(InitList); }
 
-private:
-	FAnyStructArray& Arr;
-};
+	FORCEINLINE int32 AddDefaulted(const int32 Num) { return Array.AddDefaulted(Num); }
+	FORCEINLINE int32 AddUninitialized(const int32 Num) { return Array.AddUninitialized(Num); }
+	FORCEINLINE int32 AddFromBuffer(const void* CopyValue) { return Array.AddFromBuffer(CopyValue); }
+	FORCEINLINE void AppendFromBuffer(const void* CopyValues, const int32 Num) { Array.AppendFromBuffer(CopyValues, Num); }
+	FORCEINLINE void* InsertAtFromBuffer(const void* CopyValue, const int32 Index) { return Array.InsertAtFromBuffer(CopyValue, Index); }
 
-template<typename T>
-class FAnyStructArray::TConstIterator
-{
-	friend FAnyStructArray;
-	TConstIterator() = delete;
-	FORCEINLINE explicit TConstIterator(const FAnyStructArray& Arr)
-		: Arr(Arr)
-	{
-		checkf(Arr.GetType() == TBaseStructure<T>::Get(), TEXT("FAnyStructArray: Type mismatch!"));
-	}
-public:
-	UE_NODISCARD FORCEINLINE const T* begin() const { return (T*)Arr.Memory; }
-	UE_NODISCARD FORCEINLINE const T* end() const { return (T*)Arr.Memory + Arr.NumElems; }
+	FORCEINLINE void SetNumUninitialized(const int32 Num) { Array.SetNumUninitialized(Num); }
+	FORCEINLINE void SetNum(const int32 Num) { Array.SetNum(Num); }
 
-private:
-	const FAnyStructArray& Arr;
-};
+	FORCEINLINE void RemoveAt(const int32 Index, const int32 Num = 1) { Array.RemoveAt(Index, Num); }
+	FORCEINLINE void RemoveAtSwap(const int32 Index) { Array.RemoveAtSwap(Index); }
 
-template<typename T>
-UE_NODISCARD FORCEINLINE FAnyStructArray::TIterator<T> FAnyStructArray::ForEach()
-{
-	return FAnyStructArray::TIterator<T>(*this);
-}
+	// Resizes array without calling constructors / destructors. VERY DANGEROUS!
+	FORCEINLINE void Resize(const int32 NewSize) { Array.Resize(NewSize); }
 
-template<typename T>
-UE_NODISCARD FORCEINLINE FAnyStructArray::TConstIterator<T> FAnyStructArray::ForEach() const
+	// Sets Num() within the current capacity without calling constructors / destructors or touching the allocator. VERY DANGEROUS!
+	FORCEINLINE void SetNumUnsafe(const int32 Num) { Array.SetNumUnsafe(Num); }
+
+	template<typename T>
+	FORCEINLINE T& Get(const int32 Index) { return Array.Get<T>(Index); }
+
+	template<typename T>
+	FORCEINLINE const T& Get(const int32 Index) const { return Array.Get<T>(Index); }
+
+	FORCEINLINE void* GetRawPtr(const int32 Index) { return Array.GetRawPtr(Index); }
+	FORCEINLINE const void* GetRawPtr(const int32 Index) const { return Array.GetRawPtr(Index); }
+
+	template<typename T>
+	FORCEINLINE T& Last() { return Array.Last<T>(); }
+
+	template<typename T>
+	FORCEINLINE const T& Last() const { return Array.Last<T>(); }
+
+	FORCEINLINE void* Last() { return Array.Last(); }
+	FORCEINLINE const void* Last() const { return Array.Last(); }
+
+	FORCEINLINE bool IsEmpty() const { return Array.IsEmpty(); }
+	FORCEINLINE bool IsValidIndex(const int32 Index) const { return Array.IsValidIndex(Index); }
+	FORCEINLINE bool IsA(const UScriptStruct* InType) const { return Array.IsA(InType); }
+
+	template<typename T>
+	FORCEINLINE bool IsA() const { return Array.IsA<T>(); }
+
+	FORCEINLINE int32 Num() const { return Array.Num(); }
+	FORCEINLINE int32 Max() const { return Array.Max(); }
+	FORCEINLINE int32 GetSlack() const { return Array.GetSlack(); }
+	FORCEINLINE int32 GetStructureSize() const { return Array.GetStructureSize(); }
+	FORCEINLINE int32 GetAlignment() const { return Array.GetAlignment(); }
+
+	//~ Type traits
+	FORCEINLINE void AddStructReferencedObjects(FReferenceCollector& Collector) { Array.AddReferencedObjects(Collector); }
+	//~
+
+	//~ Simple getters
+	FORCEINLINE const void* GetAllocation() const { return Array.GetAllocation(); }
+	FORCEINLINE const UScriptStruct* GetType() const { return Array.GetType(); }
+	FORCEINLINE FArrayType& GetArray() { return Array; }
+	FORCEINLINE const FArrayType& GetArray() const { return Array; }
+	//~
+
+	template<typename T>
+	FORCEINLINE TArrayView<T> ForEach() { return Array.ForEach<T>(); }
+
+	template<typename T>
+	FORCEINLINE TArrayView<const T> ForEach() const { return Array.ForEach<T>(); }
+
+protected:
+	FArrayType Array;
+};
+
+template<>
+struct TStructOpsTypeTraits<FAnyStructArray> : TStructOpsTypeTraitsBase2<FAnyStructArray>
 {
-	return FAnyStructArray::TConstIterator<T>(*this);
-}
-//
\ No newline at end of file
+	enum
+	{
+		WithCopy = true,
+		WithIdenticalViaEquality = true,
+		WithAddStructReferencedObjects = true,
+	};
+};
@@ -163,4 +163,8 @@ public:
 		*(int32*)RESULT_PARAM = Any.Num();
 		P_NATIVE_END
 	}
+
+	// FAnyStructArray can't reflect the type stored in its TAnyStructArray, so Blueprints read it through here
+	UFUNCTION(BlueprintPure, DisplayName="Get Type (AnyStructArray)", Category="Utilities|AnyStructArray")
+	static UScriptStruct* GetTypeAnyStructArray(const FAnyStructArray& Any) { return const_cast<UScriptStruct*>(Any.GetType()); }
 };
\ No newline at end of file
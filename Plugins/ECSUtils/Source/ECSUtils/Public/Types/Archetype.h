@@ -4,17 +4,28 @@
 #include "CoreMinimal.h"
 #include "ECSBaseTypes.h"
 #include "ECSIDs.h"
+#include "ECSStructReferences.h"
 #include "Archetype.generated.h"
 
 /**
- *
+ * Stores the components of every entity with the same set of components and tags, one row per component type and one column per entity,
+ * split into chunks. Like TArray, it assumes components are bitwise relocatable: entities are moved between columns and archetypes with
+ * memcpy instead of their move constructors.
  */
 USTRUCT()
 struct ECSUTILS_API FArchetype
 {
 	GENERATED_BODY()
 	struct FComponentsRow;
+	struct FColumnMask;
 	friend class UECSSubsystem;
+
+	// Archetypes reached by adding or removing a single component / tag. Filled lazily by UECSSubsystem
+	struct FEdge
+	{
+		FArchetypeID Add;
+		FArchetypeID Remove;
+	};
 	
 	FArchetype() = delete;
 	explicit FArchetype(EForceInit);
@@ -30,14 +41,34 @@ struct ECSUTILS_API FArchetype
 
 	bool HasSameSetIdentifierFlags(const FArchetype& Other, const int32 NumCompsAndTags) const;
 
+	// Whether this archetype contains every component and tag in Signature
+	bool HasAllOf(const TBitArray<>& Signature) const;
+	bool HasAnyOf(const TBitArray<>& Signature) const;
+
+	// Copies this archetype's component / tag bitmask into a signature of NumCompsAndTags bits
+	void GetSignature(TBitArray<>& OutSignature, const int32 NumCompsAndTags) const;
+
 	int32 GetCompRow(const FCompTypeID CompTypeID) const;
-	int32 FindFirstUninitializedRow(const int32 StartColumn = 0) const;
+	int32 FindCompRow(const FCompTypeID CompTypeID) const;// Returns INDEX_NONE if this archetype doesn't contain the component
+	int32 FindFirstUninitializedRow(const int32 StartColumn = 0) const;// Returns the first uninitialized column at or after StartColumn, or INDEX_NONE if full
 
 	int32 AddAtFirstUninitialized(const TConstArrayView<const void*>* OptionalCopy = nullptr, const int32 AllocChunkIfNecessary = 1);
 	
 	int32 AddUninitialized(const int32 Num = 1);
 	int32 AddDefaulted(const int32 Num = 1);
-	bool DestructAt(const int32 ColumnIndex);
+
+	// If packed, the last initialized column is moved into the destructed column and its entity is written to OutMovedEntity
+	bool DestructAt(const int32 ColumnIndex, FEntityID* OutMovedEntity = nullptr);
+
+	// Destroys the initialized columns in [StartIndex, StartIndex + Num) a chunk range at a time, skipping rows without destructors. Never moves columns
+	void DestructRange(const int32 StartIndex, const int32 Num);
+
+	// Same as DestructAt without destroying the components. Used once they have been relocated to another archetype
+	bool ReleaseAt(const int32 ColumnIndex, FEntityID* OutMovedEntity = nullptr);
+
+	// Packed archetypes keep all initialized columns within [0, GetNumInitializedColumns()). Enabling compacts the archetype and calls OnColumnMoved(EntityID, NewColumnIndex) for every relocated entity
+	template<typename TFunctor>
+	void SetPacked(const bool bValue, TFunctor&& OnColumnMoved);
 
 	//~
 	// Getters
@@ -48,6 +79,26 @@ struct ECSUTILS_API FArchetype
 
 	FORCEINLINE int32 GetNumRows() const { return NumRows; }
 	FORCEINLINE int32 GetNumColumns() const { return NumColumns; }
+	FORCEINLINE int32 GetNumChunks() const { return NumChunks; }
+	FORCEINLINE int32 GetChunkCapacity() const { return ChunkCapacity; }
+	FORCEINLINE int32 GetNumInitializedColumns() const { return NumInitializedColumns; }
+	FORCEINLINE bool IsPacked() const { return bPacked; }
+
+	FEntityID GetColumnEntity(const int32 ColumnIndex) const;
+	//~
+
+	//~
+	// Change versions. Every row of every chunk stores the version it was last written in. Versions are compared wrap-around safe
+	uint32 GetChangeVersion(const int32 RowIndex, const int32 ChunkIndex) const;
+	bool HasRowChangedSince(const int32 RowIndex, const int32 ChunkIndex, const uint32 Version) const;
+
+	// Const as queries write components through const archetypes. Chunks are never shared between workers so this is thread-safe within a query
+	void MarkRowChanged(const int32 RowIndex, const int32 ChunkIndex, const uint32 Version) const;
+
+	// Marks every row of the chunks containing the columns
+	void MarkColumnsChanged(const int32 StartColumn, const int32 Num, const uint32 Version) const;
+
+	static bool IsNewerVersion(const uint32 Version, const uint32 Other);
 	//~
 
 	//~
@@ -68,9 +119,40 @@ struct ECSUTILS_API FArchetype
 
 	template<typename TFunctor>
 	void ForEachInitializedColumnWithBreak(const int32 StartIndex, TFunctor&& Functor) const;
+
+	template<typename TFunctor>
+	void ForEachInitializedColumnInRange(const int32 StartIndex, const int32 Num, TFunctor&& Functor) const;
+
+	// Exclusive upper bound of initialized columns. Iterating [0, GetColumnEnd()) visits every initialized column
+	int32 GetColumnEnd() const;
+
+	int32 CountInitializedColumnsInRange(const int32 StartIndex, const int32 Num) const;
+
+	// Initialized flags of the columns starting at StartIndex
+	FColumnMask GetColumnMask(const int32 StartIndex) const;
+
+	// Splits the column range [FirstColumn, FirstColumn + Num) on chunk boundaries. Functor(StartColumn, Num) receives ranges that are contiguous within every row
+	template<typename TFunctor>
+	void ForEachColumnRange(const int32 FirstColumn, const int32 Num, TFunctor&& Functor) const;
 	
 private:
+	void AllocateChunks(const int32 Num);
+
 	void SetColumnInitializedFlag(const bool bValue, const int32 Index);
+
+	// Sets the flags of columns [StartIndex, StartIndex + Num) a word at a time. Every flag in the range must currently be !bValue
+	void SetColumnRangeInitializedFlag(const bool bValue, const int32 StartIndex, const int32 Num);
+
+	// Moves initialized columns from the back into holes at the front until they meet. Calls OnColumnMoved(EntityID, NewColumnIndex) for every relocated entity
+	template<typename TFunctor>
+	void Compact(TFunctor&& OnColumnMoved);
+
+	// Returns the first of Num contiguous uninitialized columns after the last initialized one. Grows if necessary
+	int32 ReserveColumnRange(const int32 Num);
+	void SetColumnEntity(const int32 ColumnIndex, const FEntityID EntityID);
+
+	// Bitwise relocates an initialized column into an uninitialized one
+	void MoveColumn(const int32 FromColumn, const int32 ToColumn);
 	
 	template<typename TFunctor>
 	void ForEachRow(TFunctor&& Functor);
@@ -86,12 +168,28 @@ private:
 	
 	static constexpr SIZE_T BITELEM_SIZE_BITS = BITELEM_SIZE_BYTES * 8;
 	using FBitElem = TUnsignedIntType_T<BITELEM_SIZE_BYTES>;
+
+	// Target size of a single chunk of component memory. Each chunk stores ChunkCapacity columns of every row back to back
+	static constexpr int32 CHUNK_SIZE_BYTES = 16 * 1024;
 	
 	const int32 NumRows;
-	int32 NumColumns;
+	int32 NumColumns;// Always NumChunks * ChunkCapacity
+	int32 NumInitializedColumns;
+	bool bPacked;
+	int32 NumChunks;
+	int32 ChunkCapacity;// Number of columns per chunk. Derived from the summed row sizes
+	int32 ChunkSize;// Allocation size of each chunk in bytes
+	int32 ChunkAlignment;
+	uint8** Chunks;// Chunks are never reallocated so component addresses are stable for the lifetime of their chunk
+	uint32* ChangeVersions;// Index via ChunkIndex * NumRows + RowIndex
+	FEntityID* ColumnEntities;// Owning entity of each initialized column
 	FBitElem* InitializedColumnBitMask;
+	mutable int32 FreeWordHint;// Every InitializedColumnBitMask word before this one is full
 	FBitElem* IncludedCompTagBitMask;
 	FComponentsRow* Rows;
+	int32* CompRowLookup;// Index via FCompTypeID. Built once on construction
+	int32 CompRowLookupNum;
+	TMap<int32, FEdge> Edges;// Index via signature bit (FCompTypeID, or FTagTypeID offset by the number of components)
 };
 
 template<>
@@ -118,35 +216,83 @@ struct FArchetype::FComponentsRow
 	template<typename T> FORCEINLINE bool IsA() const { return IsA(T::StaticStruct()); }
 
 	template<typename T>
-	UE_NODISCARD FORCEINLINE T& Get(const int32 Index) { check(ScriptStruct == TBaseStructure<T>::Get()); return ((T*)Memory)[Index]; }
+	UE_NODISCARD FORCEINLINE T& Get(const int32 Index) { check(ScriptStruct == TBaseStructure<T>::Get()); return *(T*)(*this)[Index]; }
 
 	template<typename T>
-	UE_NODISCARD FORCEINLINE const T& Get(const int32 Index) const { check(ScriptStruct == TBaseStructure<T>::Get()); return ((T*)Memory)[Index]; }
+	UE_NODISCARD FORCEINLINE const T& Get(const int32 Index) const { check(ScriptStruct == TBaseStructure<T>::Get()); return *(const T*)(*this)[Index]; }
+
+	FORCEINLINE int32 GetSize() const { return Size; }
+	FORCEINLINE int32 GetAlignment() const { return Alignment; }
+
+	FORCEINLINE bool IsZeroConstructed() const { return Flags & ZeroConstructed; }
+	FORCEINLINE bool IsPlainOldData() const { return Flags & PlainOldData; }
+	FORCEINLINE bool HasDestructor() const { return !(Flags & NoDestructor); }
+
+	// Construct, copy assign or destroy Num contiguous elements. Rows whose type allows it use memset / memcpy instead of the UScriptStruct calls
+	void InitializeItems(uint8* Dest, const int32 Num = 1) const;
+	void CopyItems(uint8* Dest, const uint8* Source, const int32 Num = 1) const;
+	void DestroyItems(uint8* Dest, const int32 Num = 1) const;
 
 private:
+	// Capabilities of ScriptStruct. Cached on construction
+	enum EFlags : uint8
+	{
+		ZeroConstructed = 1 << 0,
+		PlainOldData = 1 << 1,
+		NoDestructor = 1 << 2,
+	};
+
 	FORCEINLINE explicit FComponentsRow(const UScriptStruct* ScriptStruct)
-		: Memory(nullptr), ScriptStruct(ScriptStruct)
+		: Chunks(nullptr), ChunkOffset(0), ChunkCapacity(0), Size(ScriptStruct->GetStructureSize()), Alignment(ScriptStruct->GetMinAlignment()), Flags(0), ScriptStruct(ScriptStruct)
 	{
 		check(ScriptStruct);
-	}
 
-	FORCEINLINE int32 GetSize() const { return ScriptStruct->GetStructureSize(); }
-	FORCEINLINE int32 GetAlignment() const { return ScriptStruct->GetMinAlignment(); }
+		// Plain old data is implicitly zero constructible, memcpy copyable and has no destructor
+		const bool bPlainOldData = ScriptStruct->StructFlags & STRUCT_IsPlainOldData;
+		if (bPlainOldData || ScriptStruct->StructFlags & STRUCT_ZeroConstructor) Flags |= ZeroConstructed;
+		if (bPlainOldData) Flags |= PlainOldData;
+		if (bPlainOldData || ScriptStruct->StructFlags & STRUCT_NoDestructor) Flags |= NoDestructor;
+	}
 
-	uint8* Memory;
+	uint8** Chunks;// Mirrors FArchetype::Chunks. Updated whenever the chunk table grows
+	int32 ChunkOffset;// Byte offset of this row's elements within each chunk
+	int32 ChunkCapacity;
+	int32 Size;
+	int32 Alignment;
+	uint8 Flags;
 	const UScriptStruct* ScriptStruct;
 };
 
+// View over the initialized flags of a range of columns. Index 0 is the first column of the range
+struct FArchetype::FColumnMask
+{
+	friend FArchetype;
+	FColumnMask() = delete;
+
+	FORCEINLINE bool operator[](const int32 Index) const
+	{
+		const int32 Bit = StartBit + Index;
+		return Words[Bit / BITELEM_SIZE_BITS] & (FBitElem)1 << Bit % BITELEM_SIZE_BITS;
+	}
+
+private:
+	FORCEINLINE explicit FColumnMask(const FBitElem* Words, const int32 StartBit)
+		: Words(Words), StartBit(StartBit) {}
+
+	const FBitElem* Words;
+	int32 StartBit;
+};
+
 FORCEINLINE uint8* FArchetype::FComponentsRow::operator[](const int32 ColumnIndex)
 {
-	check(Memory);
-	return Memory + ColumnIndex * GetSize();
+	check(Chunks);
+	return Chunks[ColumnIndex / ChunkCapacity] + ChunkOffset + (ColumnIndex % ChunkCapacity) * Size;
 }
 
 FORCEINLINE const uint8* FArchetype::FComponentsRow::operator[](const int32 ColumnIndex) const
 {
-	check(Memory);
-	return Memory + ColumnIndex * GetSize();
+	check(Chunks);
+	return Chunks[ColumnIndex / ChunkCapacity] + ChunkOffset + (ColumnIndex % ChunkCapacity) * Size;
 }
 
 
@@ -156,23 +302,95 @@ FORCEINLINE const uint8* FArchetype::FComponentsRow::operator[](const int32 Colu
 
 
 FORCEINLINE FArchetype::FArchetype(EForceInit)
-	: NumRows(0), NumColumns(0), InitializedColumnBitMask(nullptr), IncludedCompTagBitMask(nullptr), Rows(nullptr)
+	: NumRows(0), NumColumns(0), NumInitializedColumns(0), bPacked(false), NumChunks(0), ChunkCapacity(0), ChunkSize(0), ChunkAlignment(0), Chunks(nullptr), ColumnEntities(nullptr), InitializedColumnBitMask(nullptr), IncludedCompTagBitMask(nullptr), Rows(nullptr), CompRowLookup(nullptr), CompRowLookupNum(0)
 {
 	check(false);
 }
 
 inline FArchetype::FArchetype(const TBitArray<>& HasCompTagBitMask, const TConstArrayView<const UScriptStruct*>& Comps)
-	: NumRows(Comps.Num()), NumColumns(0), InitializedColumnBitMask(nullptr)
+	: NumRows(Comps.Num()), NumColumns(0), NumInitializedColumns(0), bPacked(false), NumChunks(0), Chunks(nullptr), ChangeVersions(nullptr), ColumnEntities(nullptr), InitializedColumnBitMask(nullptr), FreeWordHint(0)
 {
-	// Allocate bitmask and copy
+	// Allocate bitmask and copy. The source is stored in 32 bit words so only copy those to avoid reading past its allocation
 	const SIZE_T BitMaskNumBytes = FMath::DivideAndRoundUp<SIZE_T>(HasCompTagBitMask.Num(), BITELEM_SIZE_BITS) * BITELEM_SIZE_BYTES;
-	IncludedCompTagBitMask = (FBitElem*)FMemory::Malloc(BitMaskNumBytes, alignof(FBitElem));
-	FMemory::Memcpy(IncludedCompTagBitMask, HasCompTagBitMask.GetData(), BitMaskNumBytes);
+	IncludedCompTagBitMask = (FBitElem*)FMemory::MallocZeroed(BitMaskNumBytes, alignof(FBitElem));
+	FMemory::Memcpy(IncludedCompTagBitMask, HasCompTagBitMask.GetData(), FMath::DivideAndRoundUp(HasCompTagBitMask.Num(), NumBitsPerDWORD) * sizeof(uint32));
 
 	// Allocate rows and construct from comp types
 	Rows = (FComponentsRow*)FMemory::Malloc(NumRows * sizeof(FComponentsRow), alignof(FComponentsRow));
 	for (int32 i = 0; i < NumRows; i++)
 		new (Rows + i) FComponentsRow(Comps[i]);
+
+	// Rows are ordered by FCompTypeID and component bits precede tag bits so the N-th set bit maps to the N-th row
+	CompRowLookupNum = 0;
+	int32 NumVisitedComps = 0;
+	for (TConstSetBitIterator<> It(HasCompTagBitMask); It && NumVisitedComps < NumRows; ++It, ++NumVisitedComps)
+		CompRowLookupNum = It.GetIndex() + 1;
+
+	CompRowLookup = (int32*)FMemory::Malloc(FMath::Max(CompRowLookupNum, 1) * sizeof(int32), alignof(int32));
+	for (int32 i = 0; i < CompRowLookupNum; ++i)
+		CompRowLookup[i] = INDEX_NONE;
+
+	int32 RowIndex = 0;
+	for (TConstSetBitIterator<> It(HasCompTagBitMask); It && RowIndex < NumRows; ++It)
+		CompRowLookup[It.GetIndex()] = RowIndex++;
+
+	// Derive the number of columns per chunk from the summed row sizes. Reserve the worst case alignment padding between rows
+	int32 SummedSize = 0, PaddingSlack = 0;
+	ChunkAlignment = 1;
+	ForEachRow([&](const FComponentsRow& Row)
+	{
+		SummedSize += Row.GetSize();
+		PaddingSlack += Row.GetAlignment() - 1;
+		ChunkAlignment = FMath::Max(ChunkAlignment, Row.GetAlignment());
+	});
+
+	// Tag-only archetypes have no component memory so a chunk may hold any number of columns
+	ChunkCapacity = SummedSize > 0 ? FMath::Max((CHUNK_SIZE_BYTES - PaddingSlack) / SummedSize, 1) : CHUNK_SIZE_BYTES;
+
+	// Lay out each row's elements contiguously within the chunk
+	int32 Offset = 0;
+	ForEachRow([&](FComponentsRow& Row)
+	{
+		Offset = Align(Offset, Row.GetAlignment());
+		Row.ChunkOffset = Offset;
+		Row.ChunkCapacity = ChunkCapacity;
+		Offset += Row.GetSize() * ChunkCapacity;
+	});
+
+	// Only exceeds the target chunk size if a single column doesn't fit
+	ChunkSize = FMath::Max(Offset, 1);
+}
+
+FORCEINLINE void FArchetype::FComponentsRow::InitializeItems(uint8* Dest, const int32 Num) const
+{
+	if (IsZeroConstructed())
+	{
+		FMemory::Memzero(Dest, Size * Num);
+	}
+	else
+	{
+		ScriptStruct->InitializeStruct(Dest, Num);
+	}
+}
+
+FORCEINLINE void FArchetype::FComponentsRow::CopyItems(uint8* Dest, const uint8* Source, const int32 Num) const
+{
+	if (IsPlainOldData())
+	{
+		FMemory::Memcpy(Dest, Source, Size * Num);
+	}
+	else
+	{
+		ScriptStruct->CopyScriptStruct(Dest, Source, Num);
+	}
+}
+
+FORCEINLINE void FArchetype::FComponentsRow::DestroyItems(uint8* Dest, const int32 Num) const
+{
+	if (HasDestructor())
+	{
+		ScriptStruct->DestroyStruct(Dest, Num);
+	}
 }
 
 inline FArchetype::~FArchetype()
@@ -180,9 +398,11 @@ inline FArchetype::~FArchetype()
 	// Destroy initialized components
 	ForEachRow([this](FComponentsRow& Row)
 	{
+		if (!Row.HasDestructor()) return;
+
 		ForEachInitializedColumn([&Row](const int32 Index)
 		{
-			Row.ScriptStruct->DestroyStruct(Row[Index]);
+			Row.DestroyItems(Row[Index]);
 		});
 
 		// Destruct row. May be unnecessary
@@ -190,7 +410,14 @@ inline FArchetype::~FArchetype()
 	});
 
 	// Free allocations
+	for (int32 i = 0; i < NumChunks; ++i)
+		FMemory::Free(Chunks[i]);
+
+	FMemory::Free(Chunks);
+	FMemory::Free(ChangeVersions);
+	FMemory::Free(ColumnEntities);
 	FMemory::Free(Rows);
+	FMemory::Free(CompRowLookup);
 	FMemory::Free(InitializedColumnBitMask);
 	FMemory::Free(IncludedCompTagBitMask);
 }
@@ -214,14 +441,90 @@ FORCEINLINE bool FArchetype::IsColumnInitialized(const int32 Index) const
 FORCEINLINE void FArchetype::SetColumnInitializedFlag(const bool bValue, const int32 Index)
 {
 	check(IsValidColumn(Index));
-	if (bValue)
+	FBitElem& Elem = InitializedColumnBitMask[Index / BITELEM_SIZE_BITS];
+	const FBitElem Mask = (FBitElem)1 << Index % BITELEM_SIZE_BITS;
+	if (bValue == ((Elem & Mask) != 0)) return;
+
+	Elem ^= Mask;
+	NumInitializedColumns += bValue ? 1 : -1;
+
+	if (!bValue)
 	{
-		InitializedColumnBitMask[Index / BITELEM_SIZE_BITS] |= 1ull << Index % BITELEM_SIZE_BITS;
+		FreeWordHint = FMath::Min<int32>(FreeWordHint, Index / BITELEM_SIZE_BITS);
 	}
-	else
+}
+
+FORCEINLINE FEntityID FArchetype::GetColumnEntity(const int32 ColumnIndex) const
+{
+	checkf(IsColumnInitialized(ColumnIndex), TEXT("Attempted to retrieve the entity of uninitialized column %i"), ColumnIndex);
+	return ColumnEntities[ColumnIndex];
+}
+
+FORCEINLINE void FArchetype::SetColumnEntity(const int32 ColumnIndex, const FEntityID EntityID)
+{
+	check(IsValidColumn(ColumnIndex));
+	ColumnEntities[ColumnIndex] = EntityID;
+}
+
+inline void FArchetype::MoveColumn(const int32 FromColumn, const int32 ToColumn)
+{
+	check(IsColumnInitialized(FromColumn));
+	check(!IsColumnInitialized(ToColumn));
+
+	ForEachRow([&](FComponentsRow& Row)
+	{
+		FMemory::Memcpy(Row[ToColumn], Row[FromColumn], Row.GetSize());
+	});
+
+	// The destination chunk must not appear older than the data moved into it
+	const int32 FromChunk = FromColumn / ChunkCapacity, ToChunk = ToColumn / ChunkCapacity;
+	if (FromChunk != ToChunk)
 	{
-		InitializedColumnBitMask[Index / BITELEM_SIZE_BITS] &= ~(1ull << Index % BITELEM_SIZE_BITS);
+		for (int32 RowIndex = 0; RowIndex < NumRows; ++RowIndex)
+		{
+			const uint32 FromVersion = GetChangeVersion(RowIndex, FromChunk);
+			if (IsNewerVersion(FromVersion, GetChangeVersion(RowIndex, ToChunk)))
+				MarkRowChanged(RowIndex, ToChunk, FromVersion);
+		}
 	}
+
+	ColumnEntities[ToColumn] = ColumnEntities[FromColumn];
+	SetColumnInitializedFlag(false, FromColumn);
+	SetColumnInitializedFlag(true, ToColumn);
+}
+
+FORCEINLINE bool FArchetype::IsNewerVersion(const uint32 Version, const uint32 Other)
+{
+	return (int32)(Version - Other) > 0;
+}
+
+FORCEINLINE uint32 FArchetype::GetChangeVersion(const int32 RowIndex, const int32 ChunkIndex) const
+{
+	check(IsValidRow(RowIndex));
+	check(ChunkIndex >= 0 && ChunkIndex < NumChunks);
+	return ChangeVersions[ChunkIndex * NumRows + RowIndex];
+}
+
+FORCEINLINE bool FArchetype::HasRowChangedSince(const int32 RowIndex, const int32 ChunkIndex, const uint32 Version) const
+{
+	return IsNewerVersion(GetChangeVersion(RowIndex, ChunkIndex), Version);
+}
+
+FORCEINLINE void FArchetype::MarkRowChanged(const int32 RowIndex, const int32 ChunkIndex, const uint32 Version) const
+{
+	check(IsValidRow(RowIndex));
+	check(ChunkIndex >= 0 && ChunkIndex < NumChunks);
+	ChangeVersions[ChunkIndex * NumRows + RowIndex] = Version;
+}
+
+inline void FArchetype::MarkColumnsChanged(const int32 StartColumn, const int32 Num, const uint32 Version) const
+{
+	ForEachColumnRange(StartColumn, Num, [&](const int32 RangeStart, const int32)
+	{
+		const int32 ChunkIndex = RangeStart / ChunkCapacity;
+		for (int32 RowIndex = 0; RowIndex < NumRows; ++RowIndex)
+			MarkRowChanged(RowIndex, ChunkIndex, Version);
+	});
 }
 
 inline int32 FArchetype::AddAtFirstUninitialized(const TConstArrayView<const void*>* OptionalCopy, const int32 AllocChunkIfNecessary)
@@ -229,14 +532,7 @@ inline int32 FArchetype::AddAtFirstUninitialized(const TConstArrayView<const voi
 	check(AllocChunkIfNecessary > 0);
 	checkf(!OptionalCopy || OptionalCopy->Num() == NumRows, TEXT("Invalid number of columns"));
 	
-	int32 UninitializedRow = INDEX_NONE;
-	for (int32 i = 0; i < NumColumns; ++i)
-	{
-		if (IsColumnInitialized(i)) continue;
-		UninitializedRow = i;
-		break;
-	}
-
+	int32 UninitializedRow = FindFirstUninitializedRow();
 	if (UNLIKELY(UninitializedRow == INDEX_NONE))
 	{
 		UninitializedRow = AddUninitialized(AllocChunkIfNecessary);
@@ -247,11 +543,18 @@ inline int32 FArchetype::AddAtFirstUninitialized(const TConstArrayView<const voi
 	{
 		FComponentsRow& Column = Rows[i];
 		uint8* Item = Column[UninitializedRow];
+
+		// Plain old data can be copied straight into uninitialized memory
+		if (OptionalCopy && Column.IsPlainOldData())
+		{
+			FMemory::Memcpy(Item, (*OptionalCopy)[i], Column.GetSize());
+			continue;
+		}
 			
-		Column.ScriptStruct->InitializeStruct(Item);
+		Column.InitializeItems(Item);
 		if (OptionalCopy)
 		{
-			Column.ScriptStruct->CopyScriptStruct(Item, (*OptionalCopy)[i]);
+			Column.CopyItems(Item, (const uint8*)(*OptionalCopy)[i]);
 		}
 	}
 	
@@ -260,12 +563,38 @@ inline int32 FArchetype::AddAtFirstUninitialized(const TConstArrayView<const voi
 	return UninitializedRow;
 }
 
+inline void FArchetype::AllocateChunks(const int32 Num)
+{
+	check(Num > 0);
+
+	// Only the chunk table is reallocated. Existing chunks and the components within them never move
+	Chunks = (uint8**)FMemory::Realloc(Chunks, (NumChunks + Num) * sizeof(uint8*), alignof(uint8*));
+	for (int32 i = NumChunks; i < NumChunks + Num; ++i)
+		Chunks[i] = (uint8*)FMemory::Malloc(ChunkSize, ChunkAlignment);
+
+	if (NumRows > 0)
+	{
+		ChangeVersions = (uint32*)FMemory::Realloc(ChangeVersions, (NumChunks + Num) * NumRows * sizeof(uint32), alignof(uint32));
+		FMemory::Memzero(ChangeVersions + NumChunks * NumRows, Num * NumRows * sizeof(uint32));
+	}
+
+	NumChunks += Num;
+
+	ForEachRow([this](FComponentsRow& Row)
+	{
+		Row.Chunks = Chunks;
+	});
+}
+
 inline int32 FArchetype::AddUninitialized(const int32 Num)
 {
 	check(Num > 0);
 
+	// Grow by whole chunks. May add more columns than requested
 	const int32 OldNumColumns = NumColumns;
-	NumColumns += Num;
+	AllocateChunks(FMath::DivideAndRoundUp(Num, ChunkCapacity));
+	NumColumns = NumChunks * ChunkCapacity;
+
 	const SIZE_T NumBytes = FMath::DivideAndRoundUp<SIZE_T>(NumColumns, BITELEM_SIZE_BITS) * BITELEM_SIZE_BYTES;
 	if (UNLIKELY(!InitializedColumnBitMask))
 	{
@@ -273,70 +602,175 @@ inline int32 FArchetype::AddUninitialized(const int32 Num)
 	}
 	else
 	{
-		// Allocate new bytes for BitMask if necessary
-		if (NumBytes != FMath::DivideAndRoundUp<SIZE_T>(OldNumColumns, BITELEM_SIZE_BITS) * BITELEM_SIZE_BYTES)
+		// Allocate new bytes for BitMask if necessary and set new bits to false. Bits past the old column count within the last word were never set
+		const SIZE_T OldNumBytes = FMath::DivideAndRoundUp<SIZE_T>(OldNumColumns, BITELEM_SIZE_BITS) * BITELEM_SIZE_BYTES;
+		if (NumBytes != OldNumBytes)
 		{
 			InitializedColumnBitMask = (FBitElem*)FMemory::Realloc(InitializedColumnBitMask, NumBytes, alignof(FBitElem));
+			FMemory::Memzero((uint8*)InitializedColumnBitMask + OldNumBytes, NumBytes - OldNumBytes);
 		}
+	}
 
-		// Set new bits to false
-		for (int32 i = OldNumColumns; i < NumColumns; ++i)
-		{
-			SetColumnInitializedFlag(false, i);
-		}
+	ColumnEntities = (FEntityID*)FMemory::Realloc(ColumnEntities, NumColumns * sizeof(FEntityID), alignof(FEntityID));
+
+	// The previously last word may have gained free columns
+	FreeWordHint = FMath::Min<int32>(FreeWordHint, OldNumColumns / BITELEM_SIZE_BITS);
+
+	return OldNumColumns;
+}
+
+inline void FArchetype::SetColumnRangeInitializedFlag(const bool bValue, const int32 StartIndex, const int32 Num)
+{
+	check(Num >= 0);
+	check(StartIndex >= 0 && StartIndex + Num <= NumColumns);
+
+	for (int32 i = StartIndex; i < StartIndex + Num;)
+	{
+		const int32 Bit = i % BITELEM_SIZE_BITS;
+		const int32 Count = FMath::Min<int32>(BITELEM_SIZE_BITS - Bit, StartIndex + Num - i);
+		const FBitElem Mask = (Count == BITELEM_SIZE_BITS ? ~(FBitElem)0 : ((FBitElem)1 << Count) - 1) << Bit;
+
+		FBitElem& Elem = InitializedColumnBitMask[i / BITELEM_SIZE_BITS];
+		checkf((Elem & Mask) == (bValue ? 0 : Mask), TEXT("Attempted to set initialized flags in range [%i, %i) that were already %s"), StartIndex, StartIndex + Num, bValue ? TEXT("set") : TEXT("cleared"));
+		Elem ^= Mask;
+		i += Count;
 	}
 
-	// Allocate new row elements
-	ForEachRow([this](FComponentsRow& Row)->void
+	NumInitializedColumns += bValue ? Num : -Num;
+
+	if (!bValue && Num > 0)
 	{
-		if (UNLIKELY(!Row.Memory))
-		{
-			Row.Memory = (uint8*)FMemory::Malloc(NumColumns * Row.GetSize(), Row.GetAlignment());
-		}
-		else
+		FreeWordHint = FMath::Min<int32>(FreeWordHint, StartIndex / BITELEM_SIZE_BITS);
+	}
+}
+
+inline int32 FArchetype::ReserveColumnRange(const int32 Num)
+{
+	check(Num > 0);
+
+	int32 FirstIndex = 0;
+	if (bPacked)
+	{
+		FirstIndex = NumInitializedColumns;
+	}
+	else
+	{
+		// Find the end of the last initialized column
+		for (int32 i = FMath::DivideAndRoundUp<int32>(NumColumns, BITELEM_SIZE_BITS) - 1; i >= 0; --i)
 		{
-			Row.Memory = (uint8*)FMemory::Realloc(Row.Memory, NumColumns * Row.GetSize(), Row.GetAlignment());
+			if (!InitializedColumnBitMask[i]) continue;
+			FirstIndex = i * BITELEM_SIZE_BITS + 64 - FMath::CountLeadingZeros64((uint64)InitializedColumnBitMask[i]);
+			break;
 		}
-	});
+	}
 
-	return OldNumColumns;
+	if (FirstIndex + Num > NumColumns)
+	{
+		AddUninitialized(FirstIndex + Num - NumColumns);
+	}
+
+	return FirstIndex;
 }
 
 inline int32 FArchetype::AddDefaulted(const int32 Num)
 {
-	const int32 FirstIndex = AddUninitialized(Num);
+	const int32 FirstIndex = ReserveColumnRange(Num);
+	SetColumnRangeInitializedFlag(true, FirstIndex, Num);
 
-	// Set column bit flags to true for initialized
-	for (int32 i = FirstIndex; i < NumColumns; ++i)
+	// Initialize row elements one contiguous chunk range at a time
+	ForEachRow([this, &FirstIndex, &Num](FComponentsRow& Row)
 	{
-		check(!IsColumnInitialized(i));
-		SetColumnInitializedFlag(true, i);
-	}
-
-	// Initialize row elements
-	ForEachRow([&FirstIndex, &Num](FComponentsRow& Row)
-	{
-		Row.ScriptStruct->InitializeStruct(Row[FirstIndex], Num);
+		ForEachColumnRange(FirstIndex, Num, [&Row](const int32 StartColumn, const int32 RangeNum)
+		{
+			Row.InitializeItems(Row[StartColumn], RangeNum);
+		});
 	});
 	
 	return FirstIndex;
 }
 
-inline bool FArchetype::DestructAt(const int32 ColumnIndex)
+inline bool FArchetype::DestructAt(const int32 ColumnIndex, FEntityID* OutMovedEntity)
 {
 	check(IsValidColumn(ColumnIndex));
 	if (!IsColumnInitialized(ColumnIndex)) return false;
 
-	// Set validity flag to false and destroy all corresponding components
-	SetColumnInitializedFlag(false, ColumnIndex);
 	ForEachRow([&ColumnIndex](FComponentsRow& Row)->void
 	{
-		Row.ScriptStruct->DestroyStruct(Row[ColumnIndex]);
+		Row.DestroyItems(Row[ColumnIndex]);
 	});
 
+	return ReleaseAt(ColumnIndex, OutMovedEntity);
+}
+
+inline void FArchetype::DestructRange(const int32 StartIndex, const int32 Num)
+{
+	check(Num >= 0);
+	check(StartIndex >= 0 && StartIndex + Num <= NumColumns);
+
+	ForEachRow([&](FComponentsRow& Row)
+	{
+		if (!Row.HasDestructor()) return;
+
+		ForEachColumnRange(StartIndex, Num, [&Row](const int32 StartColumn, const int32 RangeNum)
+		{
+			Row.DestroyItems(Row[StartColumn], RangeNum);
+		});
+	});
+
+	SetColumnRangeInitializedFlag(false, StartIndex, Num);
+}
+
+inline bool FArchetype::ReleaseAt(const int32 ColumnIndex, FEntityID* OutMovedEntity)
+{
+	check(IsValidColumn(ColumnIndex));
+	if (!IsColumnInitialized(ColumnIndex)) return false;
+
+	SetColumnInitializedFlag(false, ColumnIndex);
+
+	// Swap-remove. Fill the hole with the last initialized column so rows stay contiguous
+	if (bPacked)
+	{
+		const int32 LastColumn = NumInitializedColumns;
+		if (LastColumn != ColumnIndex)
+		{
+			MoveColumn(LastColumn, ColumnIndex);
+			if (OutMovedEntity)
+			{
+				*OutMovedEntity = ColumnEntities[ColumnIndex];
+			}
+		}
+	}
+
 	return true;
 }
 
+template<typename TFunctor>
+inline void FArchetype::SetPacked(const bool bValue, TFunctor&& OnColumnMoved)
+{
+	if (bPacked == bValue) return;
+	bPacked = bValue;
+	if (!bPacked) return;
+
+	Compact(Forward<TFunctor>(OnColumnMoved));
+}
+
+template<typename TFunctor>
+inline void FArchetype::Compact(TFunctor&& OnColumnMoved)
+{
+	int32 Hole = 0, Live = NumColumns - 1;
+	while (true)
+	{
+		while (Hole < NumColumns && IsColumnInitialized(Hole)) ++Hole;
+		while (Live >= 0 && !IsColumnInitialized(Live)) --Live;
+		if (Hole >= Live) break;
+
+		MoveColumn(Live, Hole);
+		OnColumnMoved(ColumnEntities[Hole], Hole);
+	}
+
+	check(NumInitializedColumns == 0 || IsColumnInitialized(NumInitializedColumns - 1));
+}
+
 template<typename T>
 UE_NODISCARD FORCEINLINE typename TEnableIf<TIsDerivedFrom<T, FECSCompBase>::Value, T*>::Type FArchetype::Get(const int32 RowIndex, const int32 ColumnIndex)
 {
@@ -377,34 +811,60 @@ FORCEINLINE const FArchetype::FComponentsRow& FArchetype::operator[](const int32
 	return Rows[Index];
 }
 
-inline int32 FArchetype::GetCompRow(const FCompTypeID CompTypeID) const
+FORCEINLINE int32 FArchetype::GetCompRow(const FCompTypeID CompTypeID) const
 {
-	checkf(IncludedCompTagBitMask[CompTypeID.ToInt() / BITELEM_SIZE_BITS] & 1ull << CompTypeID.ToInt() % BITELEM_SIZE_BITS, TEXT("No components row exists for this ID!"));
-	
-	int32 RowIndex = 0;
-	for (int32 i = CompTypeID.ToInt() - 1; i >= 0; --i)
-		RowIndex += (bool)(IncludedCompTagBitMask[i / BITELEM_SIZE_BITS] & 1ull << i % BITELEM_SIZE_BITS);
-
-	checkf(IsValidRow(RowIndex), TEXT("Calculated invalid row %i"), RowIndex);
+	const int32 RowIndex = FindCompRow(CompTypeID);
+	checkf(IsValidRow(RowIndex), TEXT("No components row exists for this ID!"));
 	return RowIndex;
 }
 
+FORCEINLINE int32 FArchetype::FindCompRow(const FCompTypeID CompTypeID) const
+{
+	check(CompTypeID.ToInt() >= 0);
+	return CompTypeID.ToInt() < CompRowLookupNum ? CompRowLookup[CompTypeID.ToInt()] : INDEX_NONE;
+}
+
 inline int32 FArchetype::FindFirstUninitializedRow(const int32 StartColumn) const
 {
 	check(StartColumn >= 0);
-	
+
+	if (bPacked)
+	{
+		const int32 Column = FMath::Max(StartColumn, NumInitializedColumns);
+		return Column < NumColumns ? Column : INDEX_NONE;
+	}
+
+	// Skip words known to be full
 	const int32 NumBitElems = FMath::DivideAndRoundUp<int32>(NumColumns, BITELEM_SIZE_BITS);
-	for (int32 i = StartColumn; i < NumBitElems; ++i)
+	const int32 StartWord = StartColumn / BITELEM_SIZE_BITS;
+	// The hint can only be advanced if no free column before StartColumn is masked off
+	const bool bFromHint = FreeWordHint > StartWord || (FreeWordHint == StartWord && StartColumn % BITELEM_SIZE_BITS == 0);
+	for (int32 i = FMath::Max(StartWord, FreeWordHint); i < NumBitElems; ++i)
 	{
-		unsigned long Value;
-#if PLATFORM_64BITS
-		if (_BitScanForward64(&Value, InitializedColumnBitMask[i]))
-#else
-		if (_BitScanForward(&Value, InitializedColumnBitMask[i]))
-#endif
+		// Free columns are the set bits of the inverted word
+		uint64 FreeBits = (uint64)(FBitElem)~InitializedColumnBitMask[i];
+		if (i == StartWord)
 		{
-			return Value + 1 + i * BITELEM_SIZE_BITS;
+			FreeBits &= ~0ull << StartColumn % BITELEM_SIZE_BITS;
 		}
+
+		if (!FreeBits) continue;
+
+		// Bits past the last column are never set so they read as free
+		const int32 Column = i * BITELEM_SIZE_BITS + (int32)FMath::CountTrailingZeros64(FreeBits);
+		if (Column >= NumColumns) break;
+
+		if (bFromHint)
+		{
+			FreeWordHint = i;
+		}
+
+		return Column;
+	}
+
+	if (bFromHint)
+	{
+		FreeWordHint = NumBitElems;
 	}
 
 	return INDEX_NONE;
@@ -420,6 +880,36 @@ inline bool FArchetype::HasSameSetIdentifierFlags(const FArchetype& Other, const
 	return true;
 }
 
+inline bool FArchetype::HasAllOf(const TBitArray<>& Signature) const
+{
+	// Bit elements are little endian so the bitmask can be viewed as 32 bit words like TBitArray
+	const uint32* Words = (const uint32*)IncludedCompTagBitMask;
+	const uint32* SignatureWords = Signature.GetData();
+	const int32 NumWords = FMath::DivideAndRoundUp(Signature.Num(), NumBitsPerDWORD);
+	for (int32 i = 0; i < NumWords; ++i)
+		if ((Words[i] & SignatureWords[i]) != SignatureWords[i])
+			return false;
+
+	return true;
+}
+
+inline bool FArchetype::HasAnyOf(const TBitArray<>& Signature) const
+{
+	const uint32* Words = (const uint32*)IncludedCompTagBitMask;
+	const uint32* SignatureWords = Signature.GetData();
+	const int32 NumWords = FMath::DivideAndRoundUp(Signature.Num(), NumBitsPerDWORD);
+	for (int32 i = 0; i < NumWords; ++i)
+		if (Words[i] & SignatureWords[i])
+			return true;
+
+	return false;
+}
+
+inline void FArchetype::GetSignature(TBitArray<>& OutSignature, const int32 NumCompsAndTags) const
+{
+	OutSignature.Init(false, NumCompsAndTags);
+	FMemory::Memcpy(OutSignature.GetData(), IncludedCompTagBitMask, FMath::DivideAndRoundUp(NumCompsAndTags, NumBitsPerDWORD) * sizeof(uint32));
+}
 
 inline void FArchetype::AddStructReferencedObjects(FReferenceCollector& Collector)
 {
@@ -427,21 +917,14 @@ inline void FArchetype::AddStructReferencedObjects(FReferenceCollector& Collecto
 	{
 		Collector.AddReferencedObject(Row.ScriptStruct);
 		if (!ensure(Row.ScriptStruct)) return;
-		
-		const bool bHasNativeAdd = Row.ScriptStruct->StructFlags & STRUCT_AddStructReferencedObjects;
+
+		// Most component types hold no references so the whole row is skipped
+		const FECSStructReferences& References = FECSStructReferences::Get(Row.ScriptStruct);
+		if (!References.HasReferences()) return;
+
 		ForEachInitializedColumn([&](const int32 Index)
 		{
-			uint8* Item = Row[Index];
-			if (bHasNativeAdd)
-			{
-				Row.ScriptStruct->GetCppStructOps()->AddStructReferencedObjects()(Item, Collector);
-			}
-
-			for (TPropertyValueIterator<FObjectProperty> It(Row.ScriptStruct, Item); It; ++It)
-			{
-				UObject*& ReferencedObject = *(UObject**)It.Value();
-				Collector.AddReferencedObject(ReferencedObject);
-			}
+			References.AddReferencedObjects(Row[Index], Collector);
 		});
 	});
 }
@@ -468,6 +951,14 @@ inline void FArchetype::ForEachRow(TFunctor&& Functor) const
 template<typename TFunctor>
 inline void FArchetype::ForEachInitializedColumn(TFunctor&& Functor) const
 {
+	if (bPacked)
+	{
+		for (int32 i = 0; i < NumInitializedColumns; i++)
+			Forward<TFunctor>(Functor)(i);
+
+		return;
+	}
+	
 	for (int32 i = 0; i < NumColumns; i++)
 		if (IsColumnInitialized(i))
 			Forward<TFunctor>(Functor)(i);
@@ -476,18 +967,88 @@ inline void FArchetype::ForEachInitializedColumn(TFunctor&& Functor) const
 template<typename TFunctor>
 void FArchetype::ForEachInitializedColumnWithBreak(const int32 StartIndex, TFunctor&& Functor) const
 {
+	if (bPacked)
+	{
+		for (int32 i = StartIndex; i < NumInitializedColumns; i++)
+			if (!Forward<TFunctor>(Functor)(i))
+				break;
+
+		return;
+	}
+	
 	for (int32 i = StartIndex; i < NumColumns; i++)
 		if (IsColumnInitialized(i))
 			if (!Forward<TFunctor>(Functor)(i))
 				break;
 }
 
+template<typename TFunctor>
+inline void FArchetype::ForEachInitializedColumnInRange(const int32 StartIndex, const int32 Num, TFunctor&& Functor) const
+{
+	check(StartIndex >= 0 && StartIndex + Num <= NumColumns);
 
+	const int32 End = StartIndex + Num;
+	if (bPacked)
+	{
+		for (int32 i = StartIndex; i < FMath::Min(End, NumInitializedColumns); i++)
+			Forward<TFunctor>(Functor)(i);
 
+		return;
+	}
 
+	for (int32 i = StartIndex; i < End; i++)
+		if (IsColumnInitialized(i))
+			Forward<TFunctor>(Functor)(i);
+}
+
+FORCEINLINE int32 FArchetype::GetColumnEnd() const
+{
+	return bPacked ? NumInitializedColumns : NumColumns;
+}
+
+inline int32 FArchetype::CountInitializedColumnsInRange(const int32 StartIndex, const int32 Num) const
+{
+	check(StartIndex >= 0 && StartIndex + Num <= NumColumns);
+	if (Num == 0) return 0;
+
+	if (bPacked)
+		return FMath::Clamp(NumInitializedColumns - StartIndex, 0, Num);
+
+	// Popcount whole words, masking off the bits outside of the range in the first and last words
+	const int32 End = StartIndex + Num;
+	const int32 FirstWord = StartIndex / BITELEM_SIZE_BITS, LastWord = (End - 1) / BITELEM_SIZE_BITS;
+	int32 Count = 0;
+	for (int32 i = FirstWord; i <= LastWord; ++i)
+	{
+		FBitElem Word = InitializedColumnBitMask[i];
+		if (i == FirstWord)
+			Word &= ~(FBitElem)0 << StartIndex % BITELEM_SIZE_BITS;
 
+		if (i == LastWord && End % BITELEM_SIZE_BITS != 0)
+			Word &= ~(~(FBitElem)0 << End % BITELEM_SIZE_BITS);
 
+		Count += FMath::CountBits(Word);
+	}
 
+	return Count;
+}
 
+FORCEINLINE FArchetype::FColumnMask FArchetype::GetColumnMask(const int32 StartIndex) const
+{
+	check(IsValidColumn(StartIndex));
+	return FColumnMask(InitializedColumnBitMask, StartIndex);
+}
 
+template<typename TFunctor>
+inline void FArchetype::ForEachColumnRange(const int32 FirstColumn, const int32 Num, TFunctor&& Functor) const
+{
+	check(FirstColumn >= 0 && Num >= 0 && FirstColumn + Num <= NumColumns);
 
+	const int32 End = FirstColumn + Num;
+	for (int32 Column = FirstColumn; Column < End;)
+	{
+		const int32 RangeEnd = FMath::Min(End, (Column / ChunkCapacity + 1) * ChunkCapacity);
+		Functor(Column, RangeEnd - Column);
+		Column = RangeEnd;
+	}
+}
@@ -1,62 +1,576 @@
 ﻿
 #pragma once
 
+#include "Async/ParallelFor.h"
+#include "Templates/IntegerSequence.h"
 #include "Utilities/Metaprogramming.h"
 #include "ECSSubsystem.h"
 
-template<typename InTReads, typename InTWrites = TWrites<>, typename InTTagTypes = TTagTypes<>>
+// Matches archetypes with every TReads, TWrites and TTagTypes type. InFilterTypes narrow the match further: TWithout and TAnyOf reject whole
+// archetypes when they're matched, TChanged skips unchanged chunks and TOptionalComps passes a const pointer per component that's null if the archetype lacks it.
+// ForEach functors take (const TReads&..., TWrites&..., const TOptionalComps*...). Sparse set stored TReads, TWrites and TTagTypes are joined per entity:
+// ForEach drives iteration from whichever of the smallest sparse set and the matching archetypes holds fewer entities, ParallelForEach always drives from the archetypes
+template<typename InTReads, typename InTWrites = TWrites<>, typename InTTagTypes = TTagTypes<>, typename... InFilterTypes>
 class TCompQuery;
 
-template<typename... InTReads, typename... InTWrites, typename... InTTagTypes>
-class TCompQuery<TReads<InTReads...>, TWrites<InTWrites...>, TTagTypes<InTTagTypes...>>
+template<typename... InTReads, typename... InTWrites, typename... InTTagTypes, typename... InFilterTypes>
+class TCompQuery<TReads<InTReads...>, TWrites<InTWrites...>, TTagTypes<InTTagTypes...>, InFilterTypes...>
 {
 	static_assert(sizeof...(InTReads) != 0 || sizeof...(InTWrites) != 0);
 
 public:
 	using FCompTypes = TCompTypes<InTReads..., InTWrites...>;
 	using FTagTypes = TTagTypes<InTTagTypes...>;
+	using FChanged = typename TFindFilter<TChanged, InFilterTypes...>::Type;
+	using FWithout = typename TFindFilter<TWithout, InFilterTypes...>::Type;
+	using FAnyOf = typename TFindFilter<TAnyOf, InFilterTypes...>::Type;
+	using FOptionalComps = typename TFindFilter<TOptionalComps, InFilterTypes...>::Type;
 	
 	TCompQuery() = delete;
 	explicit TCompQuery(const UECSSubsystem* Subsystem);
 
+	// Default minimum number of columns processed per worker task
+	static constexpr int32 DEFAULT_PARALLEL_BATCH_SIZE = 256;
+
 	template<typename FunctorType>
 	void ForEach(FunctorType&& Functor) const;
 
+	// Iterates matching entities across worker threads. Matching archetypes are split into chunk aligned batches of at least MinBatchSize columns
+	// so archetypes of very different sizes are balanced. The functor must be thread-safe and may not make structural changes
+	template<typename FunctorType>
+	void ParallelForEach(FunctorType&& Functor, const int32 MinBatchSize = DEFAULT_PARALLEL_BATCH_SIZE) const;
+
+	// Iterates matching archetypes one chunk at a time for vectorized kernels. Functor(const int32 Num, const FArchetype::FColumnMask* LiveMask, TArrayView<const TReads>..., TArrayView<TWrites>..., const TOptionalComps*...)
+	// receives contiguous spans of Num components per row. LiveMask is null if every column in the spans is initialized, otherwise uninitialized columns must be skipped.
+	// Optional components are passed as the start of their span, or null. Not available with sparse set stored types
+	template<typename FunctorType>
+	void ForEachChunk(FunctorType&& Functor) const;
+
+	// Every iteration stamps the chunks of TWrites rows with a new change version. TChanged skips chunks not written since the previous iteration of this query
+	FORCEINLINE uint32 GetLastRunVersion() const { return LastRunVersion; }
+
+	// Components read and written by this query. Index via FCompTypeID
+	void GetAccessSignatures(TBitArray<>& OutReads, TBitArray<>& OutWrites) const;
+
+	FORCEINLINE FQueryID GetQueryID() const { return QueryID; }
+
 private:
+	static constexpr int32 NUM_READS = sizeof...(InTReads);
+	static constexpr int32 NUM_COMPS = sizeof...(InTReads) + sizeof...(InTWrites);
+	static constexpr int32 NUM_OPTIONAL = GetTypeListNum(FOptionalComps{});
+	static constexpr bool HAS_SPARSE = HasSparseStorageType(TTypeList<InTReads..., InTWrites..., InTTagTypes...>{});
+
+	static_assert(!TAnd<TIsSparseStorage<InTReads>..., TIsSparseStorage<InTWrites>...>::Value, "TCompQuery: At least one component must be table stored to match archetypes!");
+	static_assert(!HasSparseStorageType(FChanged{}) && !HasSparseStorageType(FWithout{}) && !HasSparseStorageType(FAnyOf{}) && !HasSparseStorageType(FOptionalComps{}),
+		"TCompQuery: Filters only support table stored types!");
+
+	using FChangedRows = TArray<int32, TInlineAllocator<4>>;
+	using FOptionalRows = TArray<const FArchetype::FComponentsRow*, TInlineAllocator<4>>;// Null for components the archetype lacks
+	
 	template<typename T>
-	T& InternalGetComp(const FArchetype& Archetype, const int32 ColumnIndex) const;
+	using TRowRef = const FArchetype::FComponentsRow&;
+
+	struct FBatch
+	{
+		int32 MatchIndex;
+		int32 StartColumn;
+		int32 NumColumns;
+	};
+
+	template<typename FunctorType, int32... CompIndices>
+	void InternalForEach(FunctorType& Functor, TIntegerSequence<int32, CompIndices...>) const;
+
+	template<typename FunctorType, int32... CompIndices>
+	void InternalParallelForEach(FunctorType& Functor, const int32 MinBatchSize, TIntegerSequence<int32, CompIndices...>) const;
+
+	template<typename FunctorType, int32... CompIndices>
+	void InternalForEachChunk(FunctorType& Functor, TIntegerSequence<int32, CompIndices...>) const;
+
+	// Runs the functor over one range of columns within a chunk, if the chunk isn't empty or filtered out by TChanged
+	template<typename FunctorType, int32... CompIndices>
+	void InternalForEachInChunk(const FArchetype& Archetype, const int32* RowIndices, const FChangedRows& ChangedRows, const FOptionalRows& OptionalRows, const int32 StartColumn, const int32 NumColumns,
+		const uint32 RunVersion, FunctorType& Functor, TIntegerSequence<int32, CompIndices...>) const;
+
+	template<typename... Ts>
+	static void InternalGetCompTypeIDs(const UECSSubsystem* Subsystem, TTypeList<Ts...>&&, TArray<FCompTypeID, TInlineAllocator<4>>& OutIDs);
+
+	template<typename T>
+	static const FECSSparseSet* InternalGetSparseSet(const UECSSubsystem* Subsystem);
+
+	template<typename... Ts>
+	static void InternalSetSignatureBits(const UECSSubsystem* Subsystem, TTypeList<Ts...>&&, TBitArray<>& OutSignature);
+
+	void InternalGetChangedRows(const FArchetype& Archetype, FChangedRows& OutRows) const;
+	void InternalGetOptionalRows(const FArchetype& Archetype, const int32* RowIndices, FOptionalRows& OutRows) const;
+
+	// Applies TChanged and stamps the written rows. Returns false if the chunk is filtered out
+	bool InternalPrepareChunk(const FArchetype& Archetype, const int32* RowIndices, const FChangedRows& ChangedRows, const int32 ChunkIndex, const uint32 RunVersion) const;
+
+	const FECSSparseSet* InternalGetSmallestSparseSet() const;
+
+	// Resolves the entity's components into OutComps, ordered TReads, TWrites then TOptionalComps. Returns false if the entity is missing from a sparse set
+	bool InternalResolveEntity(const FArchetype& Archetype, const int32* RowIndices, const FOptionalRows& OptionalRows, const int32 ColumnIndex, const int32 EntityIndex, void** OutComps) const;
+
+	template<typename FunctorType>
+	void InternalForEachSparse(const FECSSparseSet& DrivingSet, FunctorType& Functor, const uint32 RunVersion) const;
+
+	template<typename FunctorType>
+	void InternalForEachJoinedColumn(const FArchetype& Archetype, const int32* RowIndices, const FOptionalRows& OptionalRows, const int32 StartColumn, const int32 NumColumns, FunctorType& Functor) const;
+
+	template<typename FunctorType, int32... ReadIndices, int32... WriteIndices, typename... OptionalTypes, int32... OptionalIndices>
+	static void InternalInvokeJoined(FunctorType& Functor, void* const* Comps, TIntegerSequence<int32, ReadIndices...>, TIntegerSequence<int32, WriteIndices...>, TOptionalComps<OptionalTypes...>*, TIntegerSequence<int32, OptionalIndices...>);
+
+	template<typename FunctorType, typename... OptionalTypes, int32... OptionalIndices>
+	void InternalForEachColumn(const FArchetype& Archetype, const int32 StartColumn, const int32 NumColumns, FunctorType&& Functor, const FOptionalRows& OptionalRows, TOptionalComps<OptionalTypes...>*, TIntegerSequence<int32, OptionalIndices...>,
+		TRowRef<InTReads>... ReadRows, TRowRef<InTWrites>... WriteRows) const;
+
+	template<typename FunctorType, typename... OptionalTypes, int32... OptionalIndices>
+	void InternalInvokeChunk(const int32 StartColumn, const int32 NumColumns, const FArchetype::FColumnMask* LiveMask, FunctorType&& Functor, const FOptionalRows& OptionalRows, TOptionalComps<OptionalTypes...>*, TIntegerSequence<int32, OptionalIndices...>,
+		TRowRef<InTReads>... ReadRows, TRowRef<InTWrites>... WriteRows) const;
 	
 	UECSSubsystem const* const Subsystem;
+
+	// Cached on the subsystem so matching archetypes aren't searched for every iteration
+	FQueryID QueryID;
+	int32 CompSlots[NUM_COMPS + NUM_OPTIONAL];// Position of each of TReads, TWrites then TOptionalComps within the query's rows, which are ordered by FCompTypeID. INDEX_NONE if sparse set stored
+
+	const FECSSparseSet* SparseCompSets[NUM_COMPS];// Null for table stored components
+	TArray<const FECSSparseSet*, TInlineAllocator<2>> SparseTagSets;
+
+	TArray<FCompTypeID, TInlineAllocator<4>> ChangedCompIDs;
+	TArray<FCompTypeID, TInlineAllocator<4>> OptionalCompIDs;
+	mutable uint32 LastRunVersion;// Change version of the previous iteration
 };
 
-template<typename... InTReads, typename... InTWrites, typename... InTTagTypes>
-FORCEINLINE TCompQuery<TReads<InTReads...>, TWrites<InTWrites...>, TTagTypes<InTTagTypes...>>::TCompQuery(const UECSSubsystem* Subsystem)
-	: Subsystem(Subsystem)
+template<typename... InTReads, typename... InTWrites, typename... InTTagTypes, typename... InFilterTypes>
+inline TCompQuery<TReads<InTReads...>, TWrites<InTWrites...>, TTagTypes<InTTagTypes...>, InFilterTypes...>::TCompQuery(const UECSSubsystem* Subsystem)
+	: Subsystem(Subsystem), LastRunVersion(0)
 {
 	check(Subsystem);
+
+	const FCompTypeID CompTypeIDs[] = { Subsystem->GetCompTypeID<InTReads>()..., Subsystem->GetCompTypeID<InTWrites>()... };
+	InternalGetCompTypeIDs(Subsystem, FChanged{}, ChangedCompIDs);
+	InternalGetCompTypeIDs(Subsystem, FOptionalComps{}, OptionalCompIDs);
+	
+	const int32 NumCompsAndTags = Subsystem->GetNumComps() + Subsystem->GetNumTags();
+	// Sparse set stored types are joined when iterating rather than matched by signature
+	const FECSSparseSet* const CompSets[] = { InternalGetSparseSet<InTReads>(Subsystem)..., InternalGetSparseSet<InTWrites>(Subsystem)... };
+
+	TBitArray<> Signature(false, NumCompsAndTags);
+	for (int32 i = 0; i < NUM_COMPS; ++i)
+	{
+		SparseCompSets[i] = CompSets[i];
+		if (!CompSets[i])
+		{
+			Signature[CompTypeIDs[i].ToInt()] = true;
+		}
+	}
+
+	// Changed components must exist for their chunks to have been written
+	for (const FCompTypeID& ID : ChangedCompIDs)
+		Signature[ID.ToInt()] = true;
+
+	if constexpr (sizeof...(InTTagTypes) != 0)
+	{
+		const FECSSparseSet* const TagSets[] = { InternalGetSparseSet<InTTagTypes>(Subsystem)... };
+		const FTagTypeID TagIDs[] = { Subsystem->GetTagTypeID<InTTagTypes>()... };
+		for (int32 i = 0; i < UE_ARRAY_COUNT(TagIDs); ++i)
+		{
+			if (TagSets[i])
+			{
+				SparseTagSets.Add(TagSets[i]);
+			}
+			else
+			{
+				Signature[TagIDs[i].ToInt() + Subsystem->GetNumComps()] = true;
+			}
+		}
+	}
+
+	TBitArray<> ExcludedSignature(false, NumCompsAndTags), AnyOfSignature(false, NumCompsAndTags), OptionalSignature(false, NumCompsAndTags);
+	InternalSetSignatureBits(Subsystem, FWithout{}, ExcludedSignature);
+	InternalSetSignatureBits(Subsystem, FAnyOf{}, AnyOfSignature);
+	for (const FCompTypeID& ID : OptionalCompIDs)
+		OptionalSignature[ID.ToInt()] = true;
+
+	QueryID = Subsystem->FindOrAddQuery(Signature, ExcludedSignature, AnyOfSignature, OptionalSignature);
+
+	// Rows also include changed and optional components so count every row ordered before each component
+	const TBitArray<>& RowSignature = Subsystem->GetQueryDescription(QueryID).RowSignature;
+	for (int32 i = 0; i < NUM_COMPS + NUM_OPTIONAL; ++i)
+	{
+		if (i < NUM_COMPS && SparseCompSets[i])
+		{
+			CompSlots[i] = INDEX_NONE;
+			continue;
+		}
+
+		const int32 CompIndex = i < NUM_COMPS ? CompTypeIDs[i].ToInt() : OptionalCompIDs[i - NUM_COMPS].ToInt();
+
+		CompSlots[i] = 0;
+		for (TConstSetBitIterator<> It(RowSignature); It && It.GetIndex() < CompIndex; ++It)
+			++CompSlots[i];
+	}
 }
 
-template<typename... InTReads, typename... InTWrites, typename... InTTagTypes> template<typename FunctorType>
-inline void TCompQuery<TReads<InTReads...>, TWrites<InTWrites...>, TTagTypes<InTTagTypes...>>::ForEach(FunctorType&& Functor) const
+template<typename... InTReads, typename... InTWrites, typename... InTTagTypes, typename... InFilterTypes>
+inline void TCompQuery<TReads<InTReads...>, TWrites<InTWrites...>, TTagTypes<InTTagTypes...>, InFilterTypes...>::GetAccessSignatures(TBitArray<>& OutReads, TBitArray<>& OutWrites) const
 {
-	const FArchetypeID ID = Subsystem->GetArchetypeID<FCompTypes, FTagTypes>();
-	const FArchetype& Archetype = Subsystem->GetArchetype(ID);
-	
-	for (const FArchetype& QueryArchetype : Subsystem->GetArchetypes())
+	OutReads.Init(false, Subsystem->GetNumComps());
+	OutWrites.Init(false, Subsystem->GetNumComps());
+
+	if constexpr (sizeof...(InTReads) != 0)
+		for (const FCompTypeID& ID : { Subsystem->GetCompTypeID<InTReads>()... })
+			OutReads[ID.ToInt()] = true;
+
+	if constexpr (sizeof...(InTWrites) != 0)
+		for (const FCompTypeID& ID : { Subsystem->GetCompTypeID<InTWrites>()... })
+			OutWrites[ID.ToInt()] = true;
+
+	// Reading change versions races with systems writing the component
+	for (const FCompTypeID& ID : ChangedCompIDs)
+		OutReads[ID.ToInt()] = true;
+
+	for (const FCompTypeID& ID : OptionalCompIDs)
+		OutReads[ID.ToInt()] = true;
+}
+
+template<typename... InTReads, typename... InTWrites, typename... InTTagTypes, typename... InFilterTypes> template<typename T>
+FORCEINLINE const FECSSparseSet* TCompQuery<TReads<InTReads...>, TWrites<InTWrites...>, TTagTypes<InTTagTypes...>, InFilterTypes...>::InternalGetSparseSet(const UECSSubsystem* Subsystem)
+{
+	if constexpr (TIsSparseStorage<T>::Value)
+	{
+		return &Subsystem->GetSparseSet<T>();
+	}
+	else
+	{
+		return nullptr;
+	}
+}
+
+template<typename... InTReads, typename... InTWrites, typename... InTTagTypes, typename... InFilterTypes> template<typename... Ts>
+FORCEINLINE void TCompQuery<TReads<InTReads...>, TWrites<InTWrites...>, TTagTypes<InTTagTypes...>, InFilterTypes...>::InternalSetSignatureBits(const UECSSubsystem* Subsystem, TTypeList<Ts...>&&, TBitArray<>& OutSignature)
+{
+	if constexpr (sizeof...(Ts) != 0)
+		for (const int32 SignatureIndex : { Subsystem->GetSignatureIndex<Ts>()... })
+			OutSignature[SignatureIndex] = true;
+}
+
+template<typename... InTReads, typename... InTWrites, typename... InTTagTypes, typename... InFilterTypes> template<typename... Ts>
+FORCEINLINE void TCompQuery<TReads<InTReads...>, TWrites<InTWrites...>, TTagTypes<InTTagTypes...>, InFilterTypes...>::InternalGetCompTypeIDs(const UECSSubsystem* Subsystem, TTypeList<Ts...>&&, TArray<FCompTypeID, TInlineAllocator<4>>& OutIDs)
+{
+	if constexpr (sizeof...(Ts) != 0)
+		OutIDs = { Subsystem->GetCompTypeID<Ts>()... };
+}
+
+template<typename... InTReads, typename... InTWrites, typename... InTTagTypes, typename... InFilterTypes>
+FORCEINLINE void TCompQuery<TReads<InTReads...>, TWrites<InTWrites...>, TTagTypes<InTTagTypes...>, InFilterTypes...>::InternalGetChangedRows(const FArchetype& Archetype, FChangedRows& OutRows) const
+{
+	OutRows.Reset();
+	for (const FCompTypeID& ID : ChangedCompIDs)
+		OutRows.Add(Archetype.GetCompRow(ID));
+}
+
+template<typename... InTReads, typename... InTWrites, typename... InTTagTypes, typename... InFilterTypes>
+FORCEINLINE void TCompQuery<TReads<InTReads...>, TWrites<InTWrites...>, TTagTypes<InTTagTypes...>, InFilterTypes...>::InternalGetOptionalRows(const FArchetype& Archetype, const int32* RowIndices, FOptionalRows& OutRows) const
+{
+	OutRows.Reset();
+	for (int32 i = NUM_COMPS; i < NUM_COMPS + NUM_OPTIONAL; ++i)
+	{
+		const int32 RowIndex = RowIndices[CompSlots[i]];
+		OutRows.Add(RowIndex != INDEX_NONE ? &Archetype[RowIndex] : nullptr);
+	}
+}
+
+template<typename... InTReads, typename... InTWrites, typename... InTTagTypes, typename... InFilterTypes>
+inline bool TCompQuery<TReads<InTReads...>, TWrites<InTWrites...>, TTagTypes<InTTagTypes...>, InFilterTypes...>::InternalPrepareChunk(const FArchetype& Archetype, const int32* RowIndices, const FChangedRows& ChangedRows, const int32 ChunkIndex, const uint32 RunVersion) const
+{
+	if (ChangedRows.Num() > 0)
+	{
+		bool bChanged = false;
+		for (const int32 RowIndex : ChangedRows)
+			bChanged |= Archetype.HasRowChangedSince(RowIndex, ChunkIndex, LastRunVersion);
+
+		if (!bChanged) return false;
+	}
+
+	for (int32 i = NUM_READS; i < NUM_COMPS; ++i)
+		Archetype.MarkRowChanged(RowIndices[CompSlots[i]], ChunkIndex, RunVersion);
+
+	return true;
+}
+
+template<typename... InTReads, typename... InTWrites, typename... InTTagTypes, typename... InFilterTypes> template<typename FunctorType>
+FORCEINLINE void TCompQuery<TReads<InTReads...>, TWrites<InTWrites...>, TTagTypes<InTTagTypes...>, InFilterTypes...>::ForEach(FunctorType&& Functor) const
+{
+	InternalForEach(Functor, TMakeIntegerSequence<int32, NUM_COMPS>{});
+}
+
+template<typename... InTReads, typename... InTWrites, typename... InTTagTypes, typename... InFilterTypes> template<typename FunctorType, int32... CompIndices>
+inline void TCompQuery<TReads<InTReads...>, TWrites<InTWrites...>, TTagTypes<InTTagTypes...>, InFilterTypes...>::InternalForEach(FunctorType& Functor, TIntegerSequence<int32, CompIndices...>) const
+{
+	const uint32 RunVersion = Subsystem->AdvanceChangeVersion();
+
+	if constexpr (HAS_SPARSE)
+	{
+		// Drive from the sparse side if it has fewer entities than the matching archetypes
+		const FECSSparseSet* SmallestSet = InternalGetSmallestSparseSet();
+
+		int32 NumTableEntities = 0;
+		for (const FArchetypeID& ArchetypeID : Subsystem->GetQueryDescription(QueryID).MatchingArchetypes)
+			NumTableEntities += Subsystem->GetArchetype(ArchetypeID).GetNumInitializedColumns();
+
+		if (SmallestSet->Num() < NumTableEntities)
+		{
+			InternalForEachSparse(*SmallestSet, Functor, RunVersion);
+			LastRunVersion = RunVersion;
+			return;
+		}
+	}
+
+	FChangedRows ChangedRows;
+	FOptionalRows OptionalRows;
+
+	// Re-fetch the query every iteration as the functor may register new queries
+	for (int32 MatchIndex = 0; MatchIndex < Subsystem->GetQueryDescription(QueryID).MatchingArchetypes.Num(); ++MatchIndex)
 	{
-		if (!Archetype.HasSameSetIdentifierFlags(QueryArchetype, Subsystem->GetNumComps() + Subsystem->GetNumTags())) continue;
-		QueryArchetype.ForEachInitializedColumn([this, &QueryArchetype, &Functor](const int32 ColumnIndex)
+		const FQueryDescription& Query = Subsystem->GetQueryDescription(QueryID);
+		const FArchetype& Archetype = Subsystem->GetArchetype(Query.MatchingArchetypes[MatchIndex]);
+		if (Archetype.GetNumInitializedColumns() == 0) continue;
+
+		// Rows were resolved when the archetype was matched
+		const int32* RowIndices = Query.GetRowIndices(MatchIndex);
+		InternalGetChangedRows(Archetype, ChangedRows);
+		InternalGetOptionalRows(Archetype, RowIndices, OptionalRows);
+		Archetype.ForEachColumnRange(0, Archetype.GetColumnEnd(), [&](const int32 StartColumn, const int32 NumColumns)
 		{
-			Forward<FunctorType>(Functor)(InternalGetComp<std::add_const_t<InTReads>>(QueryArchetype, ColumnIndex)..., InternalGetComp<InTWrites>(QueryArchetype, ColumnIndex)...);
+			InternalForEachInChunk(Archetype, RowIndices, ChangedRows, OptionalRows, StartColumn, NumColumns, RunVersion, Functor, TIntegerSequence<int32, CompIndices...>{});
 		});
 	}
+
+	LastRunVersion = RunVersion;
+}
+
+template<typename... InTReads, typename... InTWrites, typename... InTTagTypes, typename... InFilterTypes> template<typename FunctorType, int32... CompIndices>
+FORCEINLINE void TCompQuery<TReads<InTReads...>, TWrites<InTWrites...>, TTagTypes<InTTagTypes...>, InFilterTypes...>::InternalForEachInChunk(const FArchetype& Archetype, const int32* RowIndices, const FChangedRows& ChangedRows, const FOptionalRows& OptionalRows,
+	const int32 StartColumn, const int32 NumColumns, const uint32 RunVersion, FunctorType& Functor, TIntegerSequence<int32, CompIndices...>) const
+{
+	// Unpacked archetypes may have empty chunks. Stamping their write versions would make TChanged report them
+	if (Archetype.CountInitializedColumnsInRange(StartColumn, NumColumns) == 0) return;
+	if (!InternalPrepareChunk(Archetype, RowIndices, ChangedRows, StartColumn / Archetype.GetChunkCapacity(), RunVersion)) return;
+
+	if constexpr (HAS_SPARSE)
+	{
+		InternalForEachJoinedColumn(Archetype, RowIndices, OptionalRows, StartColumn, NumColumns, Functor);
+	}
+	else
+	{
+		InternalForEachColumn(Archetype, StartColumn, NumColumns, Functor, OptionalRows, (FOptionalComps*)nullptr, TMakeIntegerSequence<int32, NUM_OPTIONAL>{}, Archetype[RowIndices[CompSlots[CompIndices]]]...);
+	}
+}
+
+template<typename... InTReads, typename... InTWrites, typename... InTTagTypes, typename... InFilterTypes> template<typename FunctorType>
+FORCEINLINE void TCompQuery<TReads<InTReads...>, TWrites<InTWrites...>, TTagTypes<InTTagTypes...>, InFilterTypes...>::ParallelForEach(FunctorType&& Functor, const int32 MinBatchSize) const
+{
+	check(MinBatchSize > 0);
+	InternalParallelForEach(Functor, MinBatchSize, TMakeIntegerSequence<int32, NUM_COMPS>{});
+}
+
+template<typename... InTReads, typename... InTWrites, typename... InTTagTypes, typename... InFilterTypes> template<typename FunctorType, int32... CompIndices>
+inline void TCompQuery<TReads<InTReads...>, TWrites<InTWrites...>, TTagTypes<InTTagTypes...>, InFilterTypes...>::InternalParallelForEach(FunctorType& Functor, const int32 MinBatchSize, TIntegerSequence<int32, CompIndices...>) const
+{
+	const FQueryDescription& Query = Subsystem->GetQueryDescription(QueryID);
+	const uint32 RunVersion = Subsystem->AdvanceChangeVersion();
+
+	// Split every matching archetype into batches of whole chunks so workers never share a chunk
+	TArray<FBatch, TInlineAllocator<64>> Batches;
+	for (int32 MatchIndex = 0; MatchIndex < Query.MatchingArchetypes.Num(); ++MatchIndex)
+	{
+		const FArchetype& Archetype = Subsystem->GetArchetype(Query.MatchingArchetypes[MatchIndex]);
+		if (Archetype.GetNumInitializedColumns() == 0) continue;
+
+		const int32 ColumnEnd = Archetype.GetColumnEnd();
+		const int32 BatchSize = FMath::DivideAndRoundUp(MinBatchSize, Archetype.GetChunkCapacity()) * Archetype.GetChunkCapacity();
+		for (int32 StartColumn = 0; StartColumn < ColumnEnd; StartColumn += BatchSize)
+		{
+			Batches.Add(FBatch{ MatchIndex, StartColumn, FMath::Min(BatchSize, ColumnEnd - StartColumn) });
+		}
+	}
+
+	ParallelFor(Batches.Num(), [&](const int32 BatchIndex)
+	{
+		const FBatch& Batch = Batches[BatchIndex];
+		const FArchetype& Archetype = Subsystem->GetArchetype(Query.MatchingArchetypes[Batch.MatchIndex]);
+		const int32* RowIndices = Query.GetRowIndices(Batch.MatchIndex);
+
+		FChangedRows ChangedRows;
+		FOptionalRows OptionalRows;
+		InternalGetChangedRows(Archetype, ChangedRows);
+		InternalGetOptionalRows(Archetype, RowIndices, OptionalRows);
+
+		// Batches are chunk aligned so no two workers stamp the same chunk
+		Archetype.ForEachColumnRange(Batch.StartColumn, Batch.NumColumns, [&](const int32 StartColumn, const int32 NumColumns)
+		{
+			InternalForEachInChunk(Archetype, RowIndices, ChangedRows, OptionalRows, StartColumn, NumColumns, RunVersion, Functor, TIntegerSequence<int32, CompIndices...>{});
+		});
+	});
+
+	LastRunVersion = RunVersion;
 }
 
-template<typename... InTReads, typename... InTWrites, typename... InTTagTypes> template<typename T>
-FORCEINLINE T& TCompQuery<TReads<InTReads...>, TWrites<InTWrites...>, TTagTypes<InTTagTypes...>>::InternalGetComp(const FArchetype& Archetype, const int32 ColumnIndex) const
+template<typename... InTReads, typename... InTWrites, typename... InTTagTypes, typename... InFilterTypes> template<typename FunctorType>
+FORCEINLINE void TCompQuery<TReads<InTReads...>, TWrites<InTWrites...>, TTagTypes<InTTagTypes...>, InFilterTypes...>::ForEachChunk(FunctorType&& Functor) const
 {
-	const int32 RowIndex = Archetype.GetCompRow(Subsystem->GetCompTypeID<std::remove_const_t<T>>());
-	return *(T*)Archetype[RowIndex][ColumnIndex];
+	static_assert(!HAS_SPARSE, "ForEachChunk: Sparse set stored types have no contiguous spans, use ForEach instead!");
+	InternalForEachChunk(Functor, TMakeIntegerSequence<int32, NUM_COMPS>{});
+}
+
+template<typename... InTReads, typename... InTWrites, typename... InTTagTypes, typename... InFilterTypes> template<typename FunctorType, int32... CompIndices>
+inline void TCompQuery<TReads<InTReads...>, TWrites<InTWrites...>, TTagTypes<InTTagTypes...>, InFilterTypes...>::InternalForEachChunk(FunctorType& Functor, TIntegerSequence<int32, CompIndices...>) const
+{
+	const uint32 RunVersion = Subsystem->AdvanceChangeVersion();
+	FChangedRows ChangedRows;
+	FOptionalRows OptionalRows;
+
+	for (int32 MatchIndex = 0; MatchIndex < Subsystem->GetQueryDescription(QueryID).MatchingArchetypes.Num(); ++MatchIndex)
+	{
+		const FQueryDescription& Query = Subsystem->GetQueryDescription(QueryID);
+		const FArchetype& Archetype = Subsystem->GetArchetype(Query.MatchingArchetypes[MatchIndex]);
+		if (Archetype.GetNumInitializedColumns() == 0) continue;
+
+		const int32* RowIndices = Query.GetRowIndices(MatchIndex);
+		InternalGetChangedRows(Archetype, ChangedRows);
+		InternalGetOptionalRows(Archetype, RowIndices, OptionalRows);
+		const int32 ColumnEnd = Archetype.GetColumnEnd();
+		for (int32 StartColumn = 0; StartColumn < ColumnEnd; StartColumn += Archetype.GetChunkCapacity())
+		{
+			const int32 NumColumns = FMath::Min(Archetype.GetChunkCapacity(), ColumnEnd - StartColumn);
+
+			// Skip empty chunks and only hand out a mask if the chunk has holes
+			const int32 NumInitialized = Archetype.CountInitializedColumnsInRange(StartColumn, NumColumns);
+			if (NumInitialized == 0) continue;
+			if (!InternalPrepareChunk(Archetype, RowIndices, ChangedRows, StartColumn / Archetype.GetChunkCapacity(), RunVersion)) continue;
+
+			const FArchetype::FColumnMask Mask = Archetype.GetColumnMask(StartColumn);
+			InternalInvokeChunk(StartColumn, NumColumns, NumInitialized == NumColumns ? nullptr : &Mask, Functor, OptionalRows, (FOptionalComps*)nullptr, TMakeIntegerSequence<int32, NUM_OPTIONAL>{}, Archetype[RowIndices[CompSlots[CompIndices]]]...);
+		}
+	}
+
+	LastRunVersion = RunVersion;
+}
+
+template<typename... InTReads, typename... InTWrites, typename... InTTagTypes, typename... InFilterTypes>
+inline const FECSSparseSet* TCompQuery<TReads<InTReads...>, TWrites<InTWrites...>, TTagTypes<InTTagTypes...>, InFilterTypes...>::InternalGetSmallestSparseSet() const
+{
+	const FECSSparseSet* SmallestSet = nullptr;
+	for (const FECSSparseSet* SparseSet : SparseCompSets)
+		if (SparseSet && (!SmallestSet || SparseSet->Num() < SmallestSet->Num()))
+			SmallestSet = SparseSet;
+
+	for (const FECSSparseSet* SparseSet : SparseTagSets)
+		if (!SmallestSet || SparseSet->Num() < SmallestSet->Num())
+			SmallestSet = SparseSet;
+
+	check(SmallestSet);
+	return SmallestSet;
+}
+
+template<typename... InTReads, typename... InTWrites, typename... InTTagTypes, typename... InFilterTypes>
+FORCEINLINE bool TCompQuery<TReads<InTReads...>, TWrites<InTWrites...>, TTagTypes<InTTagTypes...>, InFilterTypes...>::InternalResolveEntity(const FArchetype& Archetype, const int32* RowIndices, const FOptionalRows& OptionalRows, const int32 ColumnIndex, const int32 EntityIndex, void** OutComps) const
+{
+	for (const FECSSparseSet* SparseSet : SparseTagSets)
+		if (!SparseSet->Contains(EntityIndex))
+			return false;
+
+	for (int32 i = 0; i < NUM_COMPS; ++i)
+	{
+		if (SparseCompSets[i])
+		{
+			OutComps[i] = SparseCompSets[i]->Find(EntityIndex);
+			if (!OutComps[i]) return false;
+		}
+		else
+		{
+			OutComps[i] = (void*)Archetype[RowIndices[CompSlots[i]]][ColumnIndex];
+		}
+	}
+
+	for (int32 i = 0; i < NUM_OPTIONAL; ++i)
+		OutComps[NUM_COMPS + i] = OptionalRows[i] ? (void*)(*OptionalRows[i])[ColumnIndex] : nullptr;
+
+	return true;
+}
+
+template<typename... InTReads, typename... InTWrites, typename... InTTagTypes, typename... InFilterTypes> template<typename FunctorType>
+inline void TCompQuery<TReads<InTReads...>, TWrites<InTWrites...>, TTagTypes<InTTagTypes...>, InFilterTypes...>::InternalForEachSparse(const FECSSparseSet& DrivingSet, FunctorType& Functor, const uint32 RunVersion) const
+{
+	void* Comps[NUM_COMPS + NUM_OPTIONAL];
+	FChangedRows ChangedRows;
+	FOptionalRows OptionalRows;
+	FArchetypeID CachedArchetypeID;
+
+	for (int32 DenseIndex = 0; DenseIndex < DrivingSet.Num(); ++DenseIndex)
+	{
+		const FEntityID EntityID = DrivingSet.GetEntity(DenseIndex);
+		const FArchetypeEntityRecord& Record = Subsystem->GetEntityRecord(EntityID);
+
+		// Re-fetch the query every iteration as the functor may register new queries
+		const FQueryDescription& Query = Subsystem->GetQueryDescription(QueryID);
+		const int32 MatchIndex = Query.FindMatchIndex(Record.ArchetypeID);
+		if (MatchIndex == INDEX_NONE) continue;
+
+		const FArchetype& Archetype = Subsystem->GetArchetype(Record.ArchetypeID);
+		const int32* RowIndices = Query.GetRowIndices(MatchIndex);
+		if (Record.ArchetypeID != CachedArchetypeID)
+		{
+			CachedArchetypeID = Record.ArchetypeID;
+			InternalGetChangedRows(Archetype, ChangedRows);
+			InternalGetOptionalRows(Archetype, RowIndices, OptionalRows);
+		}
+
+		if (InternalResolveEntity(Archetype, RowIndices, OptionalRows, Record.ColumnIndex, EntityID.GetIndex(), Comps)
+			&& InternalPrepareChunk(Archetype, RowIndices, ChangedRows, Record.ColumnIndex / Archetype.GetChunkCapacity(), RunVersion))
+		{
+			InternalInvokeJoined(Functor, Comps, TMakeIntegerSequence<int32, NUM_READS>{}, TMakeIntegerSequence<int32, NUM_COMPS - NUM_READS>{}, (FOptionalComps*)nullptr, TMakeIntegerSequence<int32, NUM_OPTIONAL>{});
+		}
+	}
+}
+
+template<typename... InTReads, typename... InTWrites, typename... InTTagTypes, typename... InFilterTypes> template<typename FunctorType>
+FORCEINLINE void TCompQuery<TReads<InTReads...>, TWrites<InTWrites...>, TTagTypes<InTTagTypes...>, InFilterTypes...>::InternalForEachJoinedColumn(const FArchetype& Archetype, const int32* RowIndices, const FOptionalRows& OptionalRows, const int32 StartColumn, const int32 NumColumns, FunctorType& Functor) const
+{
+	void* Comps[NUM_COMPS + NUM_OPTIONAL];
+	Archetype.ForEachInitializedColumnInRange(StartColumn, NumColumns, [&](const int32 ColumnIndex)
+	{
+		if (InternalResolveEntity(Archetype, RowIndices, OptionalRows, ColumnIndex, Archetype.GetColumnEntity(ColumnIndex).GetIndex(), Comps))
+		{
+			InternalInvokeJoined(Functor, Comps, TMakeIntegerSequence<int32, NUM_READS>{}, TMakeIntegerSequence<int32, NUM_COMPS - NUM_READS>{}, (FOptionalComps*)nullptr, TMakeIntegerSequence<int32, NUM_OPTIONAL>{});
+		}
+	});
+}
+
+template<typename... InTReads, typename... InTWrites, typename... InTTagTypes, typename... InFilterTypes> template<typename FunctorType, int32... ReadIndices, int32... WriteIndices, typename... OptionalTypes, int32... OptionalIndices>
+FORCEINLINE void TCompQuery<TReads<InTReads...>, TWrites<InTWrites...>, TTagTypes<InTTagTypes...>, InFilterTypes...>::InternalInvokeJoined(FunctorType& Functor, void* const* Comps, TIntegerSequence<int32, ReadIndices...>, TIntegerSequence<int32, WriteIndices...>, TOptionalComps<OptionalTypes...>*, TIntegerSequence<int32, OptionalIndices...>)
+{
+	Functor(*(const InTReads*)Comps[ReadIndices]..., *(InTWrites*)Comps[NUM_READS + WriteIndices]..., (const OptionalTypes*)Comps[NUM_COMPS + OptionalIndices]...);
+}
+
+template<typename... InTReads, typename... InTWrites, typename... InTTagTypes, typename... InFilterTypes> template<typename FunctorType, typename... OptionalTypes, int32... OptionalIndices>
+FORCEINLINE void TCompQuery<TReads<InTReads...>, TWrites<InTWrites...>, TTagTypes<InTTagTypes...>, InFilterTypes...>::InternalInvokeChunk(const int32 StartColumn, const int32 NumColumns, const FArchetype::FColumnMask* LiveMask, FunctorType&& Functor, const FOptionalRows& OptionalRows, TOptionalComps<OptionalTypes...>*, TIntegerSequence<int32, OptionalIndices...>,
+	TRowRef<InTReads>... ReadRows, TRowRef<InTWrites>... WriteRows) const
+{
+	Functor(NumColumns, LiveMask, TArrayView<const InTReads>((const InTReads*)ReadRows[StartColumn], NumColumns)..., TArrayView<InTWrites>((InTWrites*)WriteRows[StartColumn], NumColumns)...,
+		(OptionalRows[OptionalIndices] ? (const OptionalTypes*)(*OptionalRows[OptionalIndices])[StartColumn] : nullptr)...);
+}
+
+template<typename... InTReads, typename... InTWrites, typename... InTTagTypes, typename... InFilterTypes> template<typename FunctorType, typename... OptionalTypes, int32... OptionalIndices>
+FORCEINLINE void TCompQuery<TReads<InTReads...>, TWrites<InTWrites...>, TTagTypes<InTTagTypes...>, InFilterTypes...>::InternalForEachColumn(const FArchetype& Archetype, const int32 StartColumn, const int32 NumColumns, FunctorType&& Functor, const FOptionalRows& OptionalRows, TOptionalComps<OptionalTypes...>*, TIntegerSequence<int32, OptionalIndices...>,
+	TRowRef<InTReads>... ReadRows, TRowRef<InTWrites>... WriteRows) const
+{
+	Archetype.ForEachInitializedColumnInRange(StartColumn, NumColumns, [&](const int32 ColumnIndex)
+	{
+		Functor(*(const InTReads*)ReadRows[ColumnIndex]..., *(InTWrites*)WriteRows[ColumnIndex]..., (OptionalRows[OptionalIndices] ? (const OptionalTypes*)(*OptionalRows[OptionalIndices])[ColumnIndex] : nullptr)...);
+	});
 }
 
 
@@ -14,4 +14,24 @@ USTRUCT()
 struct ECSUTILS_API FECSTagBase
 {
 	GENERATED_BODY()
+};
+
+enum class EECSStorage : uint8
+{
+	Table,// Stored in archetype columns. Fastest to iterate, adding / removing moves the entity's other components
+	SparseSet,// Stored in a per-type FECSSparseSet. Adding / removing is constant time and never changes the entity's archetype
+};
+
+// Specialize next to a component or tag's USTRUCT to change where it's stored, ie
+// template<> struct TECSStorageTraits<FMyDirtyTag> { static constexpr EECSStorage Storage = EECSStorage::SparseSet; };
+template<typename T>
+struct TECSStorageTraits
+{
+	static constexpr EECSStorage Storage = EECSStorage::Table;
+};
+
+template<typename T>
+struct TIsSparseStorage
+{
+	static constexpr bool Value = TECSStorageTraits<T>::Storage == EECSStorage::SparseSet;
 };
\ No newline at end of file
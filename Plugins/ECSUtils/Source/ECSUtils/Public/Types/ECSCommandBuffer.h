@@ -0,0 +1,255 @@
+﻿
+#pragma once
+
+#include "CoreMinimal.h"
+#include "ECSSubsystem.h"
+
+/**
+ * Records structural changes to be played back later by UECSSubsystem::FlushCommandBuffers. Each thread records into its own buffer
+ * (see UECSSubsystem::GetCommandBuffer) so recording never locks. Component values are constructed into the buffer on record and
+ * bitwise relocated into their archetype on playback. Spawns return placeholder IDs so the same buffer can keep changing the new entity
+ */
+class ECSUTILS_API FECSCommandBuffer
+{
+	friend class UECSSubsystem;
+public:
+	FECSCommandBuffer() = delete;
+	explicit FECSCommandBuffer(const UECSSubsystem* Subsystem, const uint32 BufferID);
+	~FECSCommandBuffer();
+	UE_NONCOPYABLE(FECSCommandBuffer);
+
+	// Spawns an entity on playback. Params construct the components in order. Every component is default constructed if no params are given.
+	// Returns a placeholder ID that this buffer's other commands accept until the next flush. They're applied after the spawns, in recording order.
+	// The placeholder isn't valid anywhere else, including other threads' buffers and the subsystem
+	template<typename InTCompTypes, typename InTTagTypes = TTagTypes<>, typename... ParamTypes>
+	typename TEnableIf<TIsTCompTypes<InTCompTypes>::Value && TIsTTagTypes<InTTagTypes>::Value && (sizeof...(ParamTypes) == 0 || GetTypeListNum(InTCompTypes{}) == sizeof...(ParamTypes)), FEntityID>::Type SpawnEntity(ParamTypes&&... Params);
+
+	// Destroys the entity on playback. Does nothing if it has already been destroyed by then
+	void DestroyEntity(const FEntityID EntityID);
+
+	// Adds the component on playback, replacing its value if the entity already has it
+	template<typename T, typename... ParamTypes>
+	typename TEnableIf<TIsDerivedFrom<T, FECSCompBase>::Value>::Type AddComp(const FEntityID EntityID, ParamTypes&&... Params);
+
+	template<typename T>
+	typename TEnableIf<TIsDerivedFrom<T, FECSCompBase>::Value>::Type RemoveComp(const FEntityID EntityID);
+
+	// Tag changes are skipped on playback if the entity already has / lacks the tag
+	template<typename T>
+	typename TEnableIf<TIsDerivedFrom<T, FECSTagBase>::Value>::Type AddTag(const FEntityID EntityID);
+
+	template<typename T>
+	typename TEnableIf<TIsDerivedFrom<T, FECSTagBase>::Value>::Type RemoveTag(const FEntityID EntityID);
+
+	FORCEINLINE bool IsEmpty() const { return Num == 0; }
+
+	// Placeholders have an index of MIN_int32 plus the spawn's index within the buffer, and the buffer's ID as generation
+	static FORCEINLINE bool IsPlaceholder(const FEntityID EntityID) { return EntityID.GetIndex() < 0 && EntityID != FEntityID(); }
+
+private:
+	enum class ECommandType : uint8
+	{
+		Spawn,
+		Destroy,
+		AddComp,
+		RemoveComp,
+		AddTag,
+		RemoveTag,
+	};
+
+	// Commands are laid out back to back. Each is followed by NumComps FCompTypeIDs, NumComps payload offsets and NumTags FTagTypeIDs, then the component payloads
+	struct FCommand
+	{
+		FEntityID EntityID;
+		ECommandType Type;
+		bool bSparse;// Targets a sparse set stored type
+		int32 NumComps;
+		int32 NumTags;
+		int32 Size;// Bytes until the next command
+
+		FORCEINLINE FCompTypeID* GetCompIDs() { return (FCompTypeID*)(this + 1); }
+		FORCEINLINE int32* GetCompOffsets() { return (int32*)(GetCompIDs() + NumComps); }
+		FORCEINLINE FTagTypeID* GetTagIDs() { return (FTagTypeID*)(GetCompOffsets() + NumComps); }
+		FORCEINLINE uint8* GetCompData(const int32 Index) { check(Index >= 0 && Index < NumComps); return (uint8*)this + GetCompOffsets()[Index]; }
+	};
+
+	template<typename... InTCompTypes, typename... InTTagTypes, typename... ParamTypes>
+	FEntityID InternalSpawnEntity(TCompTypes<InTCompTypes...>&&, TTagTypes<InTTagTypes...>&&, ParamTypes&&... Params);
+
+	static FORCEINLINE int32 GetPlaceholderSpawnIndex(const FEntityID EntityID) { return EntityID.GetIndex() - MIN_int32; }
+	FORCEINLINE bool OwnsPlaceholder(const FEntityID EntityID) const { return IsPlaceholder(EntityID) && EntityID.GetGeneration() == BufferID && GetPlaceholderSpawnIndex(EntityID) < NumSpawns; }
+
+	// Appends a command with uninitialized payloads for the given components
+	FCommand* AddCommand(const ECommandType Type, const FEntityID EntityID, const TConstArrayView<FCompTypeID>& CompIDs, const TConstArrayView<FTagTypeID>& TagIDs);
+
+	template<typename TFunctor>
+	void ForEachCommand(TFunctor&& Functor);
+
+	// Empties the buffer. Payloads are destroyed unless playback already relocated them
+	void Reset(const bool bDestroyPayloads);
+
+	// Payloads are aligned relative to the start of the buffer
+	static constexpr int32 BUFFER_ALIGNMENT = 64;
+
+	const UECSSubsystem* Subsystem;
+	uint32 BufferID;// Unique among the subsystem's buffers. Tells placeholders from different buffers apart
+	int32 NumSpawns;// Spawns recorded since the last reset
+	uint8* Data;
+	int32 Num;
+	int32 Max;
+};
+
+/**
+ * Impl
+ */
+
+inline FECSCommandBuffer::FECSCommandBuffer(const UECSSubsystem* Subsystem, const uint32 BufferID)
+	: Subsystem(Subsystem), BufferID(BufferID), NumSpawns(0), Data(nullptr), Num(0), Max(0)
+{
+	check(Subsystem);
+}
+
+inline FECSCommandBuffer::~FECSCommandBuffer()
+{
+	Reset(true);
+	FMemory::Free(Data);
+}
+
+template<typename InTCompTypes, typename InTTagTypes, typename... ParamTypes>
+FORCEINLINE typename TEnableIf<TIsTCompTypes<InTCompTypes>::Value && TIsTTagTypes<InTTagTypes>::Value && (sizeof...(ParamTypes) == 0 || GetTypeListNum(InTCompTypes{}) == sizeof...(ParamTypes)), FEntityID>::Type FECSCommandBuffer::SpawnEntity(ParamTypes&&... Params)
+{
+	return InternalSpawnEntity(InTCompTypes{}, InTTagTypes{}, Forward<ParamTypes>(Params)...);
+}
+
+template<typename... InTCompTypes, typename... InTTagTypes, typename... ParamTypes>
+inline FEntityID FECSCommandBuffer::InternalSpawnEntity(TCompTypes<InTCompTypes...>&&, TTagTypes<InTTagTypes...>&&, ParamTypes&&... Params)
+{
+	static_assert(!TOr<TIsSparseStorage<InTCompTypes>..., TIsSparseStorage<InTTagTypes>...>::Value, "Sparse set stored types aren't part of archetypes. Record AddComp / AddTag instead!");
+
+	const FCompTypeID CompIDs[] = { Subsystem->GetCompTypeID<InTCompTypes>()... };
+
+	TArray<FTagTypeID, TInlineAllocator<8>> TagIDs;
+	if constexpr (sizeof...(InTTagTypes) != 0)
+		TagIDs = { Subsystem->GetTagTypeID<InTTagTypes>()... };
+
+	FCommand* Command = AddCommand(ECommandType::Spawn, FEntityID(), CompIDs, TagIDs);
+
+	int32 Index = 0;
+	if constexpr (sizeof...(ParamTypes) == 0)
+		(new (Command->GetCompData(Index++)) InTCompTypes(), ...);
+	else
+		(new (Command->GetCompData(Index++)) InTCompTypes{Forward<ParamTypes>(Params)}, ...);
+
+	return FEntityID(MIN_int32 + NumSpawns++, BufferID);
+}
+
+FORCEINLINE void FECSCommandBuffer::DestroyEntity(const FEntityID EntityID)
+{
+	AddCommand(ECommandType::Destroy, EntityID, {}, {});
+}
+
+template<typename T, typename... ParamTypes>
+FORCEINLINE typename TEnableIf<TIsDerivedFrom<T, FECSCompBase>::Value>::Type FECSCommandBuffer::AddComp(const FEntityID EntityID, ParamTypes&&... Params)
+{
+	const FCompTypeID CompID = Subsystem->GetCompTypeID<T>();
+	FCommand* Command = AddCommand(ECommandType::AddComp, EntityID, MakeArrayView(&CompID, 1), {});
+	Command->bSparse = TIsSparseStorage<T>::Value;
+	new (Command->GetCompData(0)) T{Forward<ParamTypes>(Params)...};
+}
+
+template<typename T>
+FORCEINLINE typename TEnableIf<TIsDerivedFrom<T, FECSCompBase>::Value>::Type FECSCommandBuffer::RemoveComp(const FEntityID EntityID)
+{
+	const FCompTypeID CompID = Subsystem->GetCompTypeID<T>();
+	AddCommand(ECommandType::RemoveComp, EntityID, MakeArrayView(&CompID, 1), {});
+}
+
+template<typename T>
+FORCEINLINE typename TEnableIf<TIsDerivedFrom<T, FECSTagBase>::Value>::Type FECSCommandBuffer::AddTag(const FEntityID EntityID)
+{
+	const FTagTypeID TagID = Subsystem->GetTagTypeID<T>();
+	AddCommand(ECommandType::AddTag, EntityID, {}, MakeArrayView(&TagID, 1))->bSparse = TIsSparseStorage<T>::Value;
+}
+
+template<typename T>
+FORCEINLINE typename TEnableIf<TIsDerivedFrom<T, FECSTagBase>::Value>::Type FECSCommandBuffer::RemoveTag(const FEntityID EntityID)
+{
+	const FTagTypeID TagID = Subsystem->GetTagTypeID<T>();
+	AddCommand(ECommandType::RemoveTag, EntityID, {}, MakeArrayView(&TagID, 1));
+}
+
+inline FECSCommandBuffer::FCommand* FECSCommandBuffer::AddCommand(const ECommandType Type, const FEntityID EntityID, const TConstArrayView<FCompTypeID>& CompIDs, const TConstArrayView<FTagTypeID>& TagIDs)
+{
+	// Lay out the command and its payloads from the current end of the buffer
+	const int32 CommandOffset = Align(Num, alignof(FCommand));
+	int32 End = CommandOffset + sizeof(FCommand) + CompIDs.Num() * (sizeof(FCompTypeID) + sizeof(int32)) + TagIDs.Num() * sizeof(FTagTypeID);
+
+	TArray<int32, TInlineAllocator<16>> CompOffsets;
+	for (const FCompTypeID& CompID : CompIDs)
+	{
+		const UScriptStruct* Type = Subsystem->GetCompDescription(CompID).Type;
+		checkf(Type->GetMinAlignment() <= BUFFER_ALIGNMENT, TEXT("Component %s is over aligned for command buffers"), *Type->GetName());
+
+		End = Align(End, Type->GetMinAlignment());
+		CompOffsets.Add(End - CommandOffset);
+		End += Type->GetStructureSize();
+	}
+
+	End = Align(End, alignof(FCommand));
+	if (End > Max)
+	{
+		// Realloc moves the recorded payloads along with their commands, which is why commands find them by offset rather than by pointer
+		Max = FMath::Max(End, Max * 2);
+		Data = (uint8*)FMemory::Realloc(Data, Max, BUFFER_ALIGNMENT);
+	}
+
+	FCommand* Command = (FCommand*)(Data + CommandOffset);
+	Command->EntityID = EntityID;
+	Command->Type = Type;
+	Command->bSparse = false;
+	Command->NumComps = CompIDs.Num();
+	Command->NumTags = TagIDs.Num();
+	Command->Size = End - CommandOffset;
+
+	if (CompIDs.Num() > 0)
+	{
+		FMemory::Memcpy(Command->GetCompIDs(), CompIDs.GetData(), CompIDs.Num() * sizeof(FCompTypeID));
+		FMemory::Memcpy(Command->GetCompOffsets(), CompOffsets.GetData(), CompOffsets.Num() * sizeof(int32));
+	}
+
+	if (TagIDs.Num() > 0)
+	{
+		FMemory::Memcpy(Command->GetTagIDs(), TagIDs.GetData(), TagIDs.Num() * sizeof(FTagTypeID));
+	}
+
+	Num = End;
+	return Command;
+}
+
+template<typename TFunctor>
+inline void FECSCommandBuffer::ForEachCommand(TFunctor&& Functor)
+{
+	for (int32 Offset = 0; Offset < Num;)
+	{
+		FCommand& Command = *(FCommand*)(Data + Offset);
+		Offset += Command.Size;
+		Functor(Command);
+	}
+}
+
+inline void FECSCommandBuffer::Reset(const bool bDestroyPayloads)
+{
+	if (bDestroyPayloads)
+	{
+		ForEachCommand([this](FCommand& Command)
+		{
+			if (Command.Type != ECommandType::Spawn && Command.Type != ECommandType::AddComp) return;
+			
+			for (int32 i = 0; i < Command.NumComps; ++i)
+				Subsystem->GetCompDescription(Command.GetCompIDs()[i]).Type->DestroyStruct(Command.GetCompData(i));
+		});
+	}
+
+	Num = 0;
+	NumSpawns = 0;
+}
\ No newline at end of file
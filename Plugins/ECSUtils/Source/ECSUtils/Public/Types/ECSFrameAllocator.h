@@ -0,0 +1,109 @@
+﻿
+#pragma once
+
+#include "CoreMinimal.h"
+
+/**
+ * Per-thread linear arena rewound once per frame. Allocating is a pointer bump with no synchronization and nothing is ever freed individually.
+ * Each thread rewinds its own pages on its first allocation after the frame advanced, so memory is valid until the end of the frame it was
+ * allocated in. Never keep frame allocations alive across frames
+ */
+class ECSUTILS_API FECSFrameArena
+{
+public:
+	static constexpr SIZE_T PAGE_SIZE = 64 * 1024;
+	static constexpr uint32 PAGE_ALIGNMENT = 64;
+
+	static void* Allocate(const SIZE_T Size, const uint32 Alignment);
+
+	// Called at the end of every frame on the game thread
+	static void AdvanceFrame();
+
+	static uint32 GetFrameSerial();
+};
+
+/**
+ * Allocator policy backed by FECSFrameArena for transient per-frame containers, e.g. TArray<FEvent, FECSFrameAllocator>. Growing copies into a new
+ * arena block and shrinking is a no-op, so these containers never hit the global allocator
+ */
+class FECSFrameAllocator
+{
+public:
+	using SizeType = int32;
+
+	enum { NeedsElementType = true };
+	enum { RequireRangeCheck = true };
+
+	template<typename ElementType>
+	class ForElementType
+	{
+	public:
+		FORCEINLINE ForElementType() : Data(nullptr), FrameSerial(0) {}
+
+		ForElementType(const ForElementType&) = delete;
+		ForElementType& operator=(const ForElementType&) = delete;
+
+		FORCEINLINE ElementType* GetAllocation() const { return Data; }
+
+		void ResizeAllocation(const SizeType PreviousNumElements, const SizeType NumElements, const SIZE_T NumBytesPerElement)
+		{
+			checkf(!Data || FrameSerial == FECSFrameArena::GetFrameSerial(), TEXT("FECSFrameAllocator: Allocation was kept alive past the frame it was allocated in!"));
+			if (NumElements == 0)
+			{
+				Data = nullptr;
+				return;
+			}
+
+			ElementType* OldData = Data;
+			Data = (ElementType*)FECSFrameArena::Allocate(NumElements * NumBytesPerElement, alignof(ElementType));
+			FrameSerial = FECSFrameArena::GetFrameSerial();
+			if (OldData && PreviousNumElements > 0)
+			{
+				FMemory::Memcpy(Data, OldData, FMath::Min(PreviousNumElements, NumElements) * NumBytesPerElement);
+			}
+		}
+
+		FORCEINLINE SizeType CalculateSlackReserve(const SizeType NumElements, const SIZE_T NumBytesPerElement) const
+		{
+			return NumElements;
+		}
+
+		// Arena memory is only reclaimed at the end of the frame so there's nothing to gain from shrinking
+		FORCEINLINE SizeType CalculateSlackShrink(const SizeType NumElements, const SizeType NumAllocatedElements, const SIZE_T NumBytesPerElement) const
+		{
+			return NumAllocatedElements;
+		}
+
+		FORCEINLINE SizeType CalculateSlackGrow(const SizeType NumElements, const SizeType NumAllocatedElements, const SIZE_T NumBytesPerElement) const
+		{
+			return DefaultCalculateSlackGrow(NumElements, NumAllocatedElements, NumBytesPerElement, false);
+		}
+
+		FORCEINLINE SIZE_T GetAllocatedSize(const SizeType NumAllocatedElements, const SIZE_T NumBytesPerElement) const
+		{
+			return NumAllocatedElements * NumBytesPerElement;
+		}
+
+		FORCEINLINE bool HasAllocation() const { return !!Data; }
+		FORCEINLINE SizeType GetInitialCapacity() const { return 0; }
+
+		FORCEINLINE void MoveToEmpty(ForElementType& Other)
+		{
+			check(this != &Other);
+			Data = Other.Data;
+			FrameSerial = Other.FrameSerial;
+			Other.Data = nullptr;
+		}
+
+	private:
+		ElementType* Data;
+		uint32 FrameSerial;// Frame Data was allocated in
+	};
+
+	typedef void ForAnyElementType;
+};
+
+template<>
+struct TAllocatorTraits<FECSFrameAllocator> : TAllocatorTraitsBase<FECSFrameAllocator>
+{
+};
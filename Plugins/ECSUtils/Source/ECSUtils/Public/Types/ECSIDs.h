@@ -25,11 +25,19 @@
 	FORCEINLINE constexpr explicit operator T() const { return (T)ID; } \
 	SizeType ID;
 
+// Low 32 bits index the entity record, high 32 bits hold the generation of that record slot. Handles to destroyed entities stay invalid after their slot is reused.
+// Generations are unsigned and wrap around after 2^32 reuses of one slot, at which point a handle that old would be considered valid again. That's accepted
 USTRUCT(BlueprintType)
 struct ECSUTILS_API FEntityID
 {
 	GENERATED_BODY()
 	DEFINE_ECS_ID_TYPE(FEntityID, int64);
+
+	FORCEINLINE constexpr explicit FEntityID(const int32 Index, const uint32 Generation) noexcept
+		: ID((int64)(uint32)Index | (int64)((uint64)Generation << 32)) {}
+
+	FORCEINLINE constexpr int32 GetIndex() const { return (int32)(uint32)ID; }
+	FORCEINLINE constexpr uint32 GetGeneration() const { return (uint32)((uint64)ID >> 32); }
 };
 
 USTRUCT(BlueprintType)
@@ -51,4 +59,11 @@ struct ECSUTILS_API FArchetypeID
 {
 	GENERATED_BODY()
 	DEFINE_ECS_ID_TYPE(FArchetypeID, int32);
+};
+
+USTRUCT(BlueprintType)
+struct ECSUTILS_API FQueryID
+{
+	GENERATED_BODY()
+	DEFINE_ECS_ID_TYPE(FQueryID, int32);
 };
\ No newline at end of file
@@ -0,0 +1,173 @@
+﻿
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Types/ECSIDs.h"
+#include "Types/ECSStructReferences.h"
+
+/**
+ * Paged sparse set storing one type's components (or tag membership) keyed by entity index. Adding and removing never moves the entity between
+ * archetypes, so frequently toggled types don't fragment the archetype space. Values are kept dense and swap-removed with a memcpy
+ */
+class ECSUTILS_API FECSSparseSet
+{
+public:
+	FECSSparseSet() = delete;
+	explicit FECSSparseSet(const UScriptStruct* Type);// Null Type stores membership only, ie for tags
+	~FECSSparseSet();
+	UE_NONCOPYABLE(FECSSparseSet);
+
+	FORCEINLINE int32 Num() const { return DenseEntities.Num(); }
+	FORCEINLINE const UScriptStruct* GetType() const { return Type; }
+
+	// Returns INDEX_NONE if the entity isn't in the set
+	int32 FindDenseIndex(const int32 EntityIndex) const;
+	FORCEINLINE bool Contains(const int32 EntityIndex) const { return FindDenseIndex(EntityIndex) != INDEX_NONE; }
+
+	// Returns null if the entity isn't in the set or the set has no type
+	uint8* Find(const int32 EntityIndex) const;
+
+	FORCEINLINE FEntityID GetEntity(const int32 DenseIndex) const { return DenseEntities[DenseIndex]; }
+	uint8* GetData(const int32 DenseIndex) const;
+
+	// Adds the entity with an uninitialized value which must be constructed by the caller. Returns null if the set has no type
+	uint8* AddUninitialized(const FEntityID EntityID);
+
+	// Destroys the entity's value and moves the last value into its place. Returns false if the entity isn't in the set
+	bool Remove(const int32 EntityIndex);
+
+	void Empty();
+
+	void AddReferencedObjects(FReferenceCollector& Collector);
+
+private:
+	// Entity indices per sparse page. Pages are allocated on first use
+	static constexpr int32 PAGE_SIZE = 4096;
+
+	int32& GetSparseSlot(const int32 EntityIndex);
+
+	const UScriptStruct* Type;
+	int32 Stride;// Aligned size of Type. 0 without a type
+	
+	TArray<int32*> Pages;// Dense index of each entity index. INDEX_NONE if not in the set
+	TArray<FEntityID> DenseEntities;
+	uint8* Data;// Dense values, one per DenseEntities element
+	int32 Max;
+};
+
+/**
+ * Impl
+ */
+
+inline FECSSparseSet::FECSSparseSet(const UScriptStruct* Type)
+	: Type(Type), Stride(Type ? Align(Type->GetStructureSize(), Type->GetMinAlignment()) : 0), Data(nullptr), Max(0)
+{
+	
+}
+
+inline FECSSparseSet::~FECSSparseSet()
+{
+	Empty();
+}
+
+UE_NODISCARD FORCEINLINE int32 FECSSparseSet::FindDenseIndex(const int32 EntityIndex) const
+{
+	check(EntityIndex >= 0);
+	const int32 PageIndex = EntityIndex / PAGE_SIZE;
+	return PageIndex < Pages.Num() && Pages[PageIndex] ? Pages[PageIndex][EntityIndex % PAGE_SIZE] : INDEX_NONE;
+}
+
+UE_NODISCARD FORCEINLINE uint8* FECSSparseSet::Find(const int32 EntityIndex) const
+{
+	const int32 DenseIndex = FindDenseIndex(EntityIndex);
+	return DenseIndex != INDEX_NONE && Stride > 0 ? Data + DenseIndex * Stride : nullptr;
+}
+
+UE_NODISCARD FORCEINLINE uint8* FECSSparseSet::GetData(const int32 DenseIndex) const
+{
+	check(DenseEntities.IsValidIndex(DenseIndex));
+	return Stride > 0 ? Data + DenseIndex * Stride : nullptr;
+}
+
+FORCEINLINE int32& FECSSparseSet::GetSparseSlot(const int32 EntityIndex)
+{
+	const int32 PageIndex = EntityIndex / PAGE_SIZE;
+	if (PageIndex >= Pages.Num())
+	{
+		Pages.SetNumZeroed(PageIndex + 1);
+	}
+
+	if (!Pages[PageIndex])
+	{
+		// INDEX_NONE is all bits set
+		Pages[PageIndex] = (int32*)FMemory::Malloc(PAGE_SIZE * sizeof(int32));
+		FMemory::Memset(Pages[PageIndex], 0xFF, PAGE_SIZE * sizeof(int32));
+	}
+
+	return Pages[PageIndex][EntityIndex % PAGE_SIZE];
+}
+
+inline uint8* FECSSparseSet::AddUninitialized(const FEntityID EntityID)
+{
+	int32& Slot = GetSparseSlot(EntityID.GetIndex());
+	checkf(Slot == INDEX_NONE, TEXT("Entity %i is already in the sparse set!"), EntityID.GetIndex());
+
+	Slot = DenseEntities.Add(EntityID);
+	if (Stride == 0) return nullptr;
+
+	if (Slot >= Max)
+	{
+		Max = FMath::Max(Max * 2, 16);
+		Data = (uint8*)FMemory::Realloc(Data, Max * Stride, Type->GetMinAlignment());
+	}
+
+	return Data + Slot * Stride;
+}
+
+inline bool FECSSparseSet::Remove(const int32 EntityIndex)
+{
+	const int32 DenseIndex = FindDenseIndex(EntityIndex);
+	if (DenseIndex == INDEX_NONE) return false;
+
+	const int32 LastIndex = DenseEntities.Num() - 1;
+	if (Stride > 0)
+	{
+		Type->DestroyStruct(Data + DenseIndex * Stride);
+		if (DenseIndex != LastIndex)
+		{
+			FMemory::Memcpy(Data + DenseIndex * Stride, Data + LastIndex * Stride, Stride);
+		}
+	}
+
+	if (DenseIndex != LastIndex)
+	{
+		GetSparseSlot(DenseEntities[LastIndex].GetIndex()) = DenseIndex;
+	}
+
+	GetSparseSlot(EntityIndex) = INDEX_NONE;
+	DenseEntities.RemoveAtSwap(DenseIndex, 1, false);
+	return true;
+}
+
+inline void FECSSparseSet::Empty()
+{
+	if (Stride > 0)
+	{
+		Type->DestroyStruct(Data, DenseEntities.Num());
+	}
+
+	for (int32* Page : Pages)
+		FMemory::Free(Page);
+
+	FMemory::Free(Data);
+	Pages.Empty();
+	DenseEntities.Empty();
+	Data = nullptr;
+	Max = 0;
+}
+
+inline void FECSSparseSet::AddReferencedObjects(FReferenceCollector& Collector)
+{
+	if (Stride == 0 || DenseEntities.IsEmpty()) return;
+	FECSStructReferences::Get(Type).AddReferencedObjects(Data, DenseEntities.Num(), Stride, Collector);
+}
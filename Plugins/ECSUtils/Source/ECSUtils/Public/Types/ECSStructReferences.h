@@ -0,0 +1,68 @@
+﻿
+#pragma once
+
+#include "CoreMinimal.h"
+#include "UObject/UnrealType.h"
+
+/**
+ * Cached offsets of the UObject references inside a struct, flattened through nested structs and static arrays. Built once per type so GC
+ * reports references with a flat offset loop instead of walking properties per element, and skips types without references entirely.
+ * Nested structs with a native AddStructReferencedObjects (ie FAnyStruct members) are recorded by offset and called alongside
+ */
+class ECSUTILS_API FECSStructReferences
+{
+public:
+	// Thread safe. GC may report references from multiple threads
+	static const FECSStructReferences& Get(const UScriptStruct* Type);
+
+	// Drops every cached schema. Schemas are keyed by struct address, which a reinstanced struct may reuse after a reload.
+	// Game thread only, outside of GC
+	static void Reset();
+
+	FORCEINLINE bool HasReferences() const { return bHasReferences; }
+
+	// Reports the references of a single struct value
+	FORCEINLINE void AddReferencedObjects(void* Item, FReferenceCollector& Collector) const
+	{
+		for (const FNativeAdd& NativeAdd : NativeAdds)
+			NativeAdd.Func((uint8*)Item + NativeAdd.Offset, Collector);
+
+		if (bNeedsPropertyWalk)
+		{
+			AddReferencedObjectsByProperties(Item, Collector);
+			return;
+		}
+
+		for (const int32 Offset : ObjectOffsets)
+			Collector.AddReferencedObject(*(UObject**)((uint8*)Item + Offset));
+	}
+
+	// Reports the references of Num values laid out Stride bytes apart
+	FORCEINLINE void AddReferencedObjects(void* Items, const int32 Num, const int32 Stride, FReferenceCollector& Collector) const
+	{
+		if (!bHasReferences) return;
+
+		for (int32 i = 0; i < Num; ++i)
+			AddReferencedObjects((uint8*)Items + i * Stride, Collector);
+	}
+
+private:
+	explicit FECSStructReferences(const UScriptStruct* Type);
+
+	void AddStructOffsets(const UStruct* Struct, const int32 BaseOffset, TArray<const FStructProperty*>& EncounteredStructProps);
+
+	// Slow path. Reports every object property and native nested struct reachable through the properties, including inside containers
+	void AddReferencedObjectsByProperties(void* Item, FReferenceCollector& Collector) const;
+
+	struct FNativeAdd
+	{
+		int32 Offset;
+		UScriptStruct::ICppStructOps::TPointerToAddStructReferencedObjects Func;
+	};
+
+	const UScriptStruct* Type;
+	TArray<int32> ObjectOffsets;// Offsets of every FObjectProperty value from the start of the struct
+	TArray<FNativeAdd> NativeAdds;// The struct's own native AddStructReferencedObjects, then nested ones unless walking properties
+	bool bNeedsPropertyWalk;// References inside containers (TArray, TMap...) can't be flattened to offsets so fall back to iterating properties
+	bool bHasReferences;
+};
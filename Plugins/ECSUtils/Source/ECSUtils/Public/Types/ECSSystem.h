@@ -0,0 +1,103 @@
+﻿
+#pragma once
+
+#include "CoreMinimal.h"
+
+class UECSSubsystem;
+
+// Points in the world tick at which registered systems run
+enum class EECSSystemPhase : uint8
+{
+	PreActorTick,
+	PostActorTick,
+	Num,
+};
+
+/**
+ * A unit of per-frame work over a query. Systems within a phase run concurrently unless their component accesses conflict
+ */
+class ECSUTILS_API FECSSystem
+{
+public:
+	FECSSystem() = delete;
+	FORCEINLINE explicit FECSSystem(const FName Name) : Name(Name) {}
+	virtual ~FECSSystem() = default;
+
+	virtual void Execute(const float DeltaTime) = 0;
+
+	// Whether running both systems concurrently could race on a component
+	bool ConflictsWith(const FECSSystem& Other) const;
+
+	FORCEINLINE FName GetName() const { return Name; }
+
+protected:
+	static bool Intersects(const TBitArray<>& A, const TBitArray<>& B);
+
+	FName Name;
+	TBitArray<> ReadSignature;// Components read. Index via FCompTypeID
+	TBitArray<> WriteSignature;// Components written. Index via FCompTypeID
+};
+
+template<typename QueryType, typename FunctorType>
+class TECSQuerySystem final : public FECSSystem
+{
+public:
+	template<typename InFunctorType>
+	FORCEINLINE explicit TECSQuerySystem(const FName Name, const UECSSubsystem* Subsystem, InFunctorType&& InFunctor)
+		: FECSSystem(Name), Query(Subsystem), Functor(Forward<InFunctorType>(InFunctor))
+	{
+		Query.GetAccessSignatures(ReadSignature, WriteSignature);
+	}
+
+	virtual void Execute(const float DeltaTime) override
+	{
+		Functor(Query, DeltaTime);
+	}
+
+private:
+	QueryType Query;
+	FunctorType Functor;
+};
+
+// Systems registered to a phase plus the dependency graph derived from their component accesses
+struct FECSSystemPhase
+{
+	void BuildGraph();
+
+	TArray<TUniquePtr<FECSSystem>> Systems;// Conflicting systems run in registration order
+	TArray<TArray<int32>> Prerequisites;// Index via system. Earlier systems that conflict with it
+	bool bGraphDirty = false;
+};
+
+/**
+ * Impl
+ */
+
+inline bool FECSSystem::Intersects(const TBitArray<>& A, const TBitArray<>& B)
+{
+	const int32 NumWords = FMath::DivideAndRoundUp(FMath::Min(A.Num(), B.Num()), NumBitsPerDWORD);
+	for (int32 i = 0; i < NumWords; ++i)
+		if (A.GetData()[i] & B.GetData()[i])
+			return true;
+
+	return false;
+}
+
+FORCEINLINE bool FECSSystem::ConflictsWith(const FECSSystem& Other) const
+{
+	return Intersects(WriteSignature, Other.WriteSignature) || Intersects(WriteSignature, Other.ReadSignature) || Intersects(ReadSignature, Other.WriteSignature);
+}
+
+inline void FECSSystemPhase::BuildGraph()
+{
+	Prerequisites.Reset(Systems.Num());
+	for (int32 i = 0; i < Systems.Num(); ++i)
+	{
+		TArray<int32>& SystemPrerequisites = Prerequisites.AddDefaulted_GetRef();
+		for (int32 j = 0; j < i; ++j)
+			if (Systems[i]->ConflictsWith(*Systems[j]))
+				SystemPrerequisites.Add(j);
+	}
+
+	bGraphDirty = false;
+}
\ No newline at end of file
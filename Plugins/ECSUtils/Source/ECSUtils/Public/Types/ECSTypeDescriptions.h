@@ -16,6 +16,16 @@ struct FArchetypeEntityRecord
 	int32 ColumnIndex;
 };
 
+// Hashes archetype / query signatures. Signatures are bitmasks of component IDs followed by tag IDs (offset by the number of registered components)
+template<typename ValueType>
+struct TSignatureKeyFuncs : TDefaultMapHashableKeyFuncs<TBitArray<>, ValueType, false>
+{
+	static FORCEINLINE uint32 GetKeyHash(const TBitArray<>& Key)
+	{
+		return FCrc::MemCrc32(Key.GetData(), FMath::DivideAndRoundUp(Key.Num(), NumBitsPerDWORD) * sizeof(uint32));
+	}
+};
+
 struct FArchetypeCompRecord
 {
 	FArchetypeCompRecord() = delete;
@@ -26,15 +36,35 @@ struct FArchetypeCompRecord
 	int32 RowIndex;
 };
 
+// Cached list of archetypes matching a query signature. New archetypes are pushed to it as they are created
+struct FQueryDescription
+{
+	FQueryDescription() = delete;
+	FORCEINLINE explicit FQueryDescription(const TBitArray<>& RequiredSignature, const TBitArray<>& ExcludedSignature, const TBitArray<>& AnyOfSignature, const TBitArray<>& RowSignature, const int32 NumComps)
+		: RequiredSignature(RequiredSignature), ExcludedSignature(ExcludedSignature), AnyOfSignature(AnyOfSignature), RowSignature(RowSignature), NumComps(NumComps) {}
+
+	FORCEINLINE const int32* GetRowIndices(const int32 MatchIndex) const { return RowIndices.GetData() + MatchIndex * NumComps; }
+	FORCEINLINE int32 FindMatchIndex(const FArchetypeID ArchetypeID) const { return MatchIndices.IsValidIndex(ArchetypeID.ToInt()) ? MatchIndices[ArchetypeID.ToInt()] : INDEX_NONE; }
+
+	TBitArray<> RequiredSignature;
+	TBitArray<> ExcludedSignature;// Empty if nothing is excluded
+	TBitArray<> AnyOfSignature;// Empty if there's no any-of filter
+	TBitArray<> RowSignature;// Required and optional components
+	int32 NumComps;// Number of components in RowSignature
+	TArray<FArchetypeID> MatchingArchetypes;
+	TArray<int32> MatchIndices;// Index into MatchingArchetypes, INDEX_NONE if not matching. Index via FArchetypeID
+	TArray<int32> RowIndices;// NumComps rows per matching archetype, ordered by FCompTypeID. INDEX_NONE for missing optional components
+};
+
 USTRUCT()
 struct ECSUTILS_API FCompDescription
 {
 	GENERATED_BODY()
 
 	FCompDescription() = delete;
-	FORCEINLINE explicit FCompDescription(EForceInit) : Type(nullptr) {}
-	FORCEINLINE explicit FCompDescription(const UScriptStruct* Type)
-		: Type(Type)
+	FORCEINLINE explicit FCompDescription(EForceInit) : Type(nullptr), Storage(EECSStorage::Table) {}
+	FORCEINLINE explicit FCompDescription(const UScriptStruct* Type, const EECSStorage Storage)
+		: Type(Type), Storage(Storage)
 	{
 		check(Type);
 		check(Type->IsChildOf(FECSCompBase::StaticStruct()));
@@ -43,7 +73,10 @@ struct ECSUTILS_API FCompDescription
 	UPROPERTY()
 	const UScriptStruct* Type;
 
+	EECSStorage Storage;
+
 	TArray<FArchetypeCompRecord> ReferencedArchetypes;
+	TArray<FQueryID> ReferencedQueries;// Queries requiring this component
 };
 
 template<>
@@ -61,9 +94,9 @@ struct ECSUTILS_API FTagDescription
 	GENERATED_BODY()
 
 	FTagDescription() = delete;
-	FORCEINLINE explicit FTagDescription(EForceInit) : Type(nullptr) {}
-	FORCEINLINE explicit FTagDescription(const UScriptStruct* Type)
-		: Type(Type)
+	FORCEINLINE explicit FTagDescription(EForceInit) : Type(nullptr), Storage(EECSStorage::Table) {}
+	FORCEINLINE explicit FTagDescription(const UScriptStruct* Type, const EECSStorage Storage)
+		: Type(Type), Storage(Storage)
 	{
 		check(Type);
 		check(Type->IsChildOf(FECSTagBase::StaticStruct()));
@@ -72,7 +105,10 @@ struct ECSUTILS_API FTagDescription
 	UPROPERTY()
 	const UScriptStruct* Type;
 
+	EECSStorage Storage;
+
 	TArray<FArchetypeCompRecord> ReferencedArchetypes;
+	TArray<FQueryID> ReferencedQueries;// Queries requiring this tag
 };
 
 template<>
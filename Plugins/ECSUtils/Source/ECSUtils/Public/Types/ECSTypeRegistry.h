@@ -0,0 +1,68 @@
+﻿
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Types/ECSBaseTypes.h"
+
+/**
+ * Process-wide list of component and tag types shared by every world. Types are queued through ECS_REGISTER_TYPE during static initialization
+ * and resolved in one batch on the next world initialization, so worlds never walk every UScriptStruct. Reloaded modules queue their types again
+ * and replace the stale entries in place so existing type IDs stay stable
+ */
+class ECSUTILS_API FECSTypeRegistry
+{
+public:
+	using FStaticStructFunc = UScriptStruct*(*)();
+
+	static FECSTypeRegistry& Get();
+
+	// Safe to call during static initialization. The struct isn't resolved until ProcessPendingTypes
+	FORCEINLINE void AddPendingType(const FStaticStructFunc StaticStructFunc, const EECSStorage Storage) { PendingTypes.Add({ StaticStructFunc, Storage }); }
+
+	// Resolves queued types. New types are appended so existing IDs never change. Game thread only
+	void ProcessPendingTypes();
+
+	// Index into GetCompTypes() or GetTagTypes(). INDEX_NONE if not registered
+	FORCEINLINE int32 FindTypeIndex(const UScriptStruct* Type) const
+	{
+		const int32* Index = TypeIndices.Find(Type);
+		return Index ? *Index : INDEX_NONE;
+	}
+
+	FORCEINLINE const TArray<const UScriptStruct*>& GetCompTypes() const { return CompTypes; }
+	FORCEINLINE const TArray<const UScriptStruct*>& GetTagTypes() const { return TagTypes; }
+
+	// Storage of each type in GetCompTypes() / GetTagTypes(), captured from its TECSStorageTraits at registration
+	FORCEINLINE const TArray<EECSStorage>& GetCompStorages() const { return CompStorages; }
+	FORCEINLINE const TArray<EECSStorage>& GetTagStorages() const { return TagStorages; }
+	FORCEINLINE bool HasPendingTypes() const { return !PendingTypes.IsEmpty(); }
+
+private:
+	FECSTypeRegistry() = default;
+
+	struct FPendingType
+	{
+		FStaticStructFunc StaticStructFunc;
+		EECSStorage Storage;
+	};
+
+	TArray<FPendingType> PendingTypes;
+	TArray<const UScriptStruct*> CompTypes;
+	TArray<const UScriptStruct*> TagTypes;
+	TArray<EECSStorage> CompStorages;// Index via CompTypes
+	TArray<EECSStorage> TagStorages;// Index via TagTypes
+	TMap<const UScriptStruct*, int32> TypeIndices;// Index into CompTypes or TagTypes
+	TMap<FName, int32> TypePathIndices;// Index into CompTypes or TagTypes. Matches reloaded structs to their previous entry
+};
+
+struct FECSTypeRegistrar
+{
+	FORCEINLINE explicit FECSTypeRegistrar(const FECSTypeRegistry::FStaticStructFunc StaticStructFunc, const EECSStorage Storage)
+	{
+		FECSTypeRegistry::Get().AddPendingType(StaticStructFunc, Storage);
+	}
+};
+
+// Registers a component or tag type with every world. Place once in a .cpp at namespace scope, e.g. ECS_REGISTER_TYPE(FMyComp).
+// Any TECSStorageTraits specialization for the type must be visible here, its storage is recorded with the type
+#define ECS_REGISTER_TYPE(Type) static const FECSTypeRegistrar PREPROCESSOR_JOIN(GECSTypeRegistrar_, Type)(&Type::StaticStruct, TECSStorageTraits<Type>::Storage);
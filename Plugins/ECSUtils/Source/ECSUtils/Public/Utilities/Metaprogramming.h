@@ -17,6 +17,32 @@ class TWrites : public TTypeList<Ts...> { static_assert(TAnd<TIsDerivedFrom<Ts,
 template<typename... Ts>
 class TTagTypes : public TTypeList<Ts...> { static_assert(TAnd<TIsDerivedFrom<Ts, FECSTagBase>...>::Value, "TTagTypes: All template arguments must be derived from FECSTagBase!"); };
 
+// Query filter passing only chunks where any of the components were written since the query last ran
+template<typename... Ts>
+class TChanged : public TTypeList<Ts...> { static_assert(TAnd<TIsDerivedFrom<Ts, FECSCompBase>...>::Value, "TChanged: All template arguments must be derived from FECSCompBase!"); };
+
+// Query filter rejecting archetypes with any of the components or tags
+template<typename... Ts>
+class TWithout : public TTypeList<Ts...> { static_assert(TAnd<TOr<TIsDerivedFrom<Ts, FECSCompBase>, TIsDerivedFrom<Ts, FECSTagBase>>...>::Value, "TWithout: All template arguments must be derived from FECSCompBase or FECSTagBase!"); };
+
+// Query filter requiring archetypes to have at least one of the components or tags
+template<typename... Ts>
+class TAnyOf : public TTypeList<Ts...> { static_assert(TAnd<TOr<TIsDerivedFrom<Ts, FECSCompBase>, TIsDerivedFrom<Ts, FECSTagBase>>...>::Value, "TAnyOf: All template arguments must be derived from FECSCompBase or FECSTagBase!"); };
+
+// Query filter passing a nullable const pointer to each component. Named to avoid clashing with the engine's TOptional
+template<typename... Ts>
+class TOptionalComps : public TTypeList<Ts...> { static_assert(TAnd<TIsDerivedFrom<Ts, FECSCompBase>...>::Value, "TOptionalComps: All template arguments must be derived from FECSCompBase!"); };
+
+// Finds the filter instantiated from FilterTemplate within FilterTypes. Defaults to an empty FilterTemplate<>
+template<template<typename...> class FilterTemplate, typename... FilterTypes>
+struct TFindFilter { using Type = FilterTemplate<>; };
+
+template<template<typename...> class FilterTemplate, typename... Ts, typename... OtherFilterTypes>
+struct TFindFilter<FilterTemplate, FilterTemplate<Ts...>, OtherFilterTypes...> { using Type = FilterTemplate<Ts...>; };
+
+template<template<typename...> class FilterTemplate, typename FilterType, typename... OtherFilterTypes>
+struct TFindFilter<FilterTemplate, FilterType, OtherFilterTypes...> : TFindFilter<FilterTemplate, OtherFilterTypes...> {};
+
 template<typename T> struct TIsTCompTypes { static constexpr bool Value = false; };
 template<typename... Ts> struct TIsTCompTypes<TCompTypes<Ts...>> { static constexpr bool Value = true; };
 
@@ -24,4 +50,7 @@ template<typename T> struct TIsTTagTypes { static constexpr bool Value = false;
 template<typename... Ts> struct TIsTTagTypes<TTagTypes<Ts...>> { static constexpr bool Value = true; };
 
 template<typename... Ts>
-FORCEINLINE constexpr SIZE_T GetTypeListNum(TTypeList<Ts...>&&) { return sizeof...(Ts); }
\ No newline at end of file
+FORCEINLINE constexpr SIZE_T GetTypeListNum(TTypeList<Ts...>&&) { return sizeof...(Ts); }
+
+template<typename... Ts>
+FORCEINLINE constexpr bool HasSparseStorageType(TTypeList<Ts...>&&) { return TOr<TIsSparseStorage<Ts>...>::Value; }
\ No newline at end of file